@@ -8,6 +8,13 @@ struct app_state_t {
     bool is_initialized;
 
     bool end_execution;
+
+    // Set by update_and_render() when nothing is animating and there is no
+    // dirty state. The platform layer will then block until new input arrives
+    // or until wakeup_ms milliseconds have elapsed (if wakeup_ms > 0).
+    bool idle;
+    float wakeup_ms;
+
     struct gui_state_t gui_st;
 
     mem_pool_t memory;
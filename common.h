@@ -1301,6 +1301,21 @@ void print_u64_array (uint64_t *arr, int n)
     printf ("%"PRIu64"]\n", arr[i]);
 }
 
+// 64 bit FNV-1a hash. To hash several pieces of data pass the result of the
+// previous call as _hash_, start with FNV1A_64_OFFSET.
+#define FNV1A_64_OFFSET 14695981039346656037ULL
+#define FNV1A_64_PRIME 1099511628211ULL
+uint64_t fnv1a_64 (uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t*)data;
+    size_t i;
+    for (i=0; i<len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV1A_64_PRIME;
+    }
+    return hash;
+}
+
 void print_line (const char *sep, int len)
 {
     int w = strlen(sep);
@@ -1520,17 +1535,29 @@ void* cont_buff_push (cont_buff_t *buff, int size)
         void *new_data;
         if (buff->size == 0) {
             int new_size = MAX (CONT_BUFF_MIN_SIZE, buff->min_size);
+            while (buff->used + size >= new_size) {
+                new_size *= 2;
+            }
+
             if ((buff->data = malloc (new_size))) {
                 buff->size = new_size;
             } else {
                 printf ("Malloc failed.\n");
+                return NULL;
             }
-        } else if ((new_data = realloc (buff->data, 2*buff->size))) {
-            buff->data = new_data;
-            buff->size = 2*buff->size;
         } else {
-            printf ("Error: Realloc failed.\n");
-            return NULL;
+            uint32_t new_size = 2*buff->size;
+            while (buff->used + size >= new_size) {
+                new_size *= 2;
+            }
+
+            if ((new_data = realloc (buff->data, new_size))) {
+                buff->data = new_data;
+                buff->size = new_size;
+            } else {
+                printf ("Error: Realloc failed.\n");
+                return NULL;
+            }
         }
     }
 
@@ -1856,9 +1883,7 @@ bool ensure_dir_exists (char *path)
     }
 
     if (success == -1) {
-        char *expl = strerror (errno);
-        printf ("Could not create %s: %s\n", dir_path, expl);
-        free (expl);
+        printf ("Could not create %s: %s\n", dir_path, strerror (errno));
         retval = false;
     }
 
@@ -1981,6 +2006,113 @@ void end_mutex (volatile int *lock) {
     *lock = 0;
 }
 
+// Lock free ring buffer for a single producer thread and a single consumer
+// thread. Elements are copied in and out, capacity must be a power of 2.
+//
+// NOTE: head and tail are free running counters, they are only reduced modulo
+// the capacity when indexing into data.
+struct spsc_ring_t {
+    uint32_t element_size;
+    uint32_t capacity;
+    char *data;
+
+    // Only written by the producer.
+    uint32_t head __attribute__((aligned(64)));
+    // Only written by the consumer.
+    uint32_t tail __attribute__((aligned(64)));
+};
+
+void spsc_ring_init (struct spsc_ring_t *ring, mem_pool_t *pool,
+                     uint32_t element_size, uint32_t capacity)
+{
+    assert ((capacity & (capacity-1)) == 0 && "Capacity must be a power of 2.");
+    ring->element_size = element_size;
+    ring->capacity = capacity;
+    ring->data = (char*)mem_pool_push_size (pool, element_size*capacity);
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+// Returns false if the ring is full.
+bool spsc_ring_push (struct spsc_ring_t *ring, void *element)
+{
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == ring->capacity) {
+        return false;
+    }
+
+    memcpy (ring->data + (head & (ring->capacity-1))*ring->element_size,
+            element, ring->element_size);
+    __atomic_store_n (&ring->head, head+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Returns false if the ring is empty.
+bool spsc_ring_pop (struct spsc_ring_t *ring, void *element)
+{
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return false;
+    }
+
+    memcpy (element, ring->data + (tail & (ring->capacity-1))*ring->element_size,
+            ring->element_size);
+    __atomic_store_n (&ring->tail, tail+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Lock free triple buffer. A producer thread publishes values of some
+// structure and a consumer thread reads the latest one published, older
+// values that were never read are dropped. Neither side ever waits for the
+// other.
+//
+// The producer owns one buffer, the consumer owns another one and the third
+// one is exchanged atomically between them. Bit 2 of _middle_ is set when the
+// middle buffer contains a value the consumer has not seen yet.
+#define TRIPLE_BUFFER_NEW_DATA 0x4
+struct triple_buffer_t {
+    uint32_t size;
+    char *buffers[3];
+
+    int write_idx;
+    int read_idx;
+    int middle;
+};
+
+void triple_buffer_init (struct triple_buffer_t *tb, mem_pool_t *pool, uint32_t size)
+{
+    tb->size = size;
+    int i;
+    for (i=0; i<3; i++) {
+        tb->buffers[i] = (char*)mem_pool_push_size_full (pool, size, POOL_ZERO_INIT);
+    }
+    tb->write_idx = 0;
+    tb->middle = 1;
+    tb->read_idx = 2;
+}
+
+// Called from the producer thread.
+void triple_buffer_write (struct triple_buffer_t *tb, void *value)
+{
+    memcpy (tb->buffers[tb->write_idx], value, tb->size);
+    int prev = __atomic_exchange_n (&tb->middle, tb->write_idx|TRIPLE_BUFFER_NEW_DATA,
+                                    __ATOMIC_ACQ_REL);
+    tb->write_idx = prev & ~TRIPLE_BUFFER_NEW_DATA;
+}
+
+// Called from the consumer thread. Returns the latest published value, the
+// pointer is valid until the next call.
+void* triple_buffer_read (struct triple_buffer_t *tb)
+{
+    if (__atomic_load_n (&tb->middle, __ATOMIC_ACQUIRE) & TRIPLE_BUFFER_NEW_DATA) {
+        int prev = __atomic_exchange_n (&tb->middle, tb->read_idx, __ATOMIC_ACQ_REL);
+        tb->read_idx = prev & ~TRIPLE_BUFFER_NEW_DATA;
+    }
+    return tb->buffers[tb->read_idx];
+}
+
 
 #define COMMON_H
 #endif
@@ -0,0 +1,49 @@
+#version 430 core
+
+// A-buffer, every fragment is appended to a linked list of its sample. Nodes
+// are allocated from fragments[] with an atomic counter and the head of each
+// list is swapped atomically in head_pointers. The lists are sorted and
+// composited by abuffer_resolve_fragment.glsl.
+
+#define END_OF_LIST 0xFFFFFFFFu
+
+// NOTE: The shader has side effects, without this fragments behind opaque
+// geometry would be stored before the depth test rejects them.
+layout(early_fragment_tests) in;
+
+layout(binding = 0, r32ui) uniform coherent uimage2D head_pointers;
+layout(binding = 0, offset = 0) uniform atomic_uint fragment_count;
+
+struct fragment_t {
+    uint color; // premultiplied, packUnorm4x8()
+    float depth;
+    uint next;
+};
+
+layout(std430, binding = 0) writeonly buffer fragment_buffer {
+    fragment_t fragments[];
+};
+
+uniform uint max_fragments;
+uniform int num_samples;
+
+// Implemented by per_sample_shading.glsl or per_pixel_shading.glsl. Per pixel
+// only the list of the first sample is used.
+int sample_index ();
+
+void apply_transparency (vec4 color)
+{
+    // NOTE: The counter keeps counting past the budget so the CPU can find out
+    // how many fragments the frame needed.
+    uint idx = atomicCounterIncrement (fragment_count);
+    if (idx >= max_fragments) {
+        return;
+    }
+
+    ivec2 head_coord = ivec2 (int(gl_FragCoord.x)*num_samples + sample_index (), int(gl_FragCoord.y));
+    uint next = imageAtomicExchange (head_pointers, head_coord, idx);
+
+    fragments[idx].color = packUnorm4x8 (color);
+    fragments[idx].depth = gl_FragCoord.z;
+    fragments[idx].next = next;
+}
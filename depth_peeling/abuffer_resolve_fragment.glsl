@@ -0,0 +1,58 @@
+#version 430 core
+
+// Sorts the fragments of the A-buffer list of each sample by depth and
+// composites them front to back. Only the first MAX_SORTED_FRAGMENTS of a list
+// are used, the rest are dropped.
+
+#define END_OF_LIST 0xFFFFFFFFu
+#define MAX_SORTED_FRAGMENTS 32
+
+out vec4 out_color;
+
+layout(binding = 0, r32ui) uniform readonly uimage2D head_pointers;
+
+struct fragment_t {
+    uint color;
+    float depth;
+    uint next;
+};
+
+layout(std430, binding = 0) readonly buffer fragment_buffer {
+    fragment_t fragments[];
+};
+
+uniform int num_samples;
+uniform bool per_pixel_lists; // only the first sample has a list
+
+void main ()
+{
+    int sample_id = per_pixel_lists ? 0 : gl_SampleID;
+    ivec2 head_coord = ivec2 (int(gl_FragCoord.x)*num_samples + sample_id, int(gl_FragCoord.y));
+    uint idx = imageLoad (head_pointers, head_coord).r;
+
+    vec4 colors[MAX_SORTED_FRAGMENTS];
+    float depths[MAX_SORTED_FRAGMENTS];
+    int count = 0;
+    while (idx != END_OF_LIST && count < MAX_SORTED_FRAGMENTS) {
+        // Insertion sort, lists are short.
+        vec4 color = unpackUnorm4x8 (fragments[idx].color);
+        float depth = fragments[idx].depth;
+        int i = count;
+        while (i > 0 && depths[i-1] > depth) {
+            colors[i] = colors[i-1];
+            depths[i] = depths[i-1];
+            i--;
+        }
+        colors[i] = color;
+        depths[i] = depth;
+        count++;
+
+        idx = fragments[idx].next;
+    }
+
+    vec4 res = vec4 (0);
+    for (int i=0; i<count; i++) {
+        res += colors[i]*(1 - res.a);
+    }
+    out_color = res;
+}
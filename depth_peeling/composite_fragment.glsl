@@ -0,0 +1,14 @@
+#version 400 core
+
+// Blends a multisample texture into the target sample by sample, with the
+// operator set by the caller. Used to composite the front layers of dual depth
+// peeling over the back ones.
+
+out vec4 out_color;
+
+uniform sampler2DMS source_texture;
+
+void main ()
+{
+    out_color = texelFetch (source_texture, ivec2(gl_FragCoord.xy), gl_SampleID);
+}
@@ -1,10 +1,14 @@
-//gcc -DDEPTH_PEELING -O3 -g -Wall -o depth_peeling ../x11_platform.c -lGL -lcairo -lX11-xcb -lX11 -lxcb -lxcb-sync -lxcb-randr -lm
+//gcc -DDEPTH_PEELING -O3 -g -Wall -o depth_peeling ../x11_platform.c -lGL -lcairo -lX11-xcb -lX11 -lxcb -lxcb-sync -lxcb-randr -lpthread -lm $(pkg-config --cflags --libs pangocairo)
 /*
  * Copiright (C) 2018 Santiago León O.
  */
 
 #ifdef DEPTH_PEELING
 
+#ifdef CAIRO_SHM_BACKEND
+#error "The depth peeling demo renders with GL, build it without CAIRO_SHM_BACKEND."
+#endif
+
 struct camera_t {
     float width_m;
     float height_m;
@@ -13,6 +17,9 @@ struct camera_t {
     float pitch;
     float yaw;
     float distance;
+
+    // Set whenever a field above changes, cleared by scene_update_camera().
+    bool dirty;
 };
 
 dvec3 camera_compute_pos (struct camera_t *camera)
@@ -53,6 +60,16 @@ void cuboid_init (fvec3 dim, struct cuboid_t *res)
     }
 }
 
+void cuboid_translate (struct cuboid_t *cuboid, fvec3 offset)
+{
+    int i;
+    for (i=0; i<8; i++) {
+        cuboid->v[i].x += offset.x;
+        cuboid->v[i].y += offset.y;
+        cuboid->v[i].z += offset.z;
+    }
+}
+
 #define VA_CUBOID_SIZE (36*6*sizeof(float))
 
 float* put_cuboid_in_vertex_array (struct cuboid_t *cuboid, float *dest)
@@ -115,70 +132,287 @@ float* put_cuboid_in_vertex_array (struct cuboid_t *cuboid, float *dest)
     return (float*)((uint8_t*)dest + sizeof (vertex_array));
 }
 
+// Transparency techniques are fragment shader files that implement
+// apply_transparency(), which fragment_shader.glsl calls with the shaded color.
+// There is one scene program for each of them, and one for opaque geometry.
+enum scene_program_t {
+    SCENE_PROGRAM_OPAQUE,
+    SCENE_PROGRAM_PEEL,
+    SCENE_PROGRAM_DUAL_PEEL_INIT,
+    SCENE_PROGRAM_DUAL_PEEL,
+    SCENE_PROGRAM_WBOIT,
+    SCENE_PROGRAM_ABUFFER,
+    SCENE_PROGRAM_KBUFFER,
+
+    NUM_SCENE_PROGRAMS
+};
+
+const char *scene_program_hooks[NUM_SCENE_PROGRAMS] = {
+    "opaque.glsl",
+    "peel_front_to_back.glsl",
+    "dual_peel_init.glsl",
+    "dual_peel.glsl",
+    "wboit.glsl",
+    "abuffer.glsl",
+    "kbuffer.glsl"
+};
+
+// Uniform block shared by all scene programs, declared as frame_uniforms in
+// vertex_shader.glsl with the std140 layout. Members are ordered so there is
+// no padding between them.
+#define FRAME_UNIFORMS_BINDING 0
+struct frame_uniforms_t {
+    mat4f model;
+    mat4f view;
+    mat4f proj;
+    mat4f mvp;
+    float near_plane;
+    float far_plane;
+    float pad[2];
+};
+
+// The transparent part of the scene is a set of nested cubes, each one adds 2
+// layers to the pixels covered by the innermost cube. Only the first num_cubes
+// are drawn. Around them there is opaque geometry, a floor with some pillars
+// and a solid core inside the innermost cube.
+#define MAX_CUBES 8
+#define NUM_OPAQUE_CUBOIDS 6
+
 struct scene_t {
-    GLuint program_id;
+    GLuint programs[NUM_SCENE_PROGRAMS];
     uint32_t vao_size;
     GLuint vao;
+
+    // CPU side geometry, filled by scene_prepare(). Transparent geometry goes
+    // first, opaque geometry starts at first_opaque_vertex.
+    float *vertices;
+    uint32_t vertices_size;
+    uint32_t num_vertices;
+    uint32_t first_opaque_vertex;
+    uint32_t num_opaque_vertices;
+
+    int num_cubes;
+    bool show_opaque;
+    bool signed_face_colors; // set with scene_create_programs()
+
+    // Per frame uniforms of all programs, see struct frame_uniforms_t.
+    struct gl_uniform_ring_t frame_uniforms;
+
+    // Transform of the last scene_update_camera(), and bounds of the
+    // transparent geometry in normalized device coordinates computed with it.
+    mat4f mvp;
+    float near_plane;
+    box_t transparent_bounds;
 };
 
-struct scene_t scene_init ()
+// Computes the geometry of the scene. It doesn't need a GL context so it can
+// run while the platform is still setting up the window.
+void scene_prepare (struct scene_t *scene, mem_pool_t *pool)
+{
+    scene->vertices_size = (MAX_CUBES + NUM_OPAQUE_CUBOIDS)*VA_CUBOID_SIZE;
+    scene->vertices = (float*)mem_pool_push_size (pool, scene->vertices_size);
+    scene->num_vertices = 36*(MAX_CUBES + NUM_OPAQUE_CUBOIDS);
+    scene->first_opaque_vertex = 36*MAX_CUBES;
+    scene->num_opaque_vertices = 36*NUM_OPAQUE_CUBOIDS;
+    scene->num_cubes = 1;
+    scene->show_opaque = true;
+
+    // NOTE: Innermost cube first, so drawing a prefix of the array draws the
+    // innermost cubes.
+    float *dest = scene->vertices;
+    int i;
+    for (i=0; i<MAX_CUBES; i++) {
+        struct cuboid_t cube;
+        float size = 1 + 0.3*i;
+        cuboid_init (FVEC3 (size,size,size), &cube);
+        dest = put_cuboid_in_vertex_array (&cube, dest);
+    }
+
+    // NOTE: The outermost cube goes from -1.55 to 1.55.
+    struct {
+        fvec3 dim;
+        fvec3 pos;
+    } opaque[NUM_OPAQUE_CUBOIDS] = {
+        {FVEC3 (8, 0.2, 8),     FVEC3 ( 0, -1.95,  0)},
+        {FVEC3 (0.4, 0.4, 0.4), FVEC3 ( 0,  0,     0)},
+        {FVEC3 (0.4, 3.5, 0.4), FVEC3 ( 3, -0.1,   0)},
+        {FVEC3 (0.4, 3.5, 0.4), FVEC3 (-3, -0.1,   0)},
+        {FVEC3 (0.4, 3.5, 0.4), FVEC3 ( 0, -0.1,   3)},
+        {FVEC3 (0.4, 3.5, 0.4), FVEC3 ( 0, -0.1,  -3)}
+    };
+    for (i=0; i<NUM_OPAQUE_CUBOIDS; i++) {
+        struct cuboid_t cuboid;
+        cuboid_init (opaque[i].dim, &cuboid);
+        cuboid_translate (&cuboid, opaque[i].pos);
+        dest = put_cuboid_in_vertex_array (&cuboid, dest);
+    }
+}
+
+// Builds the programs of the scene, replacing the previous ones. Hooks read
+// the sample given by sample_index(), which depends on _per_sample_shading_.
+// Options of fragment_shader.glsl are set from the scene as #defines, each set
+// of them has its own entry in the program cache so switching back is cheap.
+//
+// NOTE: All programs are started before checking any of them, so the driver
+// can compile them in parallel.
+bool scene_create_programs (struct scene_t *scene, bool per_sample_shading)
 {
-    struct scene_t scene = {0};
+    struct gl_program_build_t builds[NUM_SCENE_PROGRAMS];
+    const char *vertex_shaders[] = {"vertex_shader.glsl"};
+    const char *fragment_shaders[NUM_SCENE_PROGRAMS][3];
+
+    char defines[128];
+    snprintf (defines, ARRAY_SIZE(defines), "#define SIGNED_FACE_COLORS %d\n",
+              scene->signed_face_colors ? 1 : 0);
+
+    int i;
+    for (i=0; i<NUM_SCENE_PROGRAMS; i++) {
+        if (scene->programs[i]) {
+            gl_delete_program (scene->programs[i]);
+        }
 
-    scene.program_id = gl_program ("vertex_shader.glsl", "fragment_shader.glsl");
-    if (!scene.program_id) {
-        return scene;
+        fragment_shaders[i][0] = "fragment_shader.glsl";
+        fragment_shaders[i][1] = scene_program_hooks[i];
+        fragment_shaders[i][2] = per_sample_shading ? "per_sample_shading.glsl" : "per_pixel_shading.glsl";
+        gl_program_build_begin (&builds[i], vertex_shaders, ARRAY_SIZE(vertex_shaders),
+                                fragment_shaders[i], ARRAY_SIZE(fragment_shaders[i]), defines);
     }
 
-    glGenVertexArrays (1, &scene.vao);
+    bool success = true;
+    for (i=0; i<NUM_SCENE_PROGRAMS; i++) {
+        scene->programs[i] = gl_program_build_end (&builds[i]);
+        if (!scene->programs[i]) {
+            // NOTE: The A-buffer shaders need GL 4.3, and the mode also needs
+            // ARB_clear_texture. Without them only that mode is unavailable.
+            if (i == SCENE_PROGRAM_ABUFFER) {
+                printf ("A-buffer mode is not available.\n");
+                continue;
+            }
+            success = false;
+            continue;
+        }
+        gl_uniform_ring_bind_program (&scene->frame_uniforms, scene->programs[i], "frame_uniforms");
+    }
+    return success;
+}
 
-    float vertices[VA_CUBOID_SIZE];
-    struct cuboid_t cube;
-    cuboid_init (FVEC3 (1,1,1), &cube);
-    put_cuboid_in_vertex_array (&cube, vertices);
+// Creates the GL objects of a scene previously computed by scene_prepare().
+bool scene_init (struct scene_t *scene, bool per_sample_shading)
+{
+    gl_uniform_ring_init (&scene->frame_uniforms, FRAME_UNIFORMS_BINDING,
+                          sizeof(struct frame_uniforms_t));
+    if (!scene_create_programs (scene, per_sample_shading)) {
+        return false;
+    }
 
-    glBindVertexArray (scene.vao);
+    glGenVertexArrays (1, &scene->vao);
+    gl_bind_vertex_array (scene->vao);
 
       GLuint vbo;
       glGenBuffers (1, &vbo);
       glBindBuffer (GL_ARRAY_BUFFER, vbo);
-      glBufferData (GL_ARRAY_BUFFER, VA_CUBOID_SIZE, vertices, GL_STATIC_DRAW);
+      glBufferData (GL_ARRAY_BUFFER, scene->vertices_size, scene->vertices, GL_STATIC_DRAW);
 
-      GLuint pos_attr = glGetAttribLocation (scene.program_id, "position");
-      glEnableVertexAttribArray (pos_attr);
-      glVertexAttribPointer (pos_attr, 3, GL_FLOAT, GL_FALSE, 6*sizeof(float), 0);
+      // NOTE: Attribute locations are set in vertex_shader.glsl.
+      glEnableVertexAttribArray (0);
+      glVertexAttribPointer (0, 3, GL_FLOAT, GL_FALSE, 6*sizeof(float), 0);
 
-      GLuint normal_attr = glGetAttribLocation (scene.program_id, "in_normal");
-      glEnableVertexAttribArray (normal_attr);
-      glVertexAttribPointer (normal_attr, 3, GL_FLOAT, GL_FALSE,
+      glEnableVertexAttribArray (1);
+      glVertexAttribPointer (1, 3, GL_FLOAT, GL_FALSE,
                              6*sizeof(float), (void*)(3*sizeof(float)));
+    return true;
+}
+
+// Computes the bounds in normalized device coordinates of the transparent
+// geometry currently drawn. If a vertex is behind the near plane the
+// projection is not bounded by the projected vertices, then the bounds are the
+// whole screen.
+void scene_compute_transparent_bounds (struct scene_t *scene)
+{
+    mat4f *mvp = &scene->mvp;
+
+    box_t bounds;
+    bounds.min = DVEC2 (INFINITY, INFINITY);
+    bounds.max = DVEC2 (-INFINITY, -INFINITY);
+
+    uint32_t num_vertices = 36*scene->num_cubes;
+    uint32_t i;
+    for (i=0; i<num_vertices; i++) {
+        float *p = scene->vertices + 6*i;
+        float clip[4];
+        int j;
+        for (j=0; j<4; j++) {
+            clip[j] = mvp->M[j][0]*p[0] + mvp->M[j][1]*p[1] + mvp->M[j][2]*p[2] + mvp->M[j][3];
+        }
+
+        if (clip[3] < scene->near_plane) {
+            BOX_X_Y_W_H (bounds, -1, -1, 2, 2);
+            break;
+        }
+
+        bounds.min.x = MIN (bounds.min.x, clip[0]/clip[3]);
+        bounds.min.y = MIN (bounds.min.y, clip[1]/clip[3]);
+        bounds.max.x = MAX (bounds.max.x, clip[0]/clip[3]);
+        bounds.max.y = MAX (bounds.max.y, clip[1]/clip[3]);
+    }
 
-    return scene;
+    bounds.min.x = CLAMP (bounds.min.x, -1, 1);
+    bounds.min.y = CLAMP (bounds.min.y, -1, 1);
+    bounds.max.x = CLAMP (bounds.max.x, bounds.min.x, 1);
+    bounds.max.y = CLAMP (bounds.max.y, bounds.min.y, 1);
+    scene->transparent_bounds = bounds;
 }
 
+// Recomputes the transforms and writes them into the next copy of the frame
+// uniforms, only if the camera changed since the last call.
 void scene_update_camera (struct scene_t *scene, struct camera_t *camera)
 {
-    glUseProgram (scene->program_id);
+    if (!camera->dirty) {
+        return;
+    }
+    camera->dirty = false;
 
     mat4f model = rotation_y (0);
-    glUniformMatrix4fv (glGetUniformLocation (scene->program_id, "model"), 1, GL_TRUE, model.E);
 
     dvec3 camera_pos = camera_compute_pos (camera);
     mat4f view = look_at (camera_pos,
                           DVEC3(0,0,0),
                           DVEC3(0,1,0));
-    glUniformMatrix4fv (glGetUniformLocation (scene->program_id, "view"), 1, GL_TRUE, view.E);
 
     mat4f projection = perspective_projection (-camera->width_m/2, camera->width_m/2,
                                                -camera->height_m/2, camera->height_m/2,
                                                camera->near_plane, camera->far_plane);
-    glUniformMatrix4fv (glGetUniformLocation (scene->program_id, "proj"), 1, GL_TRUE, projection.E);
+
+    scene->mvp = mat4f_mult (projection, mat4f_mult (view, model));
+    scene->near_plane = camera->near_plane;
+
+    struct frame_uniforms_t uniforms = {0};
+    uniforms.model = model;
+    uniforms.view = view;
+    uniforms.proj = projection;
+    uniforms.mvp = scene->mvp;
+    uniforms.near_plane = camera->near_plane;
+    uniforms.far_plane = camera->far_plane;
+    gl_uniform_ring_write (&scene->frame_uniforms, &uniforms);
+}
+
+// Draws the transparent geometry with one of the transparency programs.
+void scene_render (struct scene_t *scene, enum scene_program_t program)
+{
+    gl_use_program (scene->programs[program]);
+    gl_bind_vertex_array (scene->vao);
+    glDrawArrays (GL_TRIANGLES, 0, 36*scene->num_cubes);
 }
 
-void scene_render (struct scene_t *scene)
+void scene_render_opaque (struct scene_t *scene)
 {
-    glBindVertexArray (scene->vao);
-    glDrawArrays (GL_TRIANGLES, 0, 36);
+    if (!scene->show_opaque) {
+        return;
+    }
+
+    gl_use_program (scene->programs[SCENE_PROGRAM_OPAQUE]);
+    gl_bind_vertex_array (scene->vao);
+    glDrawArrays (GL_TRIANGLES, scene->first_opaque_vertex, scene->num_opaque_vertices);
 }
 
 void depth_peel_set_shader_slots (GLuint program_id,
@@ -194,171 +428,2062 @@ void depth_peel_set_shader_slots (GLuint program_id,
         GL_TEXTURE_2D_MULTISAMPLE, depth_texture, 0
     );
 
-    glActiveTexture (GL_TEXTURE0);
+    gl_use_program (program_id);
+    gl_active_texture (GL_TEXTURE0);
     glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, peel_depth_map);
-    glUniform1i (glGetUniformLocation (program_id, "peel_depth_map"), 0);
+    glUniform1i (gl_uniform_location (program_id, "peel_depth_map"), 0);
 }
 
-bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_input_t input)
+enum transparency_mode_t {
+    TRANSPARENCY_DEPTH_PEELING,
+    TRANSPARENCY_DUAL_DEPTH_PEELING,
+    TRANSPARENCY_WBOIT,
+    TRANSPARENCY_ABUFFER,
+    TRANSPARENCY_KBUFFER,
+
+    NUM_TRANSPARENCY_MODES
+};
+
+const char *transparency_mode_names[NUM_TRANSPARENCY_MODES] = {
+    "Depth peeling",
+    "Dual depth peeling",
+    "Weighted blended OIT",
+    "A-buffer",
+    "Stencil routed k-buffer"
+};
+
+// Depth weight functions of weighted blended OIT, must match wboit.glsl.
+enum wboit_weight_t {
+    WBOIT_WEIGHT_CONSTANT,
+    WBOIT_WEIGHT_DISTANCE_7,
+    WBOIT_WEIGHT_DISTANCE_8,
+    WBOIT_WEIGHT_DISTANCE_9,
+    WBOIT_WEIGHT_DEPTH_10,
+
+    NUM_WBOIT_WEIGHTS
+};
+
+const char *wboit_weight_names[NUM_WBOIT_WEIGHTS] = {
+    "constant",
+    "distance, eq. 7",
+    "distance, eq. 8",
+    "distance, eq. 9",
+    "depth, eq. 10"
+};
+
+// Upper bound for the number of peeling passes of a frame, one query object is
+// allocated for each of them.
+#define MAX_PEEL_PASSES 32
+
+// Render targets of all transparency modes. The result of every mode ends up
+// in color_texture with premultiplied alpha. Transparent passes are scissored
+// to the screen bounds of the transparent geometry, color_texture is only
+// valid inside them.
+struct transparency_renderer_t {
+    GLuint fb;
+    GLuint color_texture;
+    GLuint depth_texture;
+    GLuint peel_depth_map;
+    int width, height; // of the frame being rendered
+    box_t bounds;      // in pixels, with the origin at the bottom left
+
+    // Frames are rendered at render_scale of the window size, into the bottom
+    // left of the targets, and upscaled when presenting. See
+    // struct dynamic_resolution_t.
+    float render_scale;
+
+    // Quality tier. Targets have num_samples samples, and peeling runs the
+    // fragment shader per sample or per pixel. See transparency_set_samples()
+    // and scene_create_programs().
+    //
+    // Targets come from target_pool and follow the window size, see
+    // transparency_resize_targets(). has_targets is false if the pool ran out
+    // of room, then nothing is rendered.
+    struct gl_render_target_pool_t target_pool;
+    bool has_targets;
+    float target_width, target_height;
+    int num_samples;
+    int max_samples;
+    int max_texture_size;
+    bool per_sample_shading;
+
+    // Samples are resolved when presenting, by the quad shader or with
+    // glBlitFramebuffer into resolve_texture.
+    bool blit_resolve;
+    GLuint resolve_fb;
+    GLuint resolve_texture;
+
+    // Opaque geometry is rendered once into its own framebuffer. Its depth is
+    // the early-Z test of every transparent pass, the transparent result is
+    // composited over its color when presenting.
+    GLuint opaque_fb;
+    GLuint opaque_color_texture;
+    GLuint opaque_depth_map;
+
+    // Early termination of peeling, see peel_pass_begin(). The number of
+    // layers is only a maximum, passes that are not needed get skipped.
+    int max_layers;
+    uint32_t sample_threshold;
+    GLuint pass_queries[MAX_PEEL_PASSES];
+
+    // Sample counts are read when they become available, usually during the
+    // next frame. Passes are counted in the loop of the mode that issued them,
+    // so they are layers for depth peeling and pairs of layers for dual depth
+    // peeling.
+    enum transparency_mode_t queried_mode;
+    GLuint first_pass_condition; // query the first pass is conditional on, if any
+    int num_queried_passes;
+    bool pass_results_pending;
+    int num_used_passes; // leading passes that wrote some sample
+    int pass_limit;      // passes allowed by sample_threshold
+
+    // Dual depth peeling
+    GLuint depth_blender[2]; // (-nearest, farthest) depth not yet peeled
+    GLuint front_blender;
+    GLuint composite_program_id;
+    GLuint composite_vao;
+
+    // Weighted blended OIT
+    enum wboit_weight_t wboit_weight;
+    GLuint accum_texture;
+    GLuint revealage_texture;
+    GLuint resolve_program_id;
+    GLuint resolve_vao;
+
+    // A-buffer
+    uint32_t abuffer_budget; // in fragments
+    GLuint head_pointers;
+    GLuint fragment_buffer;
+    GLuint fragment_counter;
+    GLuint abuffer_resolve_program_id;
+    GLuint abuffer_resolve_vao;
+
+    // The fragment count of a frame is copied into abuffer_readback and read
+    // when its fence signals, usually during the next frame.
+    GLuint abuffer_readback;
+    GLsync abuffer_fence;
+    uint32_t abuffer_num_fragments;
+    bool abuffer_overflow;
+
+    // Stencil routed k-buffer, each of the kbuffer_size samples of a pixel
+    // stores one fragment. Empty slots have a depth of 2, and the last slot of
+    // pixels that overflowed has a negative depth.
+    int kbuffer_size;
+    GLuint kbuffer_fb;
+    GLuint kbuffer_color;
+    GLuint kbuffer_depth;
+    GLuint kbuffer_stencil;
+    GLuint kbuffer_overflow_program_id;
+    GLuint kbuffer_overflow_vao;
+    GLuint kbuffer_resolve_program_id;
+    GLuint kbuffer_resolve_vao;
+    GLuint kbuffer_overflow_query;
+};
+
+// Must match fragment_t in abuffer.glsl.
+#define ABUFFER_FRAGMENT_SIZE 12
+#define ABUFFER_DEFAULT_BUDGET (8*1024*1024)
+#define ABUFFER_MAX_BUDGET (64*1024*1024)
+#define ABUFFER_END_OF_LIST 0xFFFFFFFF
+
+// Must match kbuffer_resolve_fragment.glsl. The stencil routing values of 8
+// samples fit in 4 bits.
+#define KBUFFER_MAX_SIZE 8
+
+#define MAX_SAMPLES 8
+
+// Program for a full screen pass with the quad renderer, the fragment shader
+// runs once per pixel (or sample) of the target.
+GLuint full_screen_program (struct quad_renderer_t *quad, const char *fragment_shader, GLuint *vao)
 {
-    bool blit_needed = false;
-    st->gui_st.gr = *graphics;
-    if (!st->is_initialized) {
-        st->end_execution = false;
-        st->is_initialized = true;
+    GLuint program_id = gl_program ("2Dvertex_shader.glsl", fragment_shader);
+    if (!program_id) {
+        return 0;
     }
 
-    update_input (&st->gui_st, input);
+    mat4f identity = {{
+         1, 0, 0, 0,
+         0, 1, 0, 0,
+         0, 0, 1, 0,
+         0, 0, 0, 1
+    }};
+    glUniformMatrix4fv (gl_uniform_location (program_id, "transf"), 1, GL_TRUE, identity.E);
+
+    *vao = quad_renderer_vao (quad, program_id);
+    return program_id;
+}
+
+// Allocates space for _num_fragments_ in the A-buffer. Fragments over the
+// budget are dropped, see abuffer_poll_fragment_count().
+void abuffer_set_budget (struct transparency_renderer_t *r, uint32_t num_fragments)
+{
+    r->abuffer_budget = num_fragments;
+    r->abuffer_overflow = false;
+    glBindBuffer (GL_SHADER_STORAGE_BUFFER, r->fragment_buffer);
+    glBufferData (GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)num_fragments*ABUFFER_FRAGMENT_SIZE,
+                  NULL, GL_DYNAMIC_COPY);
+}
+
+// Acquires the render targets every mode uses, for the current size and
+// number of samples. The ones of a single mode are acquired each frame, see
+// transparency_acquire_mode_targets().
+void transparency_create_targets (struct transparency_renderer_t *r)
+{
+    struct gl_render_target_pool_t *pool = &r->target_pool;
+    int width = r->target_width, height = r->target_height;
+    int num_samples = r->num_samples;
+
+    r->color_texture = gl_render_target_acquire (pool, GL_RGBA8, width, height, num_samples);
+    r->peel_depth_map = gl_render_target_acquire (pool, GL_DEPTH_COMPONENT32F, width, height, num_samples);
+    r->depth_texture = gl_render_target_acquire (pool, GL_DEPTH_COMPONENT32F, width, height, num_samples);
+
+    // NOTE: Same format and number of samples as depth_texture, so it can be
+    // blitted into it.
+    r->opaque_color_texture = gl_render_target_acquire (pool, GL_RGBA8, width, height, num_samples);
+    r->opaque_depth_map = gl_render_target_acquire (pool, GL_DEPTH_COMPONENT32F, width, height, num_samples);
+    glBindFramebuffer (GL_FRAMEBUFFER, r->opaque_fb);
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D_MULTISAMPLE, r->opaque_color_texture, 0
+    );
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+        GL_TEXTURE_2D_MULTISAMPLE, r->opaque_depth_map, 0
+    );
+    glBindFramebuffer (GL_FRAMEBUFFER, r->fb);
+
+    if (r->abuffer_resolve_program_id) {
+        gl_use_program (r->abuffer_resolve_program_id);
+        glUniform1i (gl_uniform_location (r->abuffer_resolve_program_id, "num_samples"), num_samples);
+    }
+
+    r->resolve_texture = gl_render_target_acquire (pool, GL_RGBA8, width, height, 0);
+    glBindFramebuffer (GL_FRAMEBUFFER, r->resolve_fb);
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D, r->resolve_texture, 0
+    );
+    glBindFramebuffer (GL_FRAMEBUFFER, r->fb);
+
+    r->has_targets = r->color_texture && r->peel_depth_map && r->depth_texture &&
+                     r->opaque_color_texture && r->opaque_depth_map && r->resolve_texture;
+}
+
+void transparency_destroy_targets (struct transparency_renderer_t *r)
+{
+    GLuint *textures[] = {
+        &r->color_texture, &r->peel_depth_map, &r->depth_texture,
+        &r->opaque_color_texture, &r->opaque_depth_map, &r->resolve_texture
+    };
+
+    int i;
+    for (i=0; i<ARRAY_SIZE(textures); i++) {
+        gl_render_target_release (&r->target_pool, *textures[i]);
+        *textures[i] = 0;
+    }
+    r->has_targets = false;
+}
+
+// The head pointers of the A-buffer are num_samples times wider than the
+// targets, at high tiers with large windows they don't fit in a texture.
+bool abuffer_fits (struct transparency_renderer_t *r)
+{
+    return r->num_samples*r->target_width <= r->max_texture_size;
+}
+
+// Acquires the render targets only _mode_ uses. They are released at the end
+// of the frame, the pool hands the same textures back in the next one and
+// deletes them once the mode hasn't been used for a while. Returns false if
+// the pool ran out of room.
+bool transparency_acquire_mode_targets (struct transparency_renderer_t *r, enum transparency_mode_t mode)
+{
+    struct gl_render_target_pool_t *pool = &r->target_pool;
+    int width = r->target_width, height = r->target_height;
+    int num_samples = r->num_samples;
+
+    switch (mode) {
+        case TRANSPARENCY_DUAL_DEPTH_PEELING:
+            r->depth_blender[0] = gl_render_target_acquire (pool, GL_RG32F, width, height, num_samples);
+            r->depth_blender[1] = gl_render_target_acquire (pool, GL_RG32F, width, height, num_samples);
+            r->front_blender = gl_render_target_acquire (pool, GL_RGBA8, width, height, num_samples);
+            return r->depth_blender[0] && r->depth_blender[1] && r->front_blender;
+
+        case TRANSPARENCY_WBOIT:
+            // NOTE: Weights can get large, accum needs a float format.
+            r->accum_texture = gl_render_target_acquire (pool, GL_RGBA16F, width, height, num_samples);
+            r->revealage_texture = gl_render_target_acquire (pool, GL_R16F, width, height, num_samples);
+            return r->accum_texture && r->revealage_texture;
+
+        case TRANSPARENCY_ABUFFER:
+            // NOTE: There is a list for each sample, the samples of a pixel
+            // are next to each other in a row. See abuffer_fits().
+            if (!abuffer_fits (r)) {
+                return false;
+            }
+            r->head_pointers = gl_render_target_acquire (pool, GL_R32UI, num_samples*width, height, 0);
+            return r->head_pointers != 0;
+
+        case TRANSPARENCY_KBUFFER:
+            // NOTE: The k-buffer has its own number of samples, it doesn't
+            // change with the quality tier.
+            r->kbuffer_color = gl_render_target_acquire (pool, GL_RGBA8, width, height, r->kbuffer_size);
+            r->kbuffer_depth = gl_render_target_acquire (pool, GL_R32F, width, height, r->kbuffer_size);
+            r->kbuffer_stencil = gl_render_target_acquire (pool, GL_DEPTH24_STENCIL8, width, height, r->kbuffer_size);
+            glBindFramebuffer (GL_FRAMEBUFFER, r->kbuffer_fb);
+            glFramebufferTexture2D (
+                GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                GL_TEXTURE_2D_MULTISAMPLE, r->kbuffer_color, 0
+            );
+            glFramebufferTexture2D (
+                GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                GL_TEXTURE_2D_MULTISAMPLE, r->kbuffer_depth, 0
+            );
+            glFramebufferTexture2D (
+                GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                GL_TEXTURE_2D_MULTISAMPLE, r->kbuffer_stencil, 0
+            );
+            glBindFramebuffer (GL_FRAMEBUFFER, r->fb);
+            return r->kbuffer_color && r->kbuffer_depth && r->kbuffer_stencil;
 
-    switch (st->gui_st.input.keycode) {
-        case 24: //KEY_Q
-            st->end_execution = true;
-            break;
         default:
-            //if (input.keycode >= 8) {
-            //    printf ("%" PRIu8 "\n", input.keycode);
-            //    //printf ("%" PRIu16 "\n", input.modifiers);
-            //}
-            break;
+            return true;
     }
+}
 
-    static struct quad_renderer_t quad_renderer;
-    static struct scene_t scene;
-    static bool run_once = false;
-    static struct camera_t main_camera;
+void transparency_release_mode_targets (struct transparency_renderer_t *r)
+{
+    // NOTE: A texture deleted while attached to a framebuffer that is not
+    // bound stays alive, detach them so the pool can reclaim their memory.
+    if (r->kbuffer_color) {
+        glBindFramebuffer (GL_FRAMEBUFFER, r->kbuffer_fb);
+        glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D_MULTISAMPLE, 0, 0);
+        glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D_MULTISAMPLE, 0, 0);
+        glFramebufferTexture2D (GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D_MULTISAMPLE, 0, 0);
+        glBindFramebuffer (GL_FRAMEBUFFER, r->fb);
+    }
 
-    static GLuint fb;
-    static GLuint color_texture;
-    static GLuint depth_texture;
-    static GLuint peel_depth_map;
+    GLuint *textures[] = {
+        &r->depth_blender[0], &r->depth_blender[1], &r->front_blender,
+        &r->accum_texture, &r->revealage_texture,
+        &r->head_pointers,
+        &r->kbuffer_color, &r->kbuffer_depth, &r->kbuffer_stencil
+    };
 
-    if (!run_once) {
-        run_once = true;
+    int i;
+    for (i=0; i<ARRAY_SIZE(textures); i++) {
+        gl_render_target_release (&r->target_pool, *textures[i]);
+        *textures[i] = 0;
+    }
+}
 
-        scene = scene_init ();
-        if (scene.program_id == 0) {
-            st->end_execution = true;
-            return blit_needed;
-        }
+// Makes the render targets fit a _width_ x _height_ window. They are
+// bucketed, most resizes keep the current ones, see
+// gl_render_target_bucket().
+void transparency_resize_targets (struct transparency_renderer_t *r, int width, int height)
+{
+    int target_width = gl_render_target_bucket (r->target_width, width);
+    int target_height = gl_render_target_bucket (r->target_height, height);
+    if (target_width == r->target_width && target_height == r->target_height) {
+        return;
+    }
 
-        float width = graphics->screen_width;
-        float height = graphics->screen_height;
-        // Framebuffer creation
-        glGenFramebuffers (1, &fb);
-        glBindFramebuffer (GL_FRAMEBUFFER, fb);
+    transparency_destroy_targets (r);
+    r->target_width = target_width;
+    r->target_height = target_height;
+    transparency_create_targets (r);
+}
 
-        create_color_texture (&color_texture, width, height, 4);
-        create_depth_texture (&peel_depth_map, width, height, 4);
-        create_depth_texture (&depth_texture, width, height, 4);
+// Changes the number of samples of the render targets, recreating them. It's
+// clamped to what the implementation supports.
+void transparency_set_samples (struct transparency_renderer_t *r, int num_samples)
+{
+    num_samples = CLAMP (num_samples, 1, r->max_samples);
+    if (num_samples == r->num_samples) {
+        return;
+    }
 
-        quad_renderer = init_quad_renderer ();
+    transparency_destroy_targets (r);
+    r->num_samples = num_samples;
+    transparency_create_targets (r);
+}
 
-        main_camera.near_plane = 0.1;
-        main_camera.far_plane = 100;
-        main_camera.pitch = M_PI/4;
-        main_camera.yaw = M_PI/4;
-        main_camera.distance = 4.5;
+void set_sample_shading (struct transparency_renderer_t *r)
+{
+    if (r->per_sample_shading) {
+        gl_enable (GL_SAMPLE_SHADING);
+        glMinSampleShading (1.0);
+    } else {
+        gl_disable (GL_SAMPLE_SHADING);
     }
+}
 
-    if (st->gui_st.dragging[0]) {
-        dvec2 change = st->gui_st.ptr_delta;
-        main_camera.pitch += 0.01 * change.y;
-        main_camera.yaw -= 0.01 * change.x;
+bool transparency_renderer_init (struct transparency_renderer_t *r, struct quad_renderer_t *quad,
+                                 float width, float height)
+{
+    GLint max_color_samples, max_depth_samples;
+    glGetIntegerv (GL_MAX_COLOR_TEXTURE_SAMPLES, &max_color_samples);
+    glGetIntegerv (GL_MAX_DEPTH_TEXTURE_SAMPLES, &max_depth_samples);
+    r->max_samples = MIN (MAX_SAMPLES, MIN (max_color_samples, max_depth_samples));
+    glGetIntegerv (GL_MAX_TEXTURE_SIZE, &r->max_texture_size);
+
+    // NOTE: Enough layers to resolve every pixel of the scene.
+    r->max_layers = 2*MAX_CUBES;
+    r->render_scale = 1;
+    r->pass_limit = MAX_PEEL_PASSES;
+    r->queried_mode = NUM_TRANSPARENCY_MODES;
+    glGenQueries (MAX_PEEL_PASSES, r->pass_queries);
+
+    r->composite_program_id =
+        full_screen_program (quad, "composite_fragment.glsl", &r->composite_vao);
+    if (!r->composite_program_id) {
+        return false;
     }
+    glUniform1i (gl_uniform_location (r->composite_program_id, "source_texture"), 0);
 
-    if (input.wheel != 1) {
-        main_camera.distance -= (input.wheel - 1)*main_camera.distance*0.7;
+    r->wboit_weight = WBOIT_WEIGHT_DISTANCE_7;
+    r->resolve_program_id =
+        full_screen_program (quad, "wboit_resolve_fragment.glsl", &r->resolve_vao);
+    if (!r->resolve_program_id) {
+        return false;
+    }
+    glUniform1i (gl_uniform_location (r->resolve_program_id, "accum"), 0);
+    glUniform1i (gl_uniform_location (r->resolve_program_id, "revealage"), 1);
+
+    // NOTE: Head pointers are reset with glClearTexSubImage(), that's
+    // ARB_clear_texture (core in GL 4.4). Without it the A-buffer mode is
+    // left unavailable.
+    if (gl_has_extension ("GL_ARB_clear_texture")) {
+        r->abuffer_resolve_program_id =
+            full_screen_program (quad, "abuffer_resolve_fragment.glsl", &r->abuffer_resolve_vao);
+    } else {
+        printf ("A-buffer mode needs GL_ARB_clear_texture.\n");
     }
+    if (r->abuffer_resolve_program_id) {
+        glGenBuffers (1, &r->fragment_counter);
+        glBindBuffer (GL_ATOMIC_COUNTER_BUFFER, r->fragment_counter);
+        glBufferData (GL_ATOMIC_COUNTER_BUFFER, sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
 
-    main_camera.width_m = px_to_m_x (graphics, graphics->width);
-    main_camera.height_m = px_to_m_y (graphics, graphics->height);
+        glGenBuffers (1, &r->abuffer_readback);
+        glBindBuffer (GL_COPY_WRITE_BUFFER, r->abuffer_readback);
+        glBufferData (GL_COPY_WRITE_BUFFER, sizeof(GLuint), NULL, GL_STREAM_READ);
 
-    scene_update_camera (&scene, &main_camera);
+        glGenBuffers (1, &r->fragment_buffer);
+        abuffer_set_budget (r, ABUFFER_DEFAULT_BUDGET);
+    }
+
+    glGenFramebuffers (1, &r->fb);
+    glGenFramebuffers (1, &r->opaque_fb);
+    glGenFramebuffers (1, &r->resolve_fb);
+    glGenFramebuffers (1, &r->kbuffer_fb);
+    glBindFramebuffer (GL_FRAMEBUFFER, r->fb);
+
+    r->num_samples = MIN (4, r->max_samples);
+    r->per_sample_shading = true;
+    r->kbuffer_size = MIN (KBUFFER_MAX_SIZE, r->max_samples);
+    transparency_resize_targets (r, width, height);
+
+    r->kbuffer_overflow_program_id =
+        full_screen_program (quad, "kbuffer_overflow_fragment.glsl", &r->kbuffer_overflow_vao);
+    r->kbuffer_resolve_program_id =
+        full_screen_program (quad, "kbuffer_resolve_fragment.glsl", &r->kbuffer_resolve_vao);
+    if (r->kbuffer_resolve_program_id) {
+        glUniform1i (gl_uniform_location (r->kbuffer_resolve_program_id, "kbuffer_color"), 0);
+        glUniform1i (gl_uniform_location (r->kbuffer_resolve_program_id, "kbuffer_depth"), 1);
+        glUniform1i (gl_uniform_location (r->kbuffer_resolve_program_id, "kbuffer_size"), r->kbuffer_size);
+    }
+    glGenQueries (1, &r->kbuffer_overflow_query);
+    return true;
+}
+
+bool transparency_mode_supported (struct transparency_renderer_t *r, struct scene_t *scene,
+                                  enum transparency_mode_t mode)
+{
+    if (mode == TRANSPARENCY_ABUFFER) {
+        return scene->programs[SCENE_PROGRAM_ABUFFER] != 0 && r->abuffer_resolve_program_id != 0 &&
+            abuffer_fits (r);
+    }
+    if (mode == TRANSPARENCY_KBUFFER) {
+        return r->kbuffer_size >= 2 && scene->programs[SCENE_PROGRAM_KBUFFER] != 0 &&
+            r->kbuffer_overflow_program_id != 0 && r->kbuffer_resolve_program_id != 0;
+    }
+    return true;
+}
+
+// Maximum number of geometry passes used by a mode to resolve _num_layers_
+// layers. Peeling modes skip the passes that are not needed, see
+// transparency_used_passes().
+int transparency_num_passes (enum transparency_mode_t mode, int num_layers)
+{
+    switch (mode) {
+        case TRANSPARENCY_DEPTH_PEELING:
+            return num_layers;
+        case TRANSPARENCY_DUAL_DEPTH_PEELING:
+            // One pass to initialize the depth blender, then 2 layers per pass.
+            return 1 + (num_layers + 1)/2;
+        case TRANSPARENCY_WBOIT:
+        case TRANSPARENCY_ABUFFER:
+            return 1;
+        case TRANSPARENCY_KBUFFER:
+            // One pass fills the k-buffer, pixels with more than k layers are
+            // depth peeled.
+            return 1 + num_layers;
+        default:
+            invalid_code_path;
+            return 0;
+    }
+}
+
+// Renders the opaque geometry with depth writes into opaque_fb. Nothing else
+// in the frame writes to it.
+void render_opaque (struct transparency_renderer_t *r, struct scene_t *scene)
+{
+    float transparent[] = {0, 0, 0, 0};
+    float far_depth = 1;
+
+    // NOTE: The depth mask also applies to the clear.
+    glBindFramebuffer (GL_FRAMEBUFFER, r->opaque_fb);
+    gl_depth_mask (GL_TRUE);
+    glClearBufferfv (GL_COLOR, 0, transparent);
+    glClearBufferfv (GL_DEPTH, 0, &far_depth);
+
+    gl_enable (GL_DEPTH_TEST);
+    gl_disable (GL_BLEND);
+    scene_render_opaque (scene);
+
+    glBindFramebuffer (GL_FRAMEBUFFER, r->fb);
+}
+
+// Uses the opaque depth as a read only depth test, transparent fragments
+// behind opaque geometry get rejected before shading.
+void opaque_depth_test_begin (struct transparency_renderer_t *r)
+{
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+        GL_TEXTURE_2D_MULTISAMPLE, r->opaque_depth_map, 0
+    );
+    gl_enable (GL_DEPTH_TEST);
+    gl_depth_mask (GL_FALSE);
+}
+
+// Depth peeling needs to write depth to find the nearest layer, instead of
+// testing against the opaque depth it starts each pass from a copy of it.
+void copy_opaque_depth (struct transparency_renderer_t *r)
+{
+    int x0 = r->bounds.min.x, y0 = r->bounds.min.y;
+    int x1 = r->bounds.max.x, y1 = r->bounds.max.y;
+    glBindFramebuffer (GL_READ_FRAMEBUFFER, r->opaque_fb);
+    glBindFramebuffer (GL_DRAW_FRAMEBUFFER, r->fb);
+    glBlitFramebuffer (x0, y0, x1, y1, x0, y0, x1, y1, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer (GL_FRAMEBUFFER, r->fb);
+}
+
+// Each peeling pass is wrapped in a GL_SAMPLES_PASSED query, and every pass
+// after the first one is conditionally rendered on the query of the previous
+// one. When a pass writes nothing there are no layers left, and the GPU skips
+// the rest of the passes, so simple views cost a single pass and complex ones
+// get as many as they need, up to the maximum.
+//
+// NOTE: With GL_QUERY_WAIT it's the GPU the one that waits for the result, the
+// CPU never does. GL_QUERY_NO_WAIT would render the pass anyway if the result
+// is not ready yet, which is correct but saves nothing.
+//
+// The first pass can be made conditional too, by setting first_pass_condition.
+void peel_pass_begin (struct transparency_renderer_t *r, int pass)
+{
+    GLuint condition = pass > 0 ? r->pass_queries[pass-1] : r->first_pass_condition;
+    if (condition) {
+        glBeginConditionalRender (condition, GL_QUERY_WAIT);
+    }
+    glBeginQuery (GL_SAMPLES_PASSED, r->pass_queries[pass]);
+}
+
+void peel_pass_end (struct transparency_renderer_t *r, int pass)
+{
+    glEndQuery (GL_SAMPLES_PASSED);
+    if (pass > 0 || r->first_pass_condition) {
+        glEndConditionalRender ();
+    }
+}
+
+// Reads the sample counts of the last peeling frame if all of them are
+// available, without waiting for the GPU.
+//
+// Conditional rendering can only test if a pass wrote something. Passes that
+// write less than sample_threshold samples are cut here instead, by limiting
+// the number of passes of the following frames. If no pass went under the
+// threshold the limit grows by one, as there may be more layers than the ones
+// that were peeled.
+void peel_poll_pass_queries (struct transparency_renderer_t *r)
+{
+    if (!r->pass_results_pending) {
+        return;
+    }
+
+    int i;
+    for (i=0; i<r->num_queried_passes; i++) {
+        GLuint available;
+        glGetQueryObjectuiv (r->pass_queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            return;
+        }
+    }
+    r->pass_results_pending = false;
+
+    int num_used_passes = 0;
+    int pass_limit = MIN (r->num_queried_passes + 1, MAX_PEEL_PASSES);
+    for (i=0; i<r->num_queried_passes; i++) {
+        GLuint num_samples;
+        glGetQueryObjectuiv (r->pass_queries[i], GL_QUERY_RESULT, &num_samples);
+
+        if (num_samples > 0 && num_used_passes == i) {
+            num_used_passes++;
+        }
 
-    glEnable (GL_DEPTH_TEST);
-    glEnable (GL_SAMPLE_SHADING);
-    glMinSampleShading (1.0);
+        if (num_samples < r->sample_threshold) {
+            pass_limit = MIN (pass_limit, i + 1);
+        }
+    }
+
+    r->num_used_passes = num_used_passes;
+    r->pass_limit = pass_limit;
+}
+
+// Number of peeling passes to issue this frame out of _max_passes_.
+int peel_begin_frame (struct transparency_renderer_t *r, enum transparency_mode_t mode, int max_passes)
+{
+    peel_poll_pass_queries (r);
+
+    if (mode != r->queried_mode) {
+        // Results of a different mode count different passes.
+        r->queried_mode = mode;
+        r->pass_results_pending = false;
+        r->num_used_passes = max_passes;
+        r->pass_limit = MAX_PEEL_PASSES;
+    }
+
+    int num_passes = MIN (max_passes, MAX_PEEL_PASSES);
+    if (r->sample_threshold > 0) {
+        num_passes = MIN (num_passes, r->pass_limit);
+    }
+
+    r->num_queried_passes = num_passes;
+    r->pass_results_pending = num_passes > 0;
+    return num_passes;
+}
+
+// Front to back depth peeling, each geometry pass peels one layer. It's also
+// the fallback of the k-buffer, then _mode_ is TRANSPARENCY_KBUFFER.
+void render_depth_peeling (struct transparency_renderer_t *r, struct scene_t *scene,
+                           enum transparency_mode_t mode, int num_layers)
+{
+    int num_passes = peel_begin_frame (r, mode, num_layers);
 
-    glBindFramebuffer (GL_FRAMEBUFFER, fb);
-    glViewport (0, 0, graphics->width, graphics->height);
-    glScissor (0, 0, graphics->width, graphics->height);
+    gl_enable (GL_DEPTH_TEST);
 
     // Initial texture contents
     //
     // color_texture -> (0,0,0,0)
-    // depth_texture -> 1
-    // opaque_color_texture -> (0,0,0,0)
-    // opaque_depth_map -> 1
+    // depth_texture -> opaque_depth_map
     // peel_depth_map -> 0
 
     // Init color_texture and depth_texture
     glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
     glFramebufferTexture2D (
         GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-        GL_TEXTURE_2D_MULTISAMPLE, color_texture, 0
+        GL_TEXTURE_2D_MULTISAMPLE, r->color_texture, 0
     );
     glFramebufferTexture2D (
         GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-        GL_TEXTURE_2D_MULTISAMPLE, depth_texture, 0
+        GL_TEXTURE_2D_MULTISAMPLE, r->depth_texture, 0
     );
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glClear(GL_COLOR_BUFFER_BIT);
+    copy_opaque_depth (r);
 
     // Init peel_depth_map
     glFramebufferTexture2D (
         GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-        GL_TEXTURE_2D_MULTISAMPLE, peel_depth_map, 0
+        GL_TEXTURE_2D_MULTISAMPLE, r->peel_depth_map, 0
     );
     glClearDepth (0);
     glClear (GL_DEPTH_BUFFER_BIT);
     glClearDepth (1);
 
-    int num_pass = 2;
-
     // Fragment shader slot content:
     //
     // COLOR BUFFER: color_texture
     // DEPTH BUFFER: depth_texture
     // uniform peel_depth_map: peel_depth_map
-    depth_peel_set_shader_slots (scene.program_id,
-                                 color_texture, depth_texture,
-                                 peel_depth_map);
-
-    glDisable (GL_BLEND);
-    scene_render (&scene);
-
-    glEnable (GL_BLEND);
+    GLuint program_id = scene->programs[SCENE_PROGRAM_PEEL];
+    depth_peel_set_shader_slots (program_id,
+                                 r->color_texture, r->depth_texture,
+                                 r->peel_depth_map);
+    glUniform1i (gl_uniform_location (program_id, "overflow_only"), mode == TRANSPARENCY_KBUFFER);
+
+    gl_disable (GL_BLEND);
+    peel_pass_begin (r, 0);
+    scene_render (scene, SCENE_PROGRAM_PEEL);
+    peel_pass_end (r, 0);
+
+    gl_enable (GL_BLEND);
     int i;
-    for (i = 0; i < num_pass-1; i++) {
+    for (i = 1; i < num_passes; i++) {
         // Swap the depth buffer with peel_depth_map shader slot
-        GLuint tmp = peel_depth_map;
-        peel_depth_map = depth_texture;
-        depth_texture = tmp;
+        GLuint tmp = r->peel_depth_map;
+        r->peel_depth_map = r->depth_texture;
+        r->depth_texture = tmp;
 
         glFramebufferTexture2D (
             GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-            GL_TEXTURE_2D_MULTISAMPLE, depth_texture, 0
+            GL_TEXTURE_2D_MULTISAMPLE, r->depth_texture, 0
         );
 
-        glActiveTexture (GL_TEXTURE0);
-        glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, peel_depth_map);
-        glUniform1i (glGetUniformLocation (scene.program_id, "peel_depth_map"), 0);
+        gl_active_texture (GL_TEXTURE0);
+        glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, r->peel_depth_map);
 
-        glClear(GL_DEPTH_BUFFER_BIT);
+        // NOTE: The copy is skipped too if the pass is. The textures are still
+        // swapped, but no later pass uses them.
+        peel_pass_begin (r, i);
+        copy_opaque_depth (r);
 
         // Render scene using UNDER blending operator
-        glBlendFunc (GL_ONE_MINUS_SRC_ALPHA, GL_ONE);
-        scene_render (&scene);
+        gl_blend_func (GL_ONE_MINUS_SRC_ALPHA, GL_ONE);
+        scene_render (scene, SCENE_PROGRAM_PEEL);
+        peel_pass_end (r, i);
     }
+}
 
-    // Blend resulting color buffer into the window using the OVER operator
-    glBlendFunc (GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-    draw_into_window (graphics);
-    glClearColor(0.164f, 0.203f, 0.223f, 1.0f);
-    glClear (GL_COLOR_BUFFER_BIT);
-    set_texture_clip (&quad_renderer, graphics->screen_width, graphics->screen_height,
-                      0, 0, graphics->width, graphics->height);
-    blend_premul_quad (&quad_renderer, color_texture, true, graphics,
-                        0, 0, graphics->width, graphics->height);
+// Dual depth peeling (Bavoil and Myers 2008), each geometry pass peels the
+// nearest and the farthest layer left. Front layers are accumulated into
+// front_blender and back layers directly into color_texture, at the end front
+// is composited over back.
+void render_dual_depth_peeling (struct transparency_renderer_t *r, struct scene_t *scene, int num_layers)
+{
+    int num_passes = peel_begin_frame (r, TRANSPARENCY_DUAL_DEPTH_PEELING, (num_layers + 1)/2);
+
+    GLenum draw_buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
+    float min_depth[] = {-1, -1, 0, 0};
+    float transparent[] = {0, 0, 0, 0};
+
+    // NOTE: Depth is only tested against the opaque geometry, layers are
+    // selected by comparing against the depth blender.
+    opaque_depth_test_begin (r);
+
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D_MULTISAMPLE, r->depth_blender[0], 0
+    );
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+        GL_TEXTURE_2D_MULTISAMPLE, r->front_blender, 0
+    );
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2,
+        GL_TEXTURE_2D_MULTISAMPLE, r->color_texture, 0
+    );
+    glDrawBuffers (3, draw_buffers);
+    glClearBufferfv (GL_COLOR, 0, min_depth);
+    glClearBufferfv (GL_COLOR, 1, transparent);
+    glClearBufferfv (GL_COLOR, 2, transparent);
+
+    // Initialize depth_blender[0] with the nearest and farthest depth.
+    glDrawBuffers (1, draw_buffers);
+    gl_enable (GL_BLEND);
+    gl_blend_equation (GL_MAX);
+    scene_render (scene, SCENE_PROGRAM_DUAL_PEEL_INIT);
+
+    // Blending of each target, see dual_peel.glsl.
+    glDrawBuffers (3, draw_buffers);
+    gl_blend_equationi (0, GL_MAX);
+    gl_blend_equationi (1, GL_FUNC_ADD);
+    gl_blend_funci (1, GL_ONE_MINUS_DST_ALPHA, GL_ONE);
+    gl_blend_equationi (2, GL_FUNC_ADD);
+    gl_blend_funci (2, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+    GLuint program_id = scene->programs[SCENE_PROGRAM_DUAL_PEEL];
+    gl_use_program (program_id);
+    glUniform1i (gl_uniform_location (program_id, "depth_blender"), 0);
+    gl_active_texture (GL_TEXTURE0);
+
+    int curr = 0;
+    int i;
+    for (i=0; i<num_passes; i++) {
+        int next = 1 - curr;
+        glFramebufferTexture2D (
+            GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D_MULTISAMPLE, r->depth_blender[next], 0
+        );
+
+        peel_pass_begin (r, i);
+        glClearBufferfv (GL_COLOR, 0, min_depth);
+
+        glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, r->depth_blender[curr]);
+        scene_render (scene, SCENE_PROGRAM_DUAL_PEEL);
+        peel_pass_end (r, i);
+        curr = next;
+    }
+
+    // Composite front over back, once per sample.
+    gl_disable (GL_DEPTH_TEST);
+    glDrawBuffers (1, &draw_buffers[2]);
+    gl_blend_equation (GL_FUNC_ADD);
+    gl_blend_func (GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    gl_use_program (r->composite_program_id);
+    glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, r->front_blender);
+    gl_bind_vertex_array (r->composite_vao);
+    glDrawArrays (GL_TRIANGLES, 0, 6);
+
+    // Leave color_texture as the only attachment, like depth peeling does.
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2,
+        GL_TEXTURE_2D_MULTISAMPLE, 0, 0
+    );
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+        GL_TEXTURE_2D_MULTISAMPLE, 0, 0
+    );
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D_MULTISAMPLE, r->color_texture, 0
+    );
+    glDrawBuffers (1, draw_buffers);
+}
+
+// Weighted blended OIT, a single geometry pass regardless of the number of
+// layers. The result is approximate, how close it gets depends on the weight
+// function and the depth range of the scene.
+void render_wboit (struct transparency_renderer_t *r, struct scene_t *scene)
+{
+    GLenum draw_buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+    float transparent[] = {0, 0, 0, 0};
+    float opaque[] = {1, 0, 0, 0};
+
+    opaque_depth_test_begin (r);
+
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D_MULTISAMPLE, r->accum_texture, 0
+    );
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+        GL_TEXTURE_2D_MULTISAMPLE, r->revealage_texture, 0
+    );
+    glDrawBuffers (2, draw_buffers);
+    glClearBufferfv (GL_COLOR, 0, transparent);
+    glClearBufferfv (GL_COLOR, 1, opaque);
+
+    gl_enable (GL_BLEND);
+    gl_blend_equation (GL_FUNC_ADD);
+    gl_blend_funci (0, GL_ONE, GL_ONE);
+    gl_blend_funci (1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+
+    GLuint program_id = scene->programs[SCENE_PROGRAM_WBOIT];
+    gl_use_program (program_id);
+    glUniform1i (gl_uniform_location (program_id, "weight_function"), r->wboit_weight);
+    scene_render (scene, SCENE_PROGRAM_WBOIT);
+
+    // Resolve into color_texture, every sample is overwritten.
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+        GL_TEXTURE_2D_MULTISAMPLE, 0, 0
+    );
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D_MULTISAMPLE, r->color_texture, 0
+    );
+    glDrawBuffers (1, draw_buffers);
+    gl_disable (GL_DEPTH_TEST);
+    gl_disable (GL_BLEND);
+
+    gl_use_program (r->resolve_program_id);
+    gl_active_texture (GL_TEXTURE0);
+    glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, r->accum_texture);
+    gl_active_texture (GL_TEXTURE1);
+    glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, r->revealage_texture);
+    gl_active_texture (GL_TEXTURE0);
+    gl_bind_vertex_array (r->resolve_vao);
+    glDrawArrays (GL_TRIANGLES, 0, 6);
+}
+
+// Reads the fragment count of a previous frame if it's available, without
+// waiting for the GPU.
+void abuffer_poll_fragment_count (struct transparency_renderer_t *r)
+{
+    if (r->abuffer_fence == 0) {
+        return;
+    }
+
+    GLenum status = glClientWaitSync (r->abuffer_fence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+        return;
+    }
+    glDeleteSync (r->abuffer_fence);
+    r->abuffer_fence = 0;
+
+    glBindBuffer (GL_COPY_READ_BUFFER, r->abuffer_readback);
+    glGetBufferSubData (GL_COPY_READ_BUFFER, 0, sizeof(uint32_t), &r->abuffer_num_fragments);
+
+    bool overflow = r->abuffer_num_fragments > r->abuffer_budget;
+    if (overflow && !r->abuffer_overflow) {
+        printf ("Warning: A-buffer overflow, a frame had %u fragments but the budget is %u.\n",
+                r->abuffer_num_fragments, r->abuffer_budget);
+    }
+    r->abuffer_overflow = overflow;
+}
+
+// Per sample linked list A-buffer, a single geometry pass stores every
+// fragment, then a full screen pass sorts and composites them. Exact as long as
+// the budget is not exceeded.
+void render_abuffer (struct transparency_renderer_t *r, struct scene_t *scene)
+{
+    abuffer_poll_fragment_count (r);
+
+    // NOTE: Clearing a texture ignores the scissor, only the lists of samples
+    // inside the bounds are cleared.
+    GLuint end_of_list = ABUFFER_END_OF_LIST;
+    glClearTexSubImage (r->head_pointers, 0,
+                        r->num_samples*r->bounds.min.x, r->bounds.min.y, 0,
+                        r->num_samples*BOX_WIDTH(r->bounds), BOX_HEIGHT(r->bounds), 1,
+                        GL_RED_INTEGER, GL_UNSIGNED_INT, &end_of_list);
+
+    GLuint zero = 0;
+    glBindBuffer (GL_ATOMIC_COUNTER_BUFFER, r->fragment_counter);
+    glBufferSubData (GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(GLuint), &zero);
+
+    glBindImageTexture (0, r->head_pointers, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32UI);
+    glBindBufferBase (GL_ATOMIC_COUNTER_BUFFER, 0, r->fragment_counter);
+    glBindBufferBase (GL_SHADER_STORAGE_BUFFER, 0, r->fragment_buffer);
+
+    // Fragments only go into the lists, nothing is written to the framebuffer.
+    GLenum no_draw_buffer = GL_NONE;
+    glDrawBuffers (1, &no_draw_buffer);
+    opaque_depth_test_begin (r);
+    gl_disable (GL_BLEND);
+
+    GLuint program_id = scene->programs[SCENE_PROGRAM_ABUFFER];
+    gl_use_program (program_id);
+    glUniform1ui (gl_uniform_location (program_id, "max_fragments"), r->abuffer_budget);
+    glUniform1i (gl_uniform_location (program_id, "num_samples"), r->num_samples);
+    scene_render (scene, SCENE_PROGRAM_ABUFFER);
+
+    glMemoryBarrier (GL_SHADER_STORAGE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                     GL_BUFFER_UPDATE_BARRIER_BIT | GL_ATOMIC_COUNTER_BARRIER_BIT);
+
+    if (r->abuffer_fence == 0) {
+        glBindBuffer (GL_COPY_READ_BUFFER, r->fragment_counter);
+        glBindBuffer (GL_COPY_WRITE_BUFFER, r->abuffer_readback);
+        glCopyBufferSubData (GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(GLuint));
+        r->abuffer_fence = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    // Resolve into color_texture, every sample is overwritten.
+    GLenum draw_buffer = GL_COLOR_ATTACHMENT0;
+    glFramebufferTexture2D (
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_TEXTURE_2D_MULTISAMPLE, r->color_texture, 0
+    );
+    glDrawBuffers (1, &draw_buffer);
+    gl_disable (GL_DEPTH_TEST);
+
+    gl_use_program (r->abuffer_resolve_program_id);
+    glUniform1i (gl_uniform_location (r->abuffer_resolve_program_id, "per_pixel_lists"),
+                 !r->per_sample_shading);
+    gl_bind_vertex_array (r->abuffer_resolve_vao);
+    glDrawArrays (GL_TRIANGLES, 0, 6);
+}
+
+// Geometry passes that wrote something in the last frame with known results.
+// Before the results of a mode are known it's the maximum.
+int transparency_used_passes (struct transparency_renderer_t *r, enum transparency_mode_t mode,
+                              int num_layers)
+{
+    if (mode != r->queried_mode) {
+        return transparency_num_passes (mode, num_layers);
+    }
+
+    switch (mode) {
+        case TRANSPARENCY_DEPTH_PEELING:
+            return r->num_used_passes;
+        case TRANSPARENCY_DUAL_DEPTH_PEELING:
+        case TRANSPARENCY_KBUFFER:
+            return 1 + r->num_used_passes;
+        default:
+            return transparency_num_passes (mode, num_layers);
+    }
+}
+
+// Converts the bounds of the transparent geometry to a pixel rectangle of the
+// current frame. Rasterization and multisampling only touch pixels that
+// overlap the geometry, rounding outwards is enough.
+void transparency_compute_bounds (struct transparency_renderer_t *r, struct scene_t *scene)
+{
+    scene_compute_transparent_bounds (scene);
+
+    box_t *ndc = &scene->transparent_bounds;
+    r->bounds.min.x = floor ((ndc->min.x + 1)/2*r->width);
+    r->bounds.min.y = floor ((ndc->min.y + 1)/2*r->height);
+    r->bounds.max.x = ceil ((ndc->max.x + 1)/2*r->width);
+    r->bounds.max.y = ceil ((ndc->max.y + 1)/2*r->height);
+}
+
+// Stencil routed k-buffer (Bavoil et al. 2007). A single geometry pass stores
+// up to k fragments per pixel in the samples of a multisample target, then a
+// full screen pass sorts and composites them. Pixels with more than k layers
+// are depth peeled instead.
+//
+// NOTE: Samples are used as storage, transparent geometry is not antialiased
+// in this mode.
+void render_kbuffer (struct transparency_renderer_t *r, struct scene_t *scene, int num_layers)
+{
+    int k = r->kbuffer_size;
+    float transparent[] = {0, 0, 0, 0};
+    float empty_depth[] = {2, 0, 0, 0};
+    GLenum draw_buffers[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+
+    glBindFramebuffer (GL_FRAMEBUFFER, r->kbuffer_fb);
+    glDrawBuffers (2, draw_buffers);
+    glClearBufferfv (GL_COLOR, 0, transparent);
+    glClearBufferfv (GL_COLOR, 1, empty_depth);
+
+    gl_disable (GL_SAMPLE_SHADING);
+    gl_disable (GL_DEPTH_TEST);
+    gl_disable (GL_BLEND);
+    gl_enable (GL_STENCIL_TEST);
+    gl_stencil_mask (0xFF);
+
+    // Initialize the stencil of sample i to i+2, one full screen pass per
+    // sample.
+    gl_use_program (r->kbuffer_overflow_program_id);
+    gl_bind_vertex_array (r->kbuffer_overflow_vao);
+    gl_color_mask (GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    gl_enable (GL_SAMPLE_MASK);
+    glStencilOp (GL_REPLACE, GL_REPLACE, GL_REPLACE);
+    int i;
+    for (i=0; i<k; i++) {
+        glSampleMaski (0, 1<<i);
+        glStencilFunc (GL_ALWAYS, i + 2, 0xFF);
+        glDrawArrays (GL_TRIANGLES, 0, 6);
+    }
+    gl_disable (GL_SAMPLE_MASK);
+    gl_color_mask (GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+    // Without multisample rasterization a fragment covers every sample of its
+    // pixel. It's only stored in the one with a stencil of 2, and every sample
+    // is decremented, so the next fragment goes to the next sample.
+    gl_disable (GL_MULTISAMPLE);
+    glStencilFunc (GL_EQUAL, 2, 0xFF);
+    glStencilOp (GL_DECR, GL_DECR, GL_DECR);
+
+    GLuint program_id = scene->programs[SCENE_PROGRAM_KBUFFER];
+    gl_use_program (program_id);
+    glUniform1i (gl_uniform_location (program_id, "opaque_depth_map"), 0);
+    gl_active_texture (GL_TEXTURE0);
+    glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, r->opaque_depth_map);
+    scene_render (scene, SCENE_PROGRAM_KBUFFER);
+    gl_enable (GL_MULTISAMPLE);
+
+    // After n fragments sample i has a stencil of i+2-n clamped to 0, the last
+    // one gets to 0 only if there were more than k fragments. The query counts
+    // the pixels that overflowed.
+    GLenum overflow_buffers[] = {GL_NONE, GL_COLOR_ATTACHMENT1};
+    glDrawBuffers (2, overflow_buffers);
+    gl_enable (GL_SAMPLE_MASK);
+    glSampleMaski (0, 1<<(k-1));
+    glStencilFunc (GL_EQUAL, 0, 0xFF);
+    glStencilOp (GL_KEEP, GL_KEEP, GL_KEEP);
+
+    gl_use_program (r->kbuffer_overflow_program_id);
+    gl_bind_vertex_array (r->kbuffer_overflow_vao);
+    glBeginQuery (GL_SAMPLES_PASSED, r->kbuffer_overflow_query);
+    glDrawArrays (GL_TRIANGLES, 0, 6);
+    glEndQuery (GL_SAMPLES_PASSED);
+
+    glSampleMaski (0, 0xFFFFFFFF);
+    gl_disable (GL_SAMPLE_MASK);
+    gl_disable (GL_STENCIL_TEST);
+
+    // Fallback, depth peel the pixels that overflowed. If there are none the
+    // GPU skips every peeling pass. It also clears color_texture.
+    glBindFramebuffer (GL_FRAMEBUFFER, r->fb);
+    set_sample_shading (r);
+
+    GLuint peel_program_id = scene->programs[SCENE_PROGRAM_PEEL];
+    gl_use_program (peel_program_id);
+    glUniform1i (gl_uniform_location (peel_program_id, "kbuffer_depth"), 1);
+    glUniform1i (gl_uniform_location (peel_program_id, "kbuffer_size"), k);
+    gl_active_texture (GL_TEXTURE1);
+    glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, r->kbuffer_depth);
+
+    r->first_pass_condition = r->kbuffer_overflow_query;
+    render_depth_peeling (r, scene, TRANSPARENCY_KBUFFER, num_layers);
+    r->first_pass_condition = 0;
+
+    // Resolve the rest of the pixels, once per pixel.
+    gl_disable (GL_SAMPLE_SHADING);
+    gl_disable (GL_DEPTH_TEST);
+    gl_disable (GL_BLEND);
+
+    gl_use_program (r->kbuffer_resolve_program_id);
+    gl_active_texture (GL_TEXTURE0);
+    glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, r->kbuffer_color);
+    gl_active_texture (GL_TEXTURE1);
+    glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, r->kbuffer_depth);
+    gl_active_texture (GL_TEXTURE0);
+    gl_bind_vertex_array (r->kbuffer_resolve_vao);
+    glDrawArrays (GL_TRIANGLES, 0, 6);
+    set_sample_shading (r);
+}
+
+// Renders the opaque geometry into r->opaque_color_texture and the transparent
+// one with _mode_ into r->color_texture, inside r->bounds. The frame is
+// r->render_scale times the window size. Returns the maximum number of
+// transparent geometry passes used.
+int transparency_render (struct transparency_renderer_t *r, struct scene_t *scene,
+                         app_graphics_t *graphics, enum transparency_mode_t mode, int num_layers)
+{
+    set_sample_shading (r);
+
+    transparency_resize_targets (r, graphics->width, graphics->height);
+    if (!r->has_targets) {
+        return 0;
+    }
+    r->width = CLAMP (round (graphics->width*r->render_scale), 1, r->target_width);
+    r->height = CLAMP (round (graphics->height*r->render_scale), 1, r->target_height);
+    gl_viewport (0, 0, r->width, r->height);
+    gl_scissor (0, 0, r->width, r->height);
+
+    render_opaque (r, scene);
+
+    // NOTE: The scissor also restricts clears and blits, everything below
+    // costs in proportion to the area covered by transparent geometry.
+    transparency_compute_bounds (r, scene);
+    gl_scissor (r->bounds.min.x, r->bounds.min.y, BOX_WIDTH(r->bounds), BOX_HEIGHT(r->bounds));
+
+    // NOTE: If the pool is full only the opaque geometry is shown.
+    if (!transparency_acquire_mode_targets (r, mode)) {
+        transparency_release_mode_targets (r);
+        r->bounds = ZERO_INIT(box_t);
+        return 0;
+    }
+
+    switch (mode) {
+        case TRANSPARENCY_DEPTH_PEELING:
+            render_depth_peeling (r, scene, TRANSPARENCY_DEPTH_PEELING, num_layers);
+            break;
+        case TRANSPARENCY_DUAL_DEPTH_PEELING:
+            render_dual_depth_peeling (r, scene, num_layers);
+            break;
+        case TRANSPARENCY_WBOIT:
+            render_wboit (r, scene);
+            break;
+        case TRANSPARENCY_ABUFFER:
+            render_abuffer (r, scene);
+            break;
+        case TRANSPARENCY_KBUFFER:
+            render_kbuffer (r, scene, num_layers);
+            break;
+        default:
+            invalid_code_path;
+    }
+
+    transparency_release_mode_targets (r);
+    return transparency_num_passes (mode, num_layers);
+}
+
+// Blends the first color attachment of _read_fb_ into the window with the OVER
+// operator, only inside _rect_ (in pixels of the frame, origin at the bottom
+// left). A frame smaller than the window is upscaled, with bilinear filtering
+// when resolving with a blit and nearest otherwise.
+void transparency_present_layer (struct transparency_renderer_t *r, struct quad_renderer_t *quad,
+                                 app_graphics_t *graphics, GLuint read_fb, GLuint texture, box_t *rect)
+{
+    int x0 = rect->min.x, y0 = rect->min.y;
+    int x1 = rect->max.x, y1 = rect->max.y;
+    if (x1 <= x0 || y1 <= y0) {
+        return;
+    }
+
+    int num_samples = r->num_samples;
+    if (r->blit_resolve) {
+        glBindFramebuffer (GL_READ_FRAMEBUFFER, read_fb);
+        glReadBuffer (GL_COLOR_ATTACHMENT0);
+        glBindFramebuffer (GL_DRAW_FRAMEBUFFER, r->resolve_fb);
+
+        // NOTE: Bilinear filtering reads half a texel past the rectangle when
+        // upscaling, clear a border so it doesn't pick up stale pixels.
+        if (r->width != graphics->width || r->height != graphics->height) {
+            float transparent[] = {0, 0, 0, 0};
+            gl_scissor (x0 - 1, y0 - 1, x1 - x0 + 2, y1 - y0 + 2);
+            glClearBufferfv (GL_COLOR, 0, transparent);
+        }
+
+        gl_scissor (x0, y0, x1 - x0, y1 - y0);
+        glBlitFramebuffer (x0, y0, x1, y1, x0, y0, x1, y1, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        texture = r->resolve_texture;
+        num_samples = 0;
+    }
+
+    // NOTE: The rectangle in the window is snapped to pixels, the one sampled
+    // from the frame is made to match it exactly.
+    float scale_x = (float)graphics->width/r->width;
+    float scale_y = (float)graphics->height/r->height;
+    int wx0 = round (x0*scale_x), wy0 = round (y0*scale_y);
+    int wx1 = round (x1*scale_x), wy1 = round (y1*scale_y);
+
+    gl_enable (GL_BLEND);
+    gl_blend_func (GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    draw_into_window (graphics);
+    set_texture_clip (quad, r->target_width, r->target_height,
+                      wx0/scale_x, wy0/scale_y, (wx1 - wx0)/scale_x, (wy1 - wy0)/scale_y);
+    blend_premul_quad (quad, texture, num_samples, graphics,
+                       wx0, graphics->height - wy1, wx1 - wx0, wy1 - wy0);
+}
+
+// Composites the opaque color and then the transparent one into the window.
+// The transparent result is only valid inside its bounds.
+//
+// Samples are resolved by the quad shader, or with glBlitFramebuffer that
+// lets the driver use its own resolve, usually faster.
+void transparency_present (struct transparency_renderer_t *r, struct quad_renderer_t *quad,
+                           app_graphics_t *graphics, bool show_opaque)
+{
+    draw_into_window (graphics);
+    glClearColor(0.164f, 0.203f, 0.223f, 1.0f);
+    glClear (GL_COLOR_BUFFER_BIT);
+    if (!r->has_targets) {
+        return;
+    }
+
+    if (show_opaque) {
+        box_t screen;
+        BOX_X_Y_W_H (screen, 0, 0, r->width, r->height);
+        transparency_present_layer (r, quad, graphics, r->opaque_fb, r->opaque_color_texture, &screen);
+    }
+
+    transparency_present_layer (r, quad, graphics, r->fb, r->color_texture, &r->bounds);
+}
+
+// Frame budget controller. The GPU time of each frame is measured with a
+// GL_TIME_ELAPSED query and the render scale is adjusted so it stays within
+// budget_ms. Results are read a few frames late, when they are available, so
+// the CPU never waits for the GPU.
+//
+// GPU time is roughly proportional to the pixels rendered, the square of the
+// scale. When the smoothed time leaves the band between
+// DYNAMIC_RESOLUTION_LOW and 1 times the budget, the scale is set to the one
+// that would hit DYNAMIC_RESOLUTION_TARGET times the budget. The band keeps the
+// scale from oscillating between frames of similar cost.
+#define DYNAMIC_RESOLUTION_QUERIES 4
+#define DYNAMIC_RESOLUTION_LOW 0.6
+#define DYNAMIC_RESOLUTION_TARGET 0.8
+#define DYNAMIC_RESOLUTION_MAX_STEP 1.25 // when scaling up
+#define DYNAMIC_RESOLUTION_MIN_CHANGE 0.02
+struct dynamic_resolution_t {
+    bool enabled;
+    float budget_ms;
+    float min_scale, max_scale;
+    float scale;
+
+    GLuint queries[DYNAMIC_RESOLUTION_QUERIES];
+    int first_pending;
+    int num_pending;
+    int num_stale;  // pending queries measured at a previous scale
+    bool measuring; // a query was started this frame
+    float gpu_ms;   // smoothed, 0 if there are no measurements at this scale yet
+};
+
+void dynamic_resolution_init (struct dynamic_resolution_t *dr)
+{
+    *dr = (struct dynamic_resolution_t){0};
+    dr->enabled = true;
+    dr->budget_ms = 8;
+    dr->min_scale = 0.5;
+    dr->max_scale = 1;
+    dr->scale = 1;
+    glGenQueries (DYNAMIC_RESOLUTION_QUERIES, dr->queries);
+}
+
+void dynamic_resolution_set_scale (struct dynamic_resolution_t *dr, float scale)
+{
+    scale = CLAMP (scale, dr->min_scale, dr->max_scale);
+    if (fabs (scale - dr->scale) < DYNAMIC_RESOLUTION_MIN_CHANGE) {
+        return;
+    }
+
+    dr->scale = scale;
+    dr->gpu_ms = 0;
+    dr->num_stale = dr->num_pending;
+}
+
+void dynamic_resolution_update (struct dynamic_resolution_t *dr, float frame_ms)
+{
+    dr->gpu_ms = dr->gpu_ms == 0 ? frame_ms : 0.7*dr->gpu_ms + 0.3*frame_ms;
+    if (!dr->enabled) {
+        return;
+    }
+
+    if (dr->gpu_ms > dr->budget_ms ||
+        (dr->gpu_ms < DYNAMIC_RESOLUTION_LOW*dr->budget_ms && dr->scale < dr->max_scale)) {
+        float factor = sqrt (DYNAMIC_RESOLUTION_TARGET*dr->budget_ms/dr->gpu_ms);
+        dynamic_resolution_set_scale (dr, dr->scale*MIN (factor, DYNAMIC_RESOLUTION_MAX_STEP));
+    }
+}
+
+// Reads the results that became available and starts measuring a new frame.
+// Returns the scale the frame should be rendered at.
+float dynamic_resolution_begin_frame (struct dynamic_resolution_t *dr)
+{
+    while (dr->num_pending > 0) {
+        GLuint query = dr->queries[dr->first_pending];
+        GLuint available;
+        glGetQueryObjectuiv (query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            break;
+        }
+
+        GLuint64 elapsed_ns;
+        glGetQueryObjectui64v (query, GL_QUERY_RESULT, &elapsed_ns);
+        dr->first_pending = (dr->first_pending + 1)%DYNAMIC_RESOLUTION_QUERIES;
+        dr->num_pending--;
+
+        if (dr->num_stale > 0) {
+            dr->num_stale--;
+        } else {
+            dynamic_resolution_update (dr, elapsed_ns/1e6);
+        }
+    }
+
+    // NOTE: If the GPU is more than DYNAMIC_RESOLUTION_QUERIES frames behind
+    // this frame is not measured.
+    dr->measuring = dr->num_pending < DYNAMIC_RESOLUTION_QUERIES;
+    if (dr->measuring) {
+        int next = (dr->first_pending + dr->num_pending)%DYNAMIC_RESOLUTION_QUERIES;
+        glBeginQuery (GL_TIME_ELAPSED, dr->queries[next]);
+    }
+
+    return dr->enabled ? dr->scale : 1;
+}
+
+void dynamic_resolution_end_frame (struct dynamic_resolution_t *dr)
+{
+    if (dr->measuring) {
+        glEndQuery (GL_TIME_ELAPSED);
+        dr->num_pending++;
+        dr->measuring = false;
+    }
+}
+
+// Called when the app is about to go idle. If the last frame was rendered
+// below max_scale it returns true and the next one is rendered at max_scale,
+// that's the one left on screen until the next input.
+bool dynamic_resolution_settle (struct dynamic_resolution_t *dr)
+{
+    if (!dr->enabled || dr->scale >= dr->max_scale) {
+        return false;
+    }
+
+    // NOTE: Not dynamic_resolution_set_scale(), small changes must not be
+    // skipped here.
+    dr->scale = dr->max_scale;
+    dr->gpu_ms = 0;
+    dr->num_stale = dr->num_pending;
+    return true;
+}
+
+void dynamic_resolution_toggle (struct dynamic_resolution_t *dr)
+{
+    dr->enabled = !dr->enabled;
+    dr->gpu_ms = 0;
+    dr->num_stale = dr->num_pending;
+}
+
+// Renders the scene with each transparency mode for every number of nested
+// cubes, and prints the geometry passes and GPU time each one needs to resolve
+// all layers. It runs at the full window size, the result is not presented.
+//
+// Peeling modes get the maximum number of layers, the passes column shows the
+// ones that wrote something, out of the ones issued.
+#define BENCHMARK_ITERATIONS 20
+void transparency_benchmark (struct transparency_renderer_t *r, struct scene_t *scene,
+                             app_graphics_t *graphics)
+{
+    int saved_num_cubes = scene->num_cubes;
+    uint32_t saved_sample_threshold = r->sample_threshold;
+    r->sample_threshold = 0;
+    float saved_render_scale = r->render_scale;
+    r->render_scale = 1;
+
+    GLuint query;
+    glGenQueries (1, &query);
+
+    printf ("Transparency benchmark at %dx%d, %dx MSAA with per %s shading, %d iterations.\n",
+            graphics->width, graphics->height, r->num_samples,
+            r->per_sample_shading ? "sample" : "pixel", BENCHMARK_ITERATIONS);
+
+    struct ascii_tbl_t tbl = {0};
+    char *titles[] = {"Layers", "Mode", "Passes", "GPU time (ms)"};
+    int widths[] = {0, 0, 7, 0};
+    int mode;
+    for (mode=0; mode<NUM_TRANSPARENCY_MODES; mode++) {
+        widths[1] = MAX (widths[1], (int)strlen (transparency_mode_names[mode]));
+    }
+    ascii_tbl_header (&tbl, titles, widths, ARRAY_SIZE(titles));
+
+    int num_cubes;
+    for (num_cubes=1; num_cubes<=MAX_CUBES; num_cubes++) {
+        scene->num_cubes = num_cubes;
+        int num_layers = 2*num_cubes;
+
+        for (mode=0; mode<NUM_TRANSPARENCY_MODES; mode++) {
+            if (!transparency_mode_supported (r, scene, mode)) {
+                continue;
+            }
+
+            // NOTE: Not measured, the first frame of a mode may include
+            // driver work like shader recompilation.
+            int num_passes = transparency_render (r, scene, graphics, mode, r->max_layers);
+
+            GLuint64 total_ns = 0;
+            int i;
+            for (i=0; i<BENCHMARK_ITERATIONS; i++) {
+                glBeginQuery (GL_TIME_ELAPSED, query);
+                transparency_render (r, scene, graphics, mode, r->max_layers);
+                glEndQuery (GL_TIME_ELAPSED);
+
+                GLuint64 elapsed_ns;
+                glGetQueryObjectui64v (query, GL_QUERY_RESULT, &elapsed_ns);
+                total_ns += elapsed_ns;
+            }
+
+            // NOTE: The GPU is done with the last iteration, its sample counts
+            // are available.
+            peel_poll_pass_queries (r);
+            char passes[16];
+            snprintf (passes, ARRAY_SIZE(passes), "%d/%d",
+                      transparency_used_passes (r, mode, r->max_layers), num_passes);
+
+            printf ("%*d", widths[0], num_layers);
+            ascii_tbl_sep (&tbl);
+            printf ("%*s", widths[1], transparency_mode_names[mode]);
+            ascii_tbl_sep (&tbl);
+            printf ("%*s", widths[2], passes);
+            ascii_tbl_sep (&tbl);
+            printf ("%*.3f", widths[3], (double)total_ns/BENCHMARK_ITERATIONS/1e6);
+            ascii_tbl_sep (&tbl);
+        }
+    }
+
+    glDeleteQueries (1, &query);
+    scene->num_cubes = saved_num_cubes;
+    r->sample_threshold = saved_sample_threshold;
+    r->render_scale = saved_render_scale;
+}
+
+// Label of a mode for tables and the HUD.
+void transparency_mode_label (char *buff, size_t size,
+                              enum transparency_mode_t mode, enum wboit_weight_t weight)
+{
+    if (mode == TRANSPARENCY_WBOIT) {
+        snprintf (buff, size, "%s (%s)", transparency_mode_names[mode], wboit_weight_names[weight]);
+    } else {
+        snprintf (buff, size, "%s", transparency_mode_names[mode]);
+    }
+}
+
+// Resolves the samples of r->color_texture into _resolve_fb_ and reads it back
+// as RGBA, 4 bytes per pixel. Pixels outside r->bounds are transparent.
+void transparency_read_result (struct transparency_renderer_t *r, struct gl_framebuffer_t *resolve_fb,
+                               app_graphics_t *graphics, uint8_t *pixels)
+{
+    int width = graphics->width, height = graphics->height;
+    float transparent[] = {0, 0, 0, 0};
+    gl_scissor (0, 0, width, height);
+    glBindFramebuffer (GL_DRAW_FRAMEBUFFER, resolve_fb->fb_id);
+    glClearBufferfv (GL_COLOR, 0, transparent);
+
+    int x0 = r->bounds.min.x, y0 = r->bounds.min.y;
+    int x1 = r->bounds.max.x, y1 = r->bounds.max.y;
+    glBindFramebuffer (GL_READ_FRAMEBUFFER, r->fb);
+    glReadBuffer (GL_COLOR_ATTACHMENT0);
+    glBlitFramebuffer (x0, y0, x1, y1, x0, y0, x1, y1, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    glBindFramebuffer (GL_FRAMEBUFFER, resolve_fb->fb_id);
+    glPixelStorei (GL_PACK_ALIGNMENT, 4);
+    glReadPixels (0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+}
+
+// Compares the approximate modes against front to back depth peeling with
+// every layer peeled, which is exact. Errors are in 8 bit units of the
+// premultiplied result, and only pixels covered in either image count.
+void transparency_compare (struct transparency_renderer_t *r, struct scene_t *scene,
+                           app_graphics_t *graphics)
+{
+    int saved_num_cubes = scene->num_cubes;
+    enum wboit_weight_t saved_weight = r->wboit_weight;
+
+    // NOTE: Without a sample threshold peeling only skips passes that would
+    // write nothing, the reference stays exact.
+    uint32_t saved_sample_threshold = r->sample_threshold;
+    r->sample_threshold = 0;
+    float saved_render_scale = r->render_scale;
+    r->render_scale = 1;
+
+    int width = graphics->width, height = graphics->height;
+    mem_pool_t pool = {0};
+    uint8_t *reference = (uint8_t*)mem_pool_push_size (&pool, 4*width*height);
+    uint8_t *pixels = (uint8_t*)mem_pool_push_size (&pool, 4*width*height);
+    struct gl_framebuffer_t resolve_fb = create_framebuffer (width, height);
+
+    struct {
+        enum transparency_mode_t mode;
+        enum wboit_weight_t weight;
+        char label[64];
+    } configs[NUM_TRANSPARENCY_MODES + NUM_WBOIT_WEIGHTS];
+
+    int num_configs = 0;
+    int mode;
+    for (mode=0; mode<NUM_TRANSPARENCY_MODES; mode++) {
+        if (mode == TRANSPARENCY_DEPTH_PEELING || !transparency_mode_supported (r, scene, mode)) {
+            continue;
+        }
+
+        int num_weights = mode == TRANSPARENCY_WBOIT ? NUM_WBOIT_WEIGHTS : 1;
+        int weight;
+        for (weight=0; weight<num_weights; weight++) {
+            configs[num_configs].mode = mode;
+            configs[num_configs].weight = weight;
+            transparency_mode_label (configs[num_configs].label, ARRAY_SIZE(configs[num_configs].label),
+                                     mode, weight);
+            num_configs++;
+        }
+    }
+
+    printf ("Transparency quality against depth peeling at %dx%d.\n", width, height);
+
+    struct ascii_tbl_t tbl = {0};
+    char *titles[] = {"Layers", "Mode", "RMSE", "Max error", "PSNR (dB)"};
+    int widths[] = {0, 0, 6, 0, 0};
+    int i;
+    for (i=0; i<num_configs; i++) {
+        widths[1] = MAX (widths[1], (int)strlen (configs[i].label));
+    }
+    ascii_tbl_header (&tbl, titles, widths, ARRAY_SIZE(titles));
+
+    int num_cubes;
+    for (num_cubes=1; num_cubes<=MAX_CUBES; num_cubes++) {
+        scene->num_cubes = num_cubes;
+        int num_layers = 2*num_cubes;
+
+        transparency_render (r, scene, graphics, TRANSPARENCY_DEPTH_PEELING, num_layers);
+        transparency_read_result (r, &resolve_fb, graphics, reference);
+
+        for (i=0; i<num_configs; i++) {
+            r->wboit_weight = configs[i].weight;
+            transparency_render (r, scene, graphics, configs[i].mode, num_layers);
+            transparency_read_result (r, &resolve_fb, graphics, pixels);
+
+            double sum_sq = 0;
+            int max_error = 0;
+            int num_covered = 0;
+            int p;
+            for (p=0; p<width*height; p++) {
+                uint8_t *ref = reference + 4*p;
+                uint8_t *res = pixels + 4*p;
+                if (ref[3] == 0 && res[3] == 0) {
+                    continue;
+                }
+
+                num_covered++;
+                int c;
+                for (c=0; c<4; c++) {
+                    int d = abs ((int)ref[c] - (int)res[c]);
+                    sum_sq += d*d;
+                    max_error = MAX (max_error, d);
+                }
+            }
+
+            double rmse = num_covered > 0 ? sqrt (sum_sq/(4*num_covered)) : 0;
+
+            printf ("%*d", widths[0], num_layers);
+            ascii_tbl_sep (&tbl);
+            printf ("%*s", widths[1], configs[i].label);
+            ascii_tbl_sep (&tbl);
+            printf ("%*.2f", widths[2], rmse);
+            ascii_tbl_sep (&tbl);
+            printf ("%*d", widths[3], max_error);
+            ascii_tbl_sep (&tbl);
+            if (rmse > 0) {
+                printf ("%*.2f", widths[4], 20*log10 (255/rmse));
+            } else {
+                printf ("%*s", widths[4], "inf");
+            }
+            ascii_tbl_sep (&tbl);
+        }
+    }
+
+    destroy_framebuffer (&resolve_fb);
+    mem_pool_destroy (&pool);
+    scene->num_cubes = saved_num_cubes;
+    r->wboit_weight = saved_weight;
+    r->sample_threshold = saved_sample_threshold;
+    r->render_scale = saved_render_scale;
+}
+
+struct scene_t prepared_scene;
+
+// Called by the platform at startup, possibly from a different thread and
+// before there is a GL context. Work that does not need GL should go here.
+void app_prepare (struct app_state_t *st)
+{
+    scene_prepare (&prepared_scene, &st->memory);
+}
+
+// Small panel in the top left corner showing the camera orientation and the
+// transparency mode. It's only drawn when something changes.
+//
+// The panel and the text are drawn with the GL GUI renderers of gl_gui.h. The
+// compass needs arbitrary paths, it's drawn with cairo into the overlay. With
+// gl_gui false everything goes through cairo, to compare both paths.
+struct camera_hud_t {
+    bool gl_gui_available;
+    bool gl_gui;
+    struct css_box_t panel_style;
+    layout_box_t panel;
+
+    struct gl_css_box_renderer_t boxes;
+#ifdef __PANGO_H__
+    struct gl_text_renderer_t text;
+#endif
+};
+
+void camera_hud_init (struct camera_hud_t *hud, struct quad_renderer_t *quad)
+{
+    hud->boxes = init_gl_css_box_renderer (quad);
+#ifdef __PANGO_H__
+    hud->text = init_gl_text_renderer (quad);
+    hud->gl_gui_available = hud->boxes.program_id != 0 && hud->text.program_id != 0;
+#else
+    // NOTE: Without pango there is no GL text renderer, the panel would be
+    // drawn without its text.
+    hud->gl_gui_available = false;
+#endif
+    hud->gl_gui = hud->gl_gui_available;
+    if (!hud->gl_gui) {
+        printf ("GL GUI renderers are not available, the HUD will be drawn with cairo.\n");
+    }
+
+    hud->panel_style = ZERO_INIT(struct css_box_t);
+    hud->panel_style.border_radius = 5;
+    hud->panel_style.background_color = RGBA (0, 0, 0, 0.5);
+}
+
+void camera_hud_text (struct camera_hud_t *hud, cairo_t *cr, dvec2 pos,
+                      struct font_style_t *font_style, char *str)
+{
+    dvec4 color = RGB (1, 1, 1);
+    if (hud->gl_gui) {
+#ifdef __PANGO_H__
+        gl_text_push (&hud->text, pos, font_style, str, -1, &color, NULL, NULL);
+#endif
+    } else {
+        render_text (cr, pos, font_style, str, -1, &color, NULL, NULL);
+    }
+}
+
+void draw_camera_hud (struct camera_hud_t *hud, struct gui_state_t *gui_st, cairo_t *cr,
+                      struct camera_t *camera, struct transparency_renderer_t *transparency,
+                      enum transparency_mode_t mode, int num_layers, struct dynamic_resolution_t *dyn_res)
+{
+    box_t hud_box;
+    BOX_X_Y_W_H (hud_box, 10, 10, 380, 140);
+    gui_damage_box (gui_st, hud_box);
+
+    cairo_save (cr);
+    cairo_rectangle (cr, hud_box.min.x, hud_box.min.y, BOX_WIDTH(hud_box), BOX_HEIGHT(hud_box));
+    cairo_clip (cr);
+    cairo_clear (cr);
+
+    if (hud->gl_gui) {
+        gl_css_box_renderer_begin (&hud->boxes);
+        hud->panel.box = hud_box;
+        gl_css_box_push (&hud->boxes, &hud->panel_style, &hud->panel);
+#ifdef __PANGO_H__
+        gl_text_begin (&hud->text);
+#endif
+    } else {
+        struct rounded_box_t panel = {hud_box.min.x, hud_box.min.y,
+                                      BOX_WIDTH(hud_box), BOX_HEIGHT(hud_box), 5};
+        rounded_box_path (cr, &panel);
+        cairo_set_source_rgba (cr, 0, 0, 0, 0.5);
+        cairo_fill (cr);
+    }
+
+    // Yaw as a needle, pitch as its length.
+    dvec2 center = DVEC2 (hud_box.min.x + 30, hud_box.min.y + 30);
+    double r = 18;
+    cairo_arc (cr, center.x, center.y, r, 0, 2*M_PI);
+    cairo_set_source_rgba (cr, 1, 1, 1, 0.3);
+    cairo_fill (cr);
+
+    double len = r*cos (camera->pitch);
+    cairo_move_to (cr, center.x, center.y);
+    cairo_line_to (cr, center.x + len*sin (camera->yaw), center.y - len*cos (camera->yaw));
+    cairo_set_source_rgba (cr, 1, 1, 1, 1);
+    cairo_set_line_width (cr, 2);
+    cairo_stroke (cr);
+
+    char str[100];
+    snprintf (str, ARRAY_SIZE(str), "Distance: %.2f", camera->distance);
+    camera_hud_text (hud, cr, DVEC2 (hud_box.min.x + 55, hud_box.min.y + 12),
+                     &gui_st->default_font_style, str);
+
+    char label[64];
+    transparency_mode_label (label, ARRAY_SIZE(label), mode, transparency->wboit_weight);
+    int num_passes = transparency_num_passes (mode, num_layers);
+    int text_len;
+    if (mode == TRANSPARENCY_DEPTH_PEELING || mode == TRANSPARENCY_DUAL_DEPTH_PEELING ||
+        mode == TRANSPARENCY_KBUFFER) {
+        text_len = snprintf (str, ARRAY_SIZE(str), "%s, %d/%d passes",
+                             label, transparency_used_passes (transparency, mode, num_layers), num_passes);
+        if (transparency->sample_threshold > 0) {
+            snprintf (str + text_len, ARRAY_SIZE(str) - text_len, ", threshold %u samples",
+                      transparency->sample_threshold);
+        }
+    } else {
+        text_len = snprintf (str, ARRAY_SIZE(str), "%s, %d %s", label, num_passes, num_passes == 1 ? "pass" : "passes");
+    }
+    if (mode == TRANSPARENCY_ABUFFER) {
+        snprintf (str + text_len, ARRAY_SIZE(str) - text_len, ", %u/%u fragments%s",
+                  transparency->abuffer_num_fragments, transparency->abuffer_budget,
+                  transparency->abuffer_overflow ? " (overflow)" : "");
+    }
+    camera_hud_text (hud, cr, DVEC2 (hud_box.min.x + 55, hud_box.min.y + 32),
+                     &gui_st->default_font_style, str);
+
+    snprintf (str, ARRAY_SIZE(str), "%dx MSAA, per %s shading, %s resolve",
+              transparency->num_samples, transparency->per_sample_shading ? "sample" : "pixel",
+              transparency->blit_resolve ? "blit" : "shader");
+    camera_hud_text (hud, cr, DVEC2 (hud_box.min.x + 55, hud_box.min.y + 52),
+                     &gui_st->default_font_style, str);
+
+    text_len = snprintf (str, ARRAY_SIZE(str), "%.0f%% resolution", 100*transparency->render_scale);
+    if (dyn_res->enabled) {
+        text_len += snprintf (str + text_len, ARRAY_SIZE(str) - text_len, " (%.0f-%.0f%%)",
+                              100*dyn_res->min_scale, 100*dyn_res->max_scale);
+    }
+    if (dyn_res->gpu_ms > 0) {
+        text_len += snprintf (str + text_len, ARRAY_SIZE(str) - text_len, ", GPU %.1f ms", dyn_res->gpu_ms);
+    }
+    if (dyn_res->enabled) {
+        snprintf (str + text_len, ARRAY_SIZE(str) - text_len, ", budget %.0f ms", dyn_res->budget_ms);
+    }
+    camera_hud_text (hud, cr, DVEC2 (hud_box.min.x + 55, hud_box.min.y + 72),
+                     &gui_st->default_font_style, str);
+
+    struct gl_render_target_pool_t *pool = &transparency->target_pool;
+    snprintf (str, ARRAY_SIZE(str), "%.0fx%.0f targets, %.1f/%.1f MB in use",
+              transparency->target_width, transparency->target_height,
+              (double)pool->in_use_bytes/megabyte(1), (double)pool->allocated_bytes/megabyte(1));
+    camera_hud_text (hud, cr, DVEC2 (hud_box.min.x + 55, hud_box.min.y + 92),
+                     &gui_st->default_font_style, str);
+
+    snprintf (str, ARRAY_SIZE(str), "GL calls: %u issued, %u skipped",
+              global_gl_state.last_frame_issued, global_gl_state.last_frame_skipped);
+    camera_hud_text (hud, cr, DVEC2 (hud_box.min.x + 55, hud_box.min.y + 112),
+                     &gui_st->default_font_style, str);
+    cairo_restore (cr);
+}
+
+bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_input_t input)
+{
+    bool blit_needed = false;
+    st->gui_st.gr = *graphics;
+    if (!st->is_initialized) {
+        st->end_execution = false;
+        st->is_initialized = true;
+    }
+
+    update_input (&st->gui_st, input);
+
+    static struct quad_renderer_t quad_renderer;
+    static struct scene_t scene;
+    static bool run_once = false;
+    static struct camera_t main_camera;
+
+    static struct transparency_renderer_t transparency;
+    static enum transparency_mode_t transparency_mode = TRANSPARENCY_DEPTH_PEELING;
+    static struct dynamic_resolution_t dyn_res;
+
+    static struct gl_cairo_overlay_t overlay;
+    static struct camera_hud_t hud;
+
+    if (!run_once) {
+        run_once = true;
+
+        scene = prepared_scene;
+        if (!scene_init (&scene, true)) {
+            st->end_execution = true;
+            return blit_needed;
+        }
+
+        float width = graphics->screen_width;
+        float height = graphics->screen_height;
+
+        // NOTE: Render targets follow the window size, the overlay is created
+        // once for the whole screen.
+        quad_renderer = init_quad_renderer ();
+        if (!transparency_renderer_init (&transparency, &quad_renderer, graphics->width, graphics->height)) {
+            st->end_execution = true;
+            return blit_needed;
+        }
+        dynamic_resolution_init (&dyn_res);
+
+        global_gui_st = &st->gui_st;
+        default_gui_init (&st->gui_st);
+        gl_cairo_overlay_init (&overlay, width, height);
+        camera_hud_init (&hud, &quad_renderer);
+
+        main_camera.near_plane = 0.1;
+        main_camera.far_plane = 100;
+        main_camera.pitch = M_PI/4;
+        main_camera.yaw = M_PI/4;
+        main_camera.distance = 4.5;
+        main_camera.dirty = true;
+        blit_needed = true;
+    }
+
+    // NOTE: The scene is static, we only need to render a new frame if the
+    // camera moved, the window changed size or the platform asks for it.
+    static uint16_t last_width, last_height;
+    bool redraw = input.force_redraw || blit_needed ||
+                  graphics->width != last_width || graphics->height != last_height;
+    last_width = graphics->width;
+    last_height = graphics->height;
+
+    switch (st->gui_st.input.keycode) {
+        case 24: //KEY_Q
+            st->end_execution = true;
+            break;
+        case 10: //KEY_1
+            transparency_mode = TRANSPARENCY_DEPTH_PEELING;
+            redraw = true;
+            break;
+        case 11: //KEY_2
+            transparency_mode = TRANSPARENCY_DUAL_DEPTH_PEELING;
+            redraw = true;
+            break;
+        case 12: //KEY_3
+            transparency_mode = TRANSPARENCY_WBOIT;
+            redraw = true;
+            break;
+        case 13: //KEY_4
+            if (transparency_mode_supported (&transparency, &scene, TRANSPARENCY_ABUFFER)) {
+                transparency_mode = TRANSPARENCY_ABUFFER;
+                redraw = true;
+            }
+            break;
+        case 14: //KEY_5
+            if (transparency_mode_supported (&transparency, &scene, TRANSPARENCY_KBUFFER)) {
+                transparency_mode = TRANSPARENCY_KBUFFER;
+                redraw = true;
+            }
+            break;
+        case 34: //KEY_BRACKETLEFT
+            if (transparency.abuffer_resolve_program_id) {
+                abuffer_set_budget (&transparency, MAX (transparency.abuffer_budget/2, 1024));
+                redraw = true;
+            }
+            break;
+        case 35: //KEY_BRACKETRIGHT
+            if (transparency.abuffer_resolve_program_id) {
+                abuffer_set_budget (&transparency, MIN (transparency.abuffer_budget*2, ABUFFER_MAX_BUDGET));
+                redraw = true;
+            }
+            break;
+        case 20: //KEY_MINUS
+            transparency.max_layers = MAX (transparency.max_layers - 1, 1);
+            redraw = true;
+            break;
+        case 21: //KEY_EQUAL
+            transparency.max_layers = MIN (transparency.max_layers + 1, MAX_PEEL_PASSES);
+            redraw = true;
+            break;
+        case 59: //KEY_COMMA
+            transparency.sample_threshold /= 2;
+            redraw = true;
+            break;
+        case 60: //KEY_PERIOD
+            transparency.sample_threshold = transparency.sample_threshold == 0 ?
+                1 : MIN (transparency.sample_threshold*2, 1<<20);
+            redraw = true;
+            break;
+        case 32: //KEY_O
+            scene.show_opaque = !scene.show_opaque;
+            redraw = true;
+            break;
+        case 58: //KEY_M
+            {
+                int num_samples = transparency.num_samples*2;
+                if (num_samples > transparency.max_samples) {
+                    num_samples = 1;
+                }
+                transparency_set_samples (&transparency, num_samples);
+                redraw = true;
+            } break;
+        case 33: //KEY_P
+            transparency.per_sample_shading = !transparency.per_sample_shading;
+            if (!scene_create_programs (&scene, transparency.per_sample_shading)) {
+                st->end_execution = true;
+            }
+            redraw = true;
+            break;
+        case 41: //KEY_F
+            scene.signed_face_colors = !scene.signed_face_colors;
+            if (!scene_create_programs (&scene, transparency.per_sample_shading)) {
+                st->end_execution = true;
+            }
+            redraw = true;
+            break;
+        case 28: //KEY_T
+            if (hud.gl_gui_available) {
+                hud.gl_gui = !hud.gl_gui;
+                redraw = true;
+            }
+            break;
+        case 55: //KEY_V
+            if (hud.boxes.program_id != 0) {
+                gl_css_box_validate_styles (&hud.boxes, &st->gui_st, graphics, 2);
+                redraw = true;
+            }
+            break;
+        case 27: //KEY_R
+            transparency.blit_resolve = !transparency.blit_resolve;
+            redraw = true;
+            break;
+        case 40: //KEY_D
+            dynamic_resolution_toggle (&dyn_res);
+            redraw = true;
+            break;
+        case 42: //KEY_G
+            dyn_res.budget_ms = MAX (dyn_res.budget_ms - 1, 1);
+            redraw = true;
+            break;
+        case 43: //KEY_H
+            dyn_res.budget_ms = MIN (dyn_res.budget_ms + 1, 100);
+            redraw = true;
+            break;
+        case 25: //KEY_W
+            transparency.wboit_weight = (transparency.wboit_weight + 1)%NUM_WBOIT_WEIGHTS;
+            redraw = true;
+            break;
+        case 111: //KEY_UP
+            scene.num_cubes = MIN (scene.num_cubes + 1, MAX_CUBES);
+            redraw = true;
+            break;
+        case 116: //KEY_DOWN
+            scene.num_cubes = MAX (scene.num_cubes - 1, 1);
+            redraw = true;
+            break;
+        case 56: //KEY_B
+            transparency_benchmark (&transparency, &scene, graphics);
+            redraw = true;
+            break;
+        case 54: //KEY_C
+            transparency_compare (&transparency, &scene, graphics);
+            redraw = true;
+            break;
+        default:
+            //if (input.keycode >= 8) {
+            //    printf ("%" PRIu8 "\n", input.keycode);
+            //    //printf ("%" PRIu16 "\n", input.modifiers);
+            //}
+            break;
+    }
+
+    // NOTE: Holding the button without moving the pointer is idle too.
+    if (st->gui_st.dragging[0] &&
+        (st->gui_st.ptr_delta.x != 0 || st->gui_st.ptr_delta.y != 0)) {
+        dvec2 change = st->gui_st.ptr_delta;
+        main_camera.pitch += 0.01 * change.y;
+        main_camera.yaw -= 0.01 * change.x;
+        main_camera.dirty = true;
+        redraw = true;
+    }
+
+    float wheel = st->gui_st.input.wheel;
+    if (wheel != 1) {
+        main_camera.distance -= (wheel - 1)*main_camera.distance*0.7;
+        main_camera.dirty = true;
+        redraw = true;
+    }
+
+    // NOTE: Frames are only rendered on input, a frame rendered at a low
+    // scale while dragging would otherwise stay on screen.
+    if (!redraw && dynamic_resolution_settle (&dyn_res)) {
+        redraw = true;
+    }
+
+    st->idle = !redraw;
+    st->wakeup_ms = 0;
+    if (!redraw) {
+        // NOTE: Released render targets expire while idle too, wake up when
+        // the next one does so its memory is given back.
+        st->wakeup_ms = gl_render_target_pool_trim (&transparency.target_pool);
+        return false;
+    }
+
+    // NOTE: The HUD shows the calls of the previous frame, this one is not
+    // done yet.
+    gl_state_begin_frame ();
+
+    // NOTE: This is a maximum, peeling stops as soon as no layers are left.
+    int num_layers = transparency.max_layers;
+
+    st->gui_st.gr.cr = overlay.cr;
+    draw_camera_hud (&hud, &st->gui_st, overlay.cr, &main_camera, &transparency, transparency_mode,
+                     num_layers, &dyn_res);
+    gl_cairo_overlay_upload (&overlay, &st->gui_st);
+
+    float width_m = px_to_m_x (graphics, graphics->width);
+    float height_m = px_to_m_y (graphics, graphics->height);
+    if (width_m != main_camera.width_m || height_m != main_camera.height_m) {
+        main_camera.width_m = width_m;
+        main_camera.height_m = height_m;
+        main_camera.dirty = true;
+    }
+
+    scene_update_camera (&scene, &main_camera);
+
+    // NOTE: Only the 3D viewport is measured and scaled, the HUD is always at
+    // full resolution.
+    // NOTE: Resizing or raising the tier can leave the current mode without
+    // room for its targets, switch to depth peeling which always works.
+    transparency_resize_targets (&transparency, graphics->width, graphics->height);
+    if (!transparency_mode_supported (&transparency, &scene, transparency_mode)) {
+        printf ("%s is not supported at this size and tier, switching to %s.\n",
+                transparency_mode_names[transparency_mode],
+                transparency_mode_names[TRANSPARENCY_DEPTH_PEELING]);
+        transparency_mode = TRANSPARENCY_DEPTH_PEELING;
+    }
+
+    transparency.render_scale = dynamic_resolution_begin_frame (&dyn_res);
+    transparency_render (&transparency, &scene, graphics, transparency_mode, num_layers);
+    dynamic_resolution_end_frame (&dyn_res);
+
+    transparency_present (&transparency, &quad_renderer, graphics, scene.show_opaque);
+    gl_uniform_ring_fence (&scene.frame_uniforms);
+    gl_render_target_pool_trim (&transparency.target_pool);
+
+    // NOTE: The compass in the overlay goes over the panel and under the text.
+    if (hud.gl_gui) {
+        draw_into_window (graphics);
+        gl_css_box_renderer_draw (&hud.boxes, graphics);
+    }
+    gl_cairo_overlay_draw (&quad_renderer, &overlay, graphics);
+#ifdef __PANGO_H__
+    if (hud.gl_gui) {
+        gl_text_renderer_draw (&hud.text, graphics);
+    }
+#endif
 
     return true;
 }
@@ -0,0 +1,47 @@
+#version 400 core
+
+// Dual depth peeling pass, peels the nearest and the farthest layer left.
+//
+// Depth uses MAX blending, writing (-1,-1) leaves it unchanged. The front
+// layer is accumulated with the UNDER operator and the back one with OVER, in
+// both cases writing a transparent color leaves the target unchanged. So each
+// fragment only writes to the targets it affects.
+
+layout(location = 0) out vec2 out_depth;
+layout(location = 1) out vec4 out_front;
+layout(location = 2) out vec4 out_back;
+
+uniform sampler2DMS depth_blender;
+
+// Implemented by per_sample_shading.glsl or per_pixel_shading.glsl.
+int sample_index ();
+
+void apply_transparency (vec4 color)
+{
+    vec2 depth = texelFetch (depth_blender, ivec2(gl_FragCoord.xy), sample_index ()).xy;
+    float nearest = -depth.x;
+    float farthest = depth.y;
+    float frag_depth = gl_FragCoord.z;
+
+    out_depth = vec2 (-1, -1);
+    out_front = vec4 (0);
+    out_back = vec4 (0);
+
+    if (frag_depth < nearest || frag_depth > farthest) {
+        // Already peeled. Discarded instead of writing nothing, so the sample
+        // query of the pass only counts fragments that are left.
+        discard;
+    }
+
+    if (frag_depth > nearest && frag_depth < farthest) {
+        // Peeled in a later pass.
+        out_depth = vec2 (-frag_depth, frag_depth);
+        return;
+    }
+
+    if (frag_depth == nearest) {
+        out_front = color;
+    } else {
+        out_back = color;
+    }
+}
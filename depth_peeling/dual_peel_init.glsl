@@ -0,0 +1,11 @@
+#version 400 core
+
+// First pass of dual depth peeling. With MAX blending the depth blender ends
+// up with (-nearest, farthest) depth of each sample.
+
+layout(location = 0) out vec2 out_depth;
+
+void apply_transparency (vec4 color)
+{
+    out_depth = vec2 (-gl_FragCoord.z, gl_FragCoord.z);
+}
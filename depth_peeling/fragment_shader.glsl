@@ -1,25 +1,27 @@
 #version 400 core
-flat in vec3 normal;
 
-out vec4 out_color;
+// Variants, set by scene_create_programs().
+//  SIGNED_FACE_COLORS: Faces pointing to the negative side of an axis get a
+//                      different color than the ones pointing to the positive.
+//  ALPHA: Opacity of all faces.
+#ifndef SIGNED_FACE_COLORS
+#define SIGNED_FACE_COLORS 0
+#endif
+#ifndef ALPHA
+#define ALPHA 0.7
+#endif
 
-uniform sampler2DMS peel_depth_map;
-vec4 apply_depth_peeling (const in vec4 color)
-{
-    float peel_depth = texelFetch (peel_depth_map, ivec2(gl_FragCoord.xy), gl_SampleID).r;
+flat in vec3 normal;
 
-    if (gl_FragCoord.z <= peel_depth) {
-        discard;
-    } else {
-        return color;
-    }
-}
+// Implemented by the file of the transparency technique this shader is linked
+// with, it receives the premultiplied color of the fragment.
+void apply_transparency (vec4 color);
 
 void main()
 {
     vec3 res = vec3(0,0,0);
-    float alpha = 0.7;
-#if 1
+    float alpha = ALPHA;
+#if !SIGNED_FACE_COLORS
     if (normal.x != 0) {
         res = vec3(1,0,0);
     } else if (normal.y != 0) {
@@ -50,5 +52,5 @@ void main()
     }
 #endif
 
-    out_color = apply_depth_peeling (vec4(res * alpha, alpha));
+    apply_transparency (vec4(res * alpha, alpha));
 }
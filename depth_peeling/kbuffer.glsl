@@ -0,0 +1,23 @@
+#version 400 core
+
+// Stencil routed k-buffer (Bavoil et al. 2007), the samples of each pixel
+// store up to k fragments in rasterization order. The stencil test routes each
+// fragment to a single sample, this shader only stores it.
+//
+// NOTE: The k-buffer has a different number of samples than the opaque depth,
+// so it can't be attached and is tested here, against its first sample.
+
+layout(location = 0) out vec4 out_color;
+layout(location = 1) out float out_depth;
+
+uniform sampler2DMS opaque_depth_map;
+
+void apply_transparency (vec4 color)
+{
+    if (gl_FragCoord.z >= texelFetch (opaque_depth_map, ivec2(gl_FragCoord.xy), 0).r) {
+        discard;
+    }
+
+    out_color = color;
+    out_depth = gl_FragCoord.z;
+}
@@ -0,0 +1,12 @@
+#version 400 core
+
+// Marks the pixels that got more fragments than the k-buffer holds. The
+// stencil test selects them, and their last depth slot is set to a negative
+// value.
+
+layout(location = 1) out float out_depth;
+
+void main ()
+{
+    out_depth = -1;
+}
@@ -0,0 +1,54 @@
+#version 400 core
+
+// Sorts the fragments captured by the stencil routed k-buffer and composites
+// them front to back, once per pixel. Pixels that overflowed are left to the
+// depth peeling fallback.
+
+#define MAX_KBUFFER_SIZE 8
+
+out vec4 out_color;
+
+uniform sampler2DMS kbuffer_color;
+uniform sampler2DMS kbuffer_depth;
+uniform int kbuffer_size;
+
+void main ()
+{
+    ivec2 coord = ivec2 (gl_FragCoord.xy);
+    if (texelFetch (kbuffer_depth, coord, kbuffer_size-1).r < 0) {
+        discard;
+    }
+
+    vec4 colors[MAX_KBUFFER_SIZE];
+    float depths[MAX_KBUFFER_SIZE];
+    int count = 0;
+    for (int s=0; s<kbuffer_size; s++) {
+        // NOTE: Slots are filled in order, empty ones have a depth of 2.
+        float depth = texelFetch (kbuffer_depth, coord, s).r;
+        if (depth > 1) {
+            break;
+        }
+
+        // Insertion sort, there are at most 8 fragments.
+        vec4 color = texelFetch (kbuffer_color, coord, s);
+        int i = count;
+        while (i > 0 && depths[i-1] > depth) {
+            colors[i] = colors[i-1];
+            depths[i] = depths[i-1];
+            i--;
+        }
+        colors[i] = color;
+        depths[i] = depth;
+        count++;
+    }
+
+    if (count == 0) {
+        discard;
+    }
+
+    vec4 res = vec4 (0);
+    for (int i=0; i<count; i++) {
+        res += colors[i]*(1 - res.a);
+    }
+    out_color = res;
+}
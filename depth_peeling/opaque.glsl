@@ -0,0 +1,12 @@
+#version 400 core
+
+// Opaque geometry, rendered once before the transparent passes with depth
+// writes. The color arrives premultiplied by the alpha of the scene, it's
+// written back with full alpha.
+
+out vec4 out_color;
+
+void apply_transparency (vec4 color)
+{
+    out_color = vec4 (color.rgb/color.a, 1);
+}
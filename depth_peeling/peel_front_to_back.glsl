@@ -0,0 +1,33 @@
+#version 400 core
+
+// Front to back depth peeling, one layer per geometry pass. The depth test
+// keeps the nearest fragment behind the layer peeled in the previous pass.
+
+out vec4 out_color;
+
+uniform sampler2DMS peel_depth_map;
+
+// Implemented by per_sample_shading.glsl or per_pixel_shading.glsl.
+int sample_index ();
+
+// Set when peeling is the fallback of the k-buffer, then only pixels that
+// overflowed it get peeled, see kbuffer_overflow_fragment.glsl.
+uniform bool overflow_only;
+uniform sampler2DMS kbuffer_depth;
+uniform int kbuffer_size;
+
+void apply_transparency (vec4 color)
+{
+    if (overflow_only &&
+        texelFetch (kbuffer_depth, ivec2(gl_FragCoord.xy), kbuffer_size-1).r >= 0) {
+        discard;
+    }
+
+    float peel_depth = texelFetch (peel_depth_map, ivec2(gl_FragCoord.xy), sample_index ()).r;
+
+    if (gl_FragCoord.z <= peel_depth) {
+        discard;
+    } else {
+        out_color = color;
+    }
+}
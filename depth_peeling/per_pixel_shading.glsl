@@ -0,0 +1,14 @@
+#version 400 core
+
+// Linked with the scene programs when peeling per pixel. The fragment shader
+// runs once per pixel and reads the first sample of the peeling targets. It's
+// cheaper, but at the edges of the geometry samples of a pixel have different
+// depths and layers can get peeled twice or missed.
+//
+// NOTE: Any static use of gl_SampleID makes the shader run per sample, that's
+// why this is a separate file and not a uniform.
+
+int sample_index ()
+{
+    return 0;
+}
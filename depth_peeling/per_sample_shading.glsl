@@ -0,0 +1,9 @@
+#version 400 core
+
+// Linked with the scene programs when peeling per sample. The fragment shader
+// runs for every sample and reads its own sample of the peeling targets.
+
+int sample_index ()
+{
+    return gl_SampleID;
+}
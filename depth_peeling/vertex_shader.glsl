@@ -1,15 +1,25 @@
-#version 150 core
-in vec3 position;
-in vec3 in_normal;
+#version 330 core
+// NOTE: Locations are explicit because the same VAO is used with all the
+// programs of the scene.
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 in_normal;
 
 flat out vec3 normal;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 proj;
+// Written once per camera change and shared by all programs, see
+// struct frame_uniforms_t in depth_peeling.c. Matrices are row major like
+// mat4f.
+layout(std140, row_major) uniform frame_uniforms {
+    mat4 model;
+    mat4 view;
+    mat4 proj;
+    mat4 mvp;
+    float near_plane;
+    float far_plane;
+};
 
 void main()
 {
     normal = in_normal;
-    gl_Position = proj * view * model * vec4(position, 1.0);
+    gl_Position = mvp * vec4(position, 1.0);
 }
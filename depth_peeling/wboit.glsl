@@ -0,0 +1,63 @@
+#version 400 core
+
+// Weighted blended order independent transparency (McGuire and Bavoil 2013).
+// All transparent fragments are rendered in a single pass, accumulating the
+// weighted sum of their colors and the product of their transmittance. The
+// weight approximates occlusion so nearer fragments dominate the average.
+//
+// accum uses additive blending and revealage multiplies by (1 - alpha), see
+// wboit_resolve_fragment.glsl.
+
+layout(location = 0) out vec4 out_accum;
+layout(location = 1) out float out_revealage;
+
+// Must match enum wboit_weight_t in depth_peeling.c
+#define WEIGHT_CONSTANT 0
+#define WEIGHT_DISTANCE_7 1
+#define WEIGHT_DISTANCE_8 2
+#define WEIGHT_DISTANCE_9 3
+#define WEIGHT_DEPTH_10 4
+uniform int weight_function;
+
+// NOTE: Must match the block in vertex_shader.glsl.
+layout(std140, row_major) uniform frame_uniforms {
+    mat4 model;
+    mat4 view;
+    mat4 proj;
+    mat4 mvp;
+    float near_plane;
+    float far_plane;
+};
+
+// Distance from the camera to the fragment, from the window space depth.
+float view_depth ()
+{
+    float ndc_z = 2*gl_FragCoord.z - 1;
+    return 2*near_plane*far_plane/(far_plane + near_plane - ndc_z*(far_plane - near_plane));
+}
+
+// Weight functions from equations 7 to 10 of the paper.
+float weight (float alpha)
+{
+    float z = view_depth ();
+    switch (weight_function) {
+        case WEIGHT_DISTANCE_7:
+            return alpha*clamp (10/(1e-5 + pow (z/5, 2) + pow (z/200, 6)), 1e-2, 3e3);
+        case WEIGHT_DISTANCE_8:
+            return alpha*clamp (10/(1e-5 + pow (z/10, 3) + pow (z/200, 6)), 1e-2, 3e3);
+        case WEIGHT_DISTANCE_9:
+            return alpha*clamp (0.03/(1e-5 + pow (z/200, 4)), 1e-2, 3e3);
+        case WEIGHT_DEPTH_10:
+            return alpha*max (1e-2, 3e3*pow (1 - gl_FragCoord.z, 3));
+        case WEIGHT_CONSTANT:
+        default:
+            return 1;
+    }
+}
+
+void apply_transparency (vec4 color)
+{
+    float w = weight (color.a);
+    out_accum = color*w;
+    out_revealage = color.a;
+}
@@ -0,0 +1,20 @@
+#version 400 core
+
+// Resolves weighted blended OIT into premultiplied color, once per sample.
+// The weighted average color is scaled by the total coverage of the sample.
+
+out vec4 out_color;
+
+uniform sampler2DMS accum;
+uniform sampler2DMS revealage;
+
+void main ()
+{
+    ivec2 coord = ivec2(gl_FragCoord.xy);
+    vec4 sum = texelFetch (accum, coord, gl_SampleID);
+    float transmittance = texelFetch (revealage, coord, gl_SampleID).r;
+
+    vec3 average = sum.rgb/max (sum.a, 1e-5);
+    float alpha = 1 - transmittance;
+    out_color = vec4 (average*alpha, alpha);
+}
@@ -0,0 +1,859 @@
+/*
+ * Copiright (C) 2018 Santiago León O.
+ */
+
+#if !defined(GL_GUI_H)
+// GL renderer for css_box_t, an alternative to css_box_draw() that does no
+// rasterization on the CPU.
+//
+// Boxes are collected into an array of vec4 that is uploaded into a buffer
+// texture, then all of them are drawn with a single instanced draw of the quad
+// in quad_renderer_t. The fragment shader (css_box_fragment.glsl) evaluates
+// fill, border, gradient and shadows analytically for each pixel.
+//
+// Text content is drawn separately by gl_text_renderer_t, which needs Pango.
+
+#define GL_GUI_MAX_GRADIENT_STOPS 4
+#define GL_GUI_MAX_SHADOWS 4
+
+// Layout of a box in the buffer texture, in vec4 units. Must match the
+// shaders.
+#define GL_GUI_BOX_RECT 0
+#define GL_GUI_BOX_EXTENTS 1
+#define GL_GUI_BOX_PARAMS 2
+#define GL_GUI_BOX_COUNTS 3
+#define GL_GUI_BOX_BACKGROUND 4
+#define GL_GUI_BOX_BORDER_COLOR 5
+#define GL_GUI_BOX_GRADIENT_STOPS 6
+#define GL_GUI_BOX_OUTSET_SHADOWS (GL_GUI_BOX_GRADIENT_STOPS+GL_GUI_MAX_GRADIENT_STOPS)
+#define GL_GUI_BOX_INSET_SHADOWS (GL_GUI_BOX_OUTSET_SHADOWS+2*GL_GUI_MAX_SHADOWS)
+#define GL_GUI_BOX_STRIDE (GL_GUI_BOX_INSET_SHADOWS+2*GL_GUI_MAX_SHADOWS)
+
+struct gl_css_box_renderer_t {
+    GLuint program_id;
+    GLuint vao;
+
+    GLuint buffer;
+    GLuint buffer_texture;
+    uint32_t buffer_capacity; // in boxes
+
+    mem_pool_t pool;
+    uint32_t capacity; // in boxes
+    uint32_t num_boxes;
+    float *data;
+};
+
+struct gl_css_box_renderer_t init_gl_css_box_renderer (struct quad_renderer_t *quad)
+{
+    struct gl_css_box_renderer_t res = {0};
+
+    res.program_id = gl_program ("css_box_vertex.glsl", "css_box_fragment.glsl");
+    if (!res.program_id) {
+        return res;
+    }
+
+    // Reuse the vertices of the quad renderer.
+    res.vao = quad_renderer_vao (quad, res.program_id);
+
+    glGenBuffers (1, &res.buffer);
+    glGenTextures (1, &res.buffer_texture);
+
+    gl_use_program (res.program_id);
+    glUniform1i (gl_uniform_location (res.program_id, "box_data"), 0);
+    return res;
+}
+
+void gl_css_box_renderer_begin (struct gl_css_box_renderer_t *r)
+{
+    r->num_boxes = 0;
+}
+
+static inline
+void gl_css_box_set_vec4 (float *box_data, int idx, double x, double y, double z, double w)
+{
+    box_data[4*idx+0] = x;
+    box_data[4*idx+1] = y;
+    box_data[4*idx+2] = z;
+    box_data[4*idx+3] = w;
+}
+
+// Returns the number of shadows written.
+int gl_css_box_set_shadows (float *box_data, int idx, struct box_shadow_t *shadow)
+{
+    int count = 0;
+    while (shadow != NULL) {
+        if (count == GL_GUI_MAX_SHADOWS) {
+            printf ("Warning: Box has more than %d shadows, ignoring the rest.\n", GL_GUI_MAX_SHADOWS);
+            break;
+        }
+
+        gl_css_box_set_vec4 (box_data, idx + 2*count,
+                             shadow->h_offset, shadow->v_offset,
+                             shadow->blur_radius, shadow->spread_distance);
+        gl_css_box_set_vec4 (box_data, idx + 2*count + 1, ARGS_RGBA(shadow->color));
+        count++;
+        shadow = shadow->next;
+    }
+    return count;
+}
+
+// Adds a box to the batch, boxes are drawn in the order they are pushed.
+void gl_css_box_push (struct gl_css_box_renderer_t *r, struct css_box_t *css, layout_box_t *layout)
+{
+    if (r->num_boxes == r->capacity) {
+        uint32_t new_capacity = MAX (2*r->capacity, NUM_LAYOUT_BOXES_ALLOCATED);
+        float *new_data =
+            (float*)mem_pool_push_size (&r->pool, new_capacity*GL_GUI_BOX_STRIDE*4*sizeof(float));
+        memcpy (new_data, r->data, r->num_boxes*GL_GUI_BOX_STRIDE*4*sizeof(float));
+        r->data = new_data;
+        r->capacity = new_capacity;
+    }
+
+    float *box_data = r->data + r->num_boxes*GL_GUI_BOX_STRIDE*4;
+    memset (box_data, 0, GL_GUI_BOX_STRIDE*4*sizeof(float));
+    r->num_boxes++;
+
+    box_t *b = &layout->box;
+    gl_css_box_set_vec4 (box_data, GL_GUI_BOX_RECT, b->min.x, b->min.y, BOX_WIDTH(*b), BOX_HEIGHT(*b));
+
+    // Outset shadows are gaussians, 3 standard deviations (1.5 blur radius)
+    // cover everything visible.
+    box_t extents = *b;
+    struct box_shadow_t *shadow = css->outset_shadows;
+    while (shadow != NULL) {
+        double extent = 1.5*shadow->blur_radius + shadow->spread_distance + 1;
+        extents.min.x = MIN (extents.min.x, b->min.x + shadow->h_offset - extent);
+        extents.min.y = MIN (extents.min.y, b->min.y + shadow->v_offset - extent);
+        extents.max.x = MAX (extents.max.x, b->max.x + shadow->h_offset + extent);
+        extents.max.y = MAX (extents.max.y, b->max.y + shadow->v_offset + extent);
+        shadow = shadow->next;
+    }
+    gl_css_box_set_vec4 (box_data, GL_GUI_BOX_EXTENTS,
+                         extents.min.x, extents.min.y, BOX_WIDTH(extents), BOX_HEIGHT(extents));
+
+    int num_stops = MIN (css->num_gradient_stops, GL_GUI_MAX_GRADIENT_STOPS);
+    if (num_stops < css->num_gradient_stops) {
+        printf ("Warning: Gradient has more than %d stops, ignoring the rest.\n", GL_GUI_MAX_GRADIENT_STOPS);
+    }
+    gl_css_box_set_vec4 (box_data, GL_GUI_BOX_PARAMS, css->border_radius, css->border_width, num_stops, 0);
+
+    gl_css_box_set_vec4 (box_data, GL_GUI_BOX_BACKGROUND, ARGS_RGBA(css->background_color));
+    gl_css_box_set_vec4 (box_data, GL_GUI_BOX_BORDER_COLOR, ARGS_RGBA(css->border_color));
+
+    int i;
+    for (i=0; i<num_stops; i++) {
+        gl_css_box_set_vec4 (box_data, GL_GUI_BOX_GRADIENT_STOPS + i, ARGS_RGBA(css->gradient_stops[i]));
+    }
+
+    int num_outset = gl_css_box_set_shadows (box_data, GL_GUI_BOX_OUTSET_SHADOWS, css->outset_shadows);
+    int num_inset = gl_css_box_set_shadows (box_data, GL_GUI_BOX_INSET_SHADOWS, css->inset_shadows);
+    gl_css_box_set_vec4 (box_data, GL_GUI_BOX_COUNTS, num_outset, num_inset, 0, 0);
+}
+
+// Pushes all layout boxes of the gui state that have a style.
+void gl_css_box_push_layout_boxes (struct gl_css_box_renderer_t *r, struct gui_state_t *gui_st)
+{
+    int i;
+    for (i=0; i<gui_st->num_layout_boxes; i++) {
+        layout_box_t *layout = &gui_st->layout_boxes[i];
+        if (layout->style != NULL) {
+            gl_css_box_push (r, layout->style, layout);
+        }
+    }
+}
+
+// Draws all pushed boxes into the currently bound framebuffer, which is
+// expected to have the size of the window.
+void gl_css_box_renderer_draw (struct gl_css_box_renderer_t *r, app_graphics_t *graphics)
+{
+    if (r->num_boxes == 0 || r->program_id == 0) {
+        return;
+    }
+
+    uint32_t size = r->num_boxes*GL_GUI_BOX_STRIDE*4*sizeof(float);
+    glBindBuffer (GL_TEXTURE_BUFFER, r->buffer);
+    if (r->num_boxes > r->buffer_capacity) {
+        glBufferData (GL_TEXTURE_BUFFER, size, r->data, GL_STREAM_DRAW);
+        r->buffer_capacity = r->num_boxes;
+    } else {
+        // NOTE: Orphan the old storage so we don't wait for the previous
+        // draw to finish reading it.
+        glBufferData (GL_TEXTURE_BUFFER, r->buffer_capacity*GL_GUI_BOX_STRIDE*4*sizeof(float),
+                      NULL, GL_STREAM_DRAW);
+        glBufferSubData (GL_TEXTURE_BUFFER, 0, size, r->data);
+    }
+
+    gl_active_texture (GL_TEXTURE0);
+    glBindTexture (GL_TEXTURE_BUFFER, r->buffer_texture);
+    glTexBuffer (GL_TEXTURE_BUFFER, GL_RGBA32F, r->buffer);
+
+    gl_use_program (r->program_id);
+    glUniform2f (gl_uniform_location (r->program_id, "window_size"), graphics->width, graphics->height);
+
+    gl_bind_vertex_array (r->vao);
+    gl_disable (GL_DEPTH_TEST);
+    gl_enable (GL_BLEND);
+    gl_blend_func (GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glDrawArraysInstanced (GL_TRIANGLES, 0, 6, r->num_boxes);
+}
+
+// Compares the GL renderer against css_box_draw() for the layout boxes in
+// gui_st. Both are drawn over a transparent background, the GL result is read
+// back and compared pixel by pixel. Returns the number of pixels where some
+// channel differs by more than _tolerance_ (0-255).
+//
+// To get results that don't depend on the driver run with Mesa's software
+// rasterizer (LIBGL_ALWAYS_SOFTWARE=1).
+//
+// NOTE: Text is not drawn by the GL renderer, so boxes with content will
+// differ. This also changes the current framebuffer binding.
+int gl_css_box_validate (struct gl_css_box_renderer_t *r, struct gui_state_t *gui_st,
+                         app_graphics_t *graphics, int tolerance)
+{
+    int width = graphics->width, height = graphics->height;
+
+    // Reference image from cairo.
+    cairo_surface_t *reference = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+    app_graphics_t cairo_gr = *graphics;
+    cairo_gr.cr = cairo_create (reference);
+    int i;
+    for (i=0; i<gui_st->num_layout_boxes; i++) {
+        layout_box_t *layout = &gui_st->layout_boxes[i];
+        if (layout->style != NULL && layout->content.type == LAYOUT_CONTENT_NONE) {
+            css_box_draw (&cairo_gr, layout->style, layout);
+        }
+    }
+    cairo_surface_flush (reference);
+
+    // GL image.
+    struct gl_framebuffer_t fb = create_framebuffer (width, height);
+    draw_into_full_framebuffer (fb);
+    glClearColor (0, 0, 0, 0);
+    glClear (GL_COLOR_BUFFER_BIT);
+
+    gl_css_box_renderer_begin (r);
+    for (i=0; i<gui_st->num_layout_boxes; i++) {
+        layout_box_t *layout = &gui_st->layout_boxes[i];
+        if (layout->style != NULL && layout->content.type == LAYOUT_CONTENT_NONE) {
+            gl_css_box_push (r, layout->style, layout);
+        }
+    }
+    gl_css_box_renderer_draw (r, graphics);
+
+    mem_pool_t pool = {0};
+    uint32_t *pixels = (uint32_t*)mem_pool_push_size (&pool, width*height*sizeof(uint32_t));
+    glPixelStorei (GL_PACK_ALIGNMENT, 4);
+    glReadPixels (0, 0, width, height, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, pixels);
+
+    int num_different = 0;
+    int max_difference = 0;
+    uint8_t *ref_data = cairo_image_surface_get_data (reference);
+    int ref_stride = cairo_image_surface_get_stride (reference);
+    int y;
+    for (y=0; y<height; y++) {
+        // NOTE: GL rows start at the bottom.
+        uint32_t *ref_row = (uint32_t*)(ref_data + y*ref_stride);
+        uint32_t *gl_row = pixels + (height - 1 - y)*width;
+
+        int x;
+        for (x=0; x<width; x++) {
+            bool different = false;
+            int c;
+            for (c=0; c<4; c++) {
+                int d = abs ((int)((ref_row[x] >> (8*c)) & 0xFF) - (int)((gl_row[x] >> (8*c)) & 0xFF));
+                max_difference = MAX (max_difference, d);
+                if (d > tolerance) {
+                    different = true;
+                }
+            }
+
+            if (different) {
+                num_different++;
+            }
+        }
+    }
+
+    printf ("CSS box validation: %d of %d pixels differ by more than %d (max difference %d).\n",
+            num_different, width*height, tolerance, max_difference);
+
+    mem_pool_destroy (&pool);
+    destroy_framebuffer (&fb);
+    cairo_destroy (cairo_gr.cr);
+    cairo_surface_destroy (reference);
+    return num_different;
+}
+
+// Runs gl_css_box_validate() on one box of each style of gui_st, laid out in a
+// grid. Layout boxes of the current frame are kept.
+int gl_css_box_validate_styles (struct gl_css_box_renderer_t *r, struct gui_state_t *gui_st,
+                                app_graphics_t *graphics, int tolerance)
+{
+    int num_layout_boxes = gui_st->num_layout_boxes;
+
+    // NOTE: Boxes are spaced so their shadows don't overlap.
+    double x = 20, y = 20;
+    int style;
+    for (style=CSS_NONE+1; style<CSS_NUM_STYLES; style++) {
+        layout_box_t *layout = next_layout_box ((css_style_t)style);
+        BOX_X_Y_W_H (layout->box, x, y, 120, 40);
+
+        x += 140;
+        if (x + 120 > graphics->width) {
+            x = 20;
+            y += 60;
+        }
+    }
+
+    int res = gl_css_box_validate (r, gui_st, graphics, tolerance);
+    gui_st->num_layout_boxes = num_layout_boxes;
+    return res;
+}
+
+#ifdef __PANGO_H__
+/////////////////
+// TEXT
+//
+// Text of layout boxes is drawn from a glyph atlas, all glyphs of the frame in
+// a single instanced draw. Strings are shaped once by the run cache in gui.h,
+// and each glyph is rasterized once with Pango into the atlas, afterwards
+// drawing text only looks up glyphs in a hash table.
+//
+// The atlas is split into horizontal pages, each one packed with a skyline
+// packer. When no page has space for a new glyph, the least recently used
+// page is cleared and all its glyphs are rasterized again the next time they
+// are needed. Pages used in the current frame are never evicted.
+
+#define GL_GLYPH_ATLAS_SIZE 1024
+#define GL_GLYPH_ATLAS_PAGE_HEIGHT 128
+#define GL_GLYPH_ATLAS_NUM_PAGES (GL_GLYPH_ATLAS_SIZE/GL_GLYPH_ATLAS_PAGE_HEIGHT)
+#define GL_GLYPH_PADDING 1
+
+// Layout of an instance in the buffer texture, in vec4 units. Must match
+// text_vertex.glsl.
+#define GL_TEXT_INSTANCE_RECT 0
+#define GL_TEXT_INSTANCE_UV_RECT 1
+#define GL_TEXT_INSTANCE_COLOR 2
+#define GL_TEXT_INSTANCE_STRIDE 3
+
+struct skyline_node_t {
+    int x, y, width;
+};
+
+struct gl_glyph_atlas_page_t {
+    uint32_t generation;
+    uint64_t last_used_frame;
+
+    int num_nodes;
+    struct skyline_node_t nodes[GL_GLYPH_ATLAS_SIZE+1];
+};
+
+struct gl_glyph_t {
+    bool used;
+    uint64_t key; // font_idx << 32 | glyph
+
+    // A glyph without ink (like a space) has nothing to draw.
+    bool empty;
+
+    // The glyph is in the atlas only if page != -1 and the generation matches
+    // the one of the page.
+    int page;
+    uint32_t generation;
+
+    // In atlas texels, including padding.
+    int x, y, width, height;
+    // Top left corner of the bitmap relative to the glyph origin.
+    int bearing_x, bearing_y;
+};
+
+struct gl_text_renderer_t {
+    GLuint program_id;
+    GLuint vao;
+
+    GLuint atlas_texture;
+    struct gl_glyph_atlas_page_t *pages;
+
+    // Open addressing hash table with linear probing, grows to keep the load
+    // factor under 0.5.
+    uint32_t glyph_table_size;
+    uint32_t num_glyphs;
+    struct gl_glyph_t *glyph_table;
+
+    PangoGlyphString *glyph_string;
+    uint64_t frame;
+
+    GLuint buffer;
+    GLuint buffer_texture;
+    uint32_t buffer_capacity; // in instances
+
+    mem_pool_t pool;
+    uint32_t capacity; // in instances
+    uint32_t num_instances;
+    float *data;
+
+    // Statistics of the last frame.
+    uint32_t num_rasterized;
+    uint32_t num_evicted;
+};
+
+struct gl_text_renderer_t init_gl_text_renderer (struct quad_renderer_t *quad)
+{
+    struct gl_text_renderer_t res = {0};
+
+    res.program_id = gl_program ("text_vertex.glsl", "text_fragment.glsl");
+    if (!res.program_id) {
+        return res;
+    }
+
+    res.vao = quad_renderer_vao (quad, res.program_id);
+
+    glGenBuffers (1, &res.buffer);
+    glGenTextures (1, &res.buffer_texture);
+
+    glGenTextures (1, &res.atlas_texture);
+    glBindTexture (GL_TEXTURE_2D, res.atlas_texture);
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_R8, GL_GLYPH_ATLAS_SIZE, GL_GLYPH_ATLAS_SIZE,
+                  0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+    // NOTE: Glyphs are drawn at integer positions with 1 texel per pixel.
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    res.pages = mem_pool_push_array (&res.pool, GL_GLYPH_ATLAS_NUM_PAGES, struct gl_glyph_atlas_page_t);
+    int i;
+    for (i=0; i<GL_GLYPH_ATLAS_NUM_PAGES; i++) {
+        struct gl_glyph_atlas_page_t *page = &res.pages[i];
+        page->generation = 0;
+        page->last_used_frame = 0;
+        page->num_nodes = 1;
+        page->nodes[0] = (struct skyline_node_t){0, 0, GL_GLYPH_ATLAS_SIZE};
+    }
+
+    res.glyph_table_size = 1024;
+    res.glyph_table = calloc (res.glyph_table_size, sizeof(struct gl_glyph_t));
+
+    res.glyph_string = pango_glyph_string_new ();
+    pango_glyph_string_set_size (res.glyph_string, 1);
+    memset (res.glyph_string->glyphs, 0, sizeof(PangoGlyphInfo));
+    res.glyph_string->log_clusters[0] = 0;
+
+    gl_use_program (res.program_id);
+    glUniform1i (gl_uniform_location (res.program_id, "instance_data"), 0);
+    glUniform1i (gl_uniform_location (res.program_id, "atlas"), 1);
+    return res;
+}
+
+// Bottom-left skyline packing. Places the rectangle where its top is the
+// lowest, returns false if it doesn't fit in the page.
+bool skyline_pack (struct gl_glyph_atlas_page_t *page, int width, int height, int *x, int *y)
+{
+    struct skyline_node_t *nodes = page->nodes;
+    int best_idx = -1, best_y = GL_GLYPH_ATLAS_PAGE_HEIGHT;
+
+    int i;
+    for (i=0; i<page->num_nodes; i++) {
+        if (nodes[i].x + width > GL_GLYPH_ATLAS_SIZE) {
+            break;
+        }
+
+        // Highest node under the rectangle if its left side is at node i.
+        int top = 0, remaining = width, j = i;
+        while (remaining > 0) {
+            top = MAX (top, nodes[j].y);
+            remaining -= nodes[j].width;
+            j++;
+        }
+
+        if (top + height <= GL_GLYPH_ATLAS_PAGE_HEIGHT && top < best_y) {
+            best_idx = i;
+            best_y = top;
+        }
+    }
+
+    if (best_idx == -1) {
+        return false;
+    }
+
+    *x = nodes[best_idx].x;
+    *y = best_y;
+
+    // Insert the node for the top of the new rectangle, then shrink or remove
+    // the nodes it covers.
+    memmove (&nodes[best_idx+1], &nodes[best_idx], (page->num_nodes - best_idx)*sizeof(struct skyline_node_t));
+    nodes[best_idx] = (struct skyline_node_t){*x, best_y + height, width};
+    page->num_nodes++;
+
+    i = best_idx + 1;
+    while (i < page->num_nodes) {
+        int prev_end = nodes[i-1].x + nodes[i-1].width;
+        if (nodes[i].x >= prev_end) {
+            break;
+        }
+
+        int overlap = prev_end - nodes[i].x;
+        nodes[i].x += overlap;
+        nodes[i].width -= overlap;
+        if (nodes[i].width > 0) {
+            break;
+        }
+
+        memmove (&nodes[i], &nodes[i+1], (page->num_nodes - i - 1)*sizeof(struct skyline_node_t));
+        page->num_nodes--;
+    }
+
+    // Merge neighbors of the same height.
+    i = 0;
+    while (i < page->num_nodes - 1) {
+        if (nodes[i].y == nodes[i+1].y) {
+            nodes[i].width += nodes[i+1].width;
+            memmove (&nodes[i+1], &nodes[i+2], (page->num_nodes - i - 2)*sizeof(struct skyline_node_t));
+            page->num_nodes--;
+        } else {
+            i++;
+        }
+    }
+    return true;
+}
+
+bool gl_glyph_atlas_alloc (struct gl_text_renderer_t *r, int width, int height,
+                           int *page_idx, int *x, int *y)
+{
+    int i;
+    for (i=0; i<GL_GLYPH_ATLAS_NUM_PAGES; i++) {
+        if (skyline_pack (&r->pages[i], width, height, x, y)) {
+            *page_idx = i;
+            return true;
+        }
+    }
+
+    int lru = -1;
+    for (i=0; i<GL_GLYPH_ATLAS_NUM_PAGES; i++) {
+        struct gl_glyph_atlas_page_t *page = &r->pages[i];
+        if (page->last_used_frame != r->frame &&
+            (lru == -1 || page->last_used_frame < r->pages[lru].last_used_frame)) {
+            lru = i;
+        }
+    }
+
+    if (lru == -1) {
+        return false;
+    }
+
+    struct gl_glyph_atlas_page_t *page = &r->pages[lru];
+    page->generation++;
+    page->num_nodes = 1;
+    page->nodes[0] = (struct skyline_node_t){0, 0, GL_GLYPH_ATLAS_SIZE};
+    r->num_evicted++;
+
+    *page_idx = lru;
+    return skyline_pack (page, width, height, x, y);
+}
+
+void gl_glyph_rasterize (struct gl_text_renderer_t *r, struct gl_glyph_t *g,
+                         PangoFont *font, PangoGlyph glyph)
+{
+    PangoRectangle ink;
+    pango_font_get_glyph_extents (font, glyph, &ink, NULL);
+
+    int x0 = PANGO_PIXELS_FLOOR (ink.x);
+    int y0 = PANGO_PIXELS_FLOOR (ink.y);
+    int x1 = PANGO_PIXELS_CEIL (ink.x + ink.width);
+    int y1 = PANGO_PIXELS_CEIL (ink.y + ink.height);
+    if (x1 <= x0 || y1 <= y0) {
+        g->empty = true;
+        return;
+    }
+
+    int width = x1 - x0 + 2*GL_GLYPH_PADDING;
+    int height = y1 - y0 + 2*GL_GLYPH_PADDING;
+    if (width > GL_GLYPH_ATLAS_SIZE || height > GL_GLYPH_ATLAS_PAGE_HEIGHT) {
+        printf ("Warning: Glyph of %dx%d doesn't fit in the glyph atlas.\n", width, height);
+        g->empty = true;
+        return;
+    }
+
+    int page_idx, x, y;
+    if (!gl_glyph_atlas_alloc (r, width, height, &page_idx, &x, &y)) {
+        printf ("Warning: Glyph atlas is full, text will be missing.\n");
+        g->page = -1;
+        return;
+    }
+
+    g->page = page_idx;
+    g->generation = r->pages[page_idx].generation;
+    g->x = x;
+    g->y = page_idx*GL_GLYPH_ATLAS_PAGE_HEIGHT + y;
+    g->width = width;
+    g->height = height;
+    g->bearing_x = x0 - GL_GLYPH_PADDING;
+    g->bearing_y = y0 - GL_GLYPH_PADDING;
+
+    // NOTE: The padding is uploaded too, so it clears whatever an evicted
+    // glyph left there. An alpha only surface can't hold subpixel
+    // antialiasing, cairo uses grayscale here whatever the font options.
+    cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_A8, width, height);
+    cairo_t *cr = cairo_create (surface);
+    cairo_move_to (cr, -g->bearing_x, -g->bearing_y);
+    r->glyph_string->glyphs[0].glyph = glyph;
+    pango_cairo_show_glyph_string (cr, font, r->glyph_string);
+    cairo_destroy (cr);
+    cairo_surface_flush (surface);
+
+    glBindTexture (GL_TEXTURE_2D, r->atlas_texture);
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei (GL_UNPACK_ROW_LENGTH, cairo_image_surface_get_stride (surface));
+    glTexSubImage2D (GL_TEXTURE_2D, 0, g->x, g->y, width, height,
+                     GL_RED, GL_UNSIGNED_BYTE, cairo_image_surface_get_data (surface));
+    glPixelStorei (GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+
+    cairo_surface_destroy (surface);
+    r->num_rasterized++;
+}
+
+static inline
+uint32_t gl_glyph_slot (struct gl_text_renderer_t *r, uint64_t key)
+{
+    uint32_t mask = r->glyph_table_size - 1;
+    uint32_t slot = fnv1a_64 (FNV1A_64_OFFSET, &key, sizeof(key)) & mask;
+    while (r->glyph_table[slot].used && r->glyph_table[slot].key != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Returns the glyph, making sure it's in the atlas, or NULL if it has nothing
+// to draw.
+struct gl_glyph_t* gl_text_get_glyph (struct gl_text_renderer_t *r, uint32_t font_idx, PangoGlyph glyph)
+{
+    uint64_t key = ((uint64_t)font_idx << 32) | glyph;
+    uint32_t slot = gl_glyph_slot (r, key);
+    struct gl_glyph_t *g = &r->glyph_table[slot];
+
+    if (!g->used) {
+        if (2*(r->num_glyphs + 1) > r->glyph_table_size) {
+            struct gl_glyph_t *old_table = r->glyph_table;
+            uint32_t old_size = r->glyph_table_size;
+            r->glyph_table_size *= 2;
+            r->glyph_table = calloc (r->glyph_table_size, sizeof(struct gl_glyph_t));
+
+            uint32_t i;
+            for (i=0; i<old_size; i++) {
+                if (old_table[i].used) {
+                    r->glyph_table[gl_glyph_slot (r, old_table[i].key)] = old_table[i];
+                }
+            }
+            free (old_table);
+            slot = gl_glyph_slot (r, key);
+            g = &r->glyph_table[slot];
+        }
+
+        g->used = true;
+        g->key = key;
+        g->page = -1;
+        r->num_glyphs++;
+        gl_glyph_rasterize (r, g, global_text_run_cache.fonts[font_idx], glyph);
+
+    } else if (!g->empty &&
+               (g->page == -1 || g->generation != r->pages[g->page].generation)) {
+        gl_glyph_rasterize (r, g, global_text_run_cache.fonts[font_idx], glyph);
+    }
+
+    if (g->empty || g->page == -1) {
+        return NULL;
+    }
+
+    r->pages[g->page].last_used_frame = r->frame;
+    return g;
+}
+
+float* gl_text_push_instance (struct gl_text_renderer_t *r)
+{
+    if (r->num_instances == r->capacity) {
+        uint32_t new_capacity = MAX (2*r->capacity, 1024);
+        float *new_data =
+            (float*)mem_pool_push_size (&r->pool, new_capacity*GL_TEXT_INSTANCE_STRIDE*4*sizeof(float));
+        memcpy (new_data, r->data, r->num_instances*GL_TEXT_INSTANCE_STRIDE*4*sizeof(float));
+        r->data = new_data;
+        r->capacity = new_capacity;
+    }
+
+    return r->data + 4*GL_TEXT_INSTANCE_STRIDE*r->num_instances++;
+}
+
+void gl_text_push_rect (struct gl_text_renderer_t *r, double x, double y,
+                        double width, double height, dvec4 *color)
+{
+    float *instance = gl_text_push_instance (r);
+    gl_css_box_set_vec4 (instance, GL_TEXT_INSTANCE_RECT, x, y, width, height);
+    gl_css_box_set_vec4 (instance, GL_TEXT_INSTANCE_UV_RECT, 0, 0, 0, 0);
+    gl_css_box_set_vec4 (instance, GL_TEXT_INSTANCE_COLOR, ARGS_RGBA(*color));
+}
+
+void gl_text_begin (struct gl_text_renderer_t *r)
+{
+    r->frame++;
+    r->num_instances = 0;
+    r->num_rasterized = 0;
+    r->num_evicted = 0;
+}
+
+// Pushes the glyphs of _run_ with the layout origin at _pos_. Glyphs of
+// clusters in the byte range [sel_start, sel_end) use _sel_color_ and get
+// _sel_bg_color_ as background, if it's not NULL.
+void gl_text_push_run (struct gl_text_renderer_t *r, struct text_run_t *run, dvec2 pos,
+                       dvec4 *color, size_t sel_start, size_t sel_end,
+                       dvec4 *sel_color, dvec4 *sel_bg_color)
+{
+    dvec2_floor (&pos);
+
+    uint32_t i;
+    if (sel_bg_color != NULL) {
+        double sel_min = INFINITY, sel_max = -INFINITY;
+        for (i=0; i<run->num_glyphs; i++) {
+            struct text_run_glyph_t *glyph = &run->glyphs[i];
+            if (glyph->cluster >= sel_start && glyph->cluster < sel_end) {
+                sel_min = MIN (sel_min, glyph->pos.x);
+                sel_max = MAX (sel_max, glyph->pos.x + glyph->advance);
+            }
+        }
+
+        if (sel_min < sel_max) {
+            gl_text_push_rect (r, pos.x + sel_min, pos.y, sel_max - sel_min, run->size.y, sel_bg_color);
+        }
+    }
+
+    for (i=0; i<run->num_glyphs; i++) {
+        struct text_run_glyph_t *glyph = &run->glyphs[i];
+        struct gl_glyph_t *g = gl_text_get_glyph (r, glyph->font_idx, glyph->glyph);
+        if (g == NULL) {
+            continue;
+        }
+
+        dvec4 *glyph_color = color;
+        if (glyph->cluster >= sel_start && glyph->cluster < sel_end) {
+            glyph_color = sel_color;
+        }
+
+        float *instance = gl_text_push_instance (r);
+        gl_css_box_set_vec4 (instance, GL_TEXT_INSTANCE_RECT,
+                             pos.x + round (glyph->pos.x) + g->bearing_x,
+                             pos.y + round (glyph->pos.y) + g->bearing_y,
+                             g->width, g->height);
+        gl_css_box_set_vec4 (instance, GL_TEXT_INSTANCE_UV_RECT,
+                             (double)g->x/GL_GLYPH_ATLAS_SIZE, (double)g->y/GL_GLYPH_ATLAS_SIZE,
+                             (double)g->width/GL_GLYPH_ATLAS_SIZE, (double)g->height/GL_GLYPH_ATLAS_SIZE);
+        gl_css_box_set_vec4 (instance, GL_TEXT_INSTANCE_COLOR, ARGS_RGBA(*glyph_color));
+    }
+}
+
+// Same interface as render_text(), but the text is added to the batch.
+//
+// NOTE: len == -1 means the string is null terminated.
+void gl_text_push (struct gl_text_renderer_t *r, dvec2 pos, struct font_style_t *font_style,
+                   char *str, size_t len, dvec4 *color, dvec4 *bg_color, dvec2 *out_pos)
+{
+    struct text_run_t *run = text_run_get (str, len, font_style);
+    dvec2_floor (&pos);
+    if (bg_color != NULL) {
+        gl_text_push_rect (r, pos.x, pos.y, run->size.x, run->size.y, bg_color);
+    }
+
+    if (out_pos != NULL) {
+        out_pos->x = pos.x + run->size.x;
+    }
+
+    gl_text_push_run (r, run, pos, color, 0, 0, NULL, NULL);
+}
+
+// Pushes the content of a layout box, placed like css_box_draw() does. The
+// selection is drawn from the same run as the rest of the string.
+//
+// NOTE: Only text shadows without blur are drawn.
+void gl_text_push_layout_box (struct gl_text_renderer_t *r, struct css_box_t *css, layout_box_t *layout)
+{
+    if (layout->content.type != LAYOUT_CONTENT_C_STRING) {
+        return;
+    }
+
+    compute_content_size (layout);
+    dvec2 pos = dvec2_add (layout->box.min, css_box_content_pos (css, layout));
+
+    struct font_style_t font_style = FONT_STYLE_CSS(css);
+    struct text_run_t *run = text_run_get (layout->content.str, -1, &font_style);
+
+    struct text_shadow_t *shadow = css->text_shadows;
+    while (shadow != NULL) {
+        if (shadow->blur_radius == 0) {
+            dvec2 shadow_pos = DVEC2(pos.x + shadow->h_offset, pos.y + shadow->v_offset);
+            gl_text_push_run (r, run, shadow_pos, &shadow->color, 0, 0, NULL, NULL);
+        }
+        shadow = shadow->next;
+    }
+
+    struct selection_t *selection = &global_gui_st->selection;
+    if (selection->dest == layout) {
+        size_t sel_start = selection->start - layout->content.str;
+        size_t sel_end = selection->len == -1 ? run->len : sel_start + selection->len;
+        gl_text_push_run (r, run, pos, &css->color, sel_start, sel_end,
+                          &selection->color, &selection->background_color);
+    } else {
+        gl_text_push_run (r, run, pos, &css->color, 0, 0, NULL, NULL);
+    }
+}
+
+// Pushes the content of all layout boxes of the gui state that have a style.
+void gl_text_push_layout_boxes (struct gl_text_renderer_t *r, struct gui_state_t *gui_st)
+{
+    int i;
+    for (i=0; i<gui_st->num_layout_boxes; i++) {
+        layout_box_t *layout = &gui_st->layout_boxes[i];
+        if (layout->style != NULL) {
+            gl_text_push_layout_box (r, layout->style, layout);
+        }
+    }
+}
+
+// Draws all pushed text into the currently bound framebuffer, which is expected
+// to have the size of the window.
+//
+// NOTE: All text is drawn in a single draw call, call this after the boxes
+// have been drawn. Text of a box that is covered by another box will show
+// through it.
+void gl_text_renderer_draw (struct gl_text_renderer_t *r, app_graphics_t *graphics)
+{
+    if (r->num_instances == 0 || r->program_id == 0) {
+        return;
+    }
+
+    uint32_t size = r->num_instances*GL_TEXT_INSTANCE_STRIDE*4*sizeof(float);
+    glBindBuffer (GL_TEXTURE_BUFFER, r->buffer);
+    if (r->num_instances > r->buffer_capacity) {
+        glBufferData (GL_TEXTURE_BUFFER, size, r->data, GL_STREAM_DRAW);
+        r->buffer_capacity = r->num_instances;
+    } else {
+        glBufferData (GL_TEXTURE_BUFFER, r->buffer_capacity*GL_TEXT_INSTANCE_STRIDE*4*sizeof(float),
+                      NULL, GL_STREAM_DRAW);
+        glBufferSubData (GL_TEXTURE_BUFFER, 0, size, r->data);
+    }
+
+    gl_active_texture (GL_TEXTURE0);
+    glBindTexture (GL_TEXTURE_BUFFER, r->buffer_texture);
+    glTexBuffer (GL_TEXTURE_BUFFER, GL_RGBA32F, r->buffer);
+    gl_active_texture (GL_TEXTURE1);
+    glBindTexture (GL_TEXTURE_2D, r->atlas_texture);
+    gl_active_texture (GL_TEXTURE0);
+
+    gl_use_program (r->program_id);
+    glUniform2f (gl_uniform_location (r->program_id, "window_size"), graphics->width, graphics->height);
+
+    gl_bind_vertex_array (r->vao);
+    gl_disable (GL_DEPTH_TEST);
+    gl_enable (GL_BLEND);
+    gl_blend_func (GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glDrawArraysInstanced (GL_TRIANGLES, 0, 6, r->num_instances);
+}
+#endif
+
+#define GL_GUI_H
+#endif
@@ -24,13 +24,66 @@ typedef struct {
     float y_dpi;
 } app_graphics_t;
 
+enum input_event_type_t {
+    INPUT_EVENT_MOTION,
+    INPUT_EVENT_BUTTON_PRESS,
+    INPUT_EVENT_BUTTON_RELEASE,
+    INPUT_EVENT_KEY_PRESS,
+    INPUT_EVENT_WHEEL,
+    INPUT_EVENT_PASTE
+};
+
+struct input_event_t {
+    enum input_event_type_t type;
+    uint32_t time; // Timestamp in ms as reported by the platform
+
+    dvec2 ptr; // Pointer position at the time of the event
+
+    union {
+        int button; // 0 is left, 1 is middle and 2 is right
+        float wheel; // Zoom factor, greater than 1 for scroll up
+        struct {
+            xcb_keycode_t keycode;
+            uint16_t modifiers;
+        };
+
+        // Result of a paste, str is NULL if it failed. The string is
+        // allocated with malloc() and ownership passes to the receiver.
+        struct {
+            char *str;
+            size_t len;
+        } paste;
+    };
+
+    // Consecutive motion events are coalesced into the last one of them. If
+    // app_input_t.keep_motion_samples is set, the positions of the coalesced
+    // events are stored (oldest first) in app_input_t.motion_samples starting
+    // at first_motion_sample. They don't include _ptr_.
+    int first_motion_sample;
+    int num_motion_samples;
+};
+
 // TODO: Do per platform too.
 typedef struct {
     float time_elapsed_ms;
 
     bool force_redraw;
 
-    xcb_keycode_t keycode;
+    // Events received since the last frame, in the order they happened. The
+    // arrays are allocated by the platform from a pool that is flushed every
+    // frame, use input_event_push() to add to them.
+    int num_events;
+    int events_size;
+    struct input_event_t *events;
+
+    bool keep_motion_samples;
+    int num_motion_samples;
+    int motion_samples_size;
+    dvec2 *motion_samples;
+
+    // State after all events of the frame have been processed. The platform
+    // doesn't set these, update_input() computes them from the events.
+    xcb_keycode_t keycode; // Last key pressed during the frame, or 0
     uint16_t modifiers;
 
     float wheel;
@@ -231,6 +284,13 @@ struct font_style_t {
     FONT_STYLE_FSW((css_box)->font_family,(css_box)->font_size,(css_box)->font_weight)
 
 #define NUM_LAYOUT_BOXES_ALLOCATED 30
+#define GUI_MAX_DAMAGE_RECTS 32
+
+enum clipboard_request_t {
+    CLIPBOARD_REQUEST_NONE,
+    CLIPBOARD_REQUEST_COPY,
+    CLIPBOARD_REQUEST_PASTE
+};
 
 struct gui_state_t {
     mem_pool_t pool;
@@ -249,6 +309,8 @@ struct gui_state_t {
     dvec2 click_coord[3];
     bool mouse_clicked[3];
     bool mouse_double_clicked[3];
+    int click_state[3];
+    uint32_t last_click_time[3]; // event timestamp
     float time_since_last_click[3]; // in ms
     float double_click_time; // in ms
     float min_distance_for_drag; // in pixels
@@ -265,8 +327,27 @@ struct gui_state_t {
     struct focus_element_t *focus_end;
     struct focus_element_t *freed_focus_elements;
 
+    // Clipboard requests are handled by the platform at the end of the
+    // frame, use gui_clipboard_copy() and gui_clipboard_paste().
+    //
+    // NOTE: The platform copies the offered string when it handles the
+    // request, it only has to stay valid until the end of the frame.
+    enum clipboard_request_t clipboard_request;
+    char *clipboard_offer;
+    size_t clipboard_offer_len;
+
+    // Set during the frame in which pasted data arrives. clipboard_str is
+    // valid until the next paste.
     bool clipboard_ready;
     char *clipboard_str;
+    size_t clipboard_len;
+
+    // Areas of the window that changed during the frame, in pixels. Backends
+    // that can present partial updates only send these. If there are too
+    // many rectangles the whole window is considered damaged.
+    int num_damage_rects;
+    box_t damage_rects[GUI_MAX_DAMAGE_RECTS];
+    bool full_damage;
 };
 
 struct gui_state_t *global_gui_st;
@@ -357,37 +438,51 @@ void gui_destroy (struct gui_state_t *gui_st)
 {
     mem_pool_destroy (&gui_st->pool);
     mem_pool_destroy (&gui_st->thread_pool);
+    free (gui_st->clipboard_str);
+}
+
+void gui_clipboard_copy (struct gui_state_t *gui_st, char *str, size_t len)
+{
+    gui_st->clipboard_request = CLIPBOARD_REQUEST_COPY;
+    gui_st->clipboard_offer = str;
+    gui_st->clipboard_offer_len = len;
+}
+
+// The result arrives asynchronously, check clipboard_ready in later frames.
+void gui_clipboard_paste (struct gui_state_t *gui_st)
+{
+    gui_st->clipboard_request = CLIPBOARD_REQUEST_PASTE;
 }
 
 /////////////////
 // FONT BACKEND
 
 #ifdef __PANGO_H__
-PangoLayout* new_pango_layout_from_style (cairo_t *cr, struct font_style_t *font_style)
+// Returns a copy of _font_style_ with unset fields replaced by the default
+// font style.
+struct font_style_t font_style_resolve (struct font_style_t *font_style)
 {
-    const char *font_family;
-    if (font_style->family == NULL) {
-        font_family = global_gui_st->default_font_style.family;
-    } else {
-        font_family = font_style->family;
+    struct font_style_t res = *font_style;
+    if (res.family == NULL) {
+        res.family = global_gui_st->default_font_style.family;
     }
 
-    int font_size;
-    if (font_style->size == 0) {
-        font_size = global_gui_st->default_font_style.size;
-    } else {
-        font_size = font_style->size;
+    if (res.size == 0) {
+        res.size = global_gui_st->default_font_style.size;
     }
 
-    css_font_weight_t css_font_weight;
-    if (font_style->weight == CSS_FONT_WEIGHT_NONE) {
-        css_font_weight = global_gui_st->default_font_style.weight;
-    } else {
-        css_font_weight = font_style->weight;
+    if (res.weight == CSS_FONT_WEIGHT_NONE) {
+        res.weight = global_gui_st->default_font_style.weight;
     }
+    return res;
+}
+
+PangoFontDescription* new_pango_font_description_from_style (struct font_style_t *font_style)
+{
+    struct font_style_t style = font_style_resolve (font_style);
 
     PangoWeight font_weight = PANGO_WEIGHT_NORMAL;
-    switch (css_font_weight) {
+    switch (style.weight) {
         case CSS_FONT_WEIGHT_BOLD:
             font_weight = PANGO_WEIGHT_BOLD;
             break;
@@ -400,35 +495,252 @@ PangoLayout* new_pango_layout_from_style (cairo_t *cr, struct font_style_t *font
     }
 
     PangoFontDescription *font_desc = pango_font_description_new ();
-    pango_font_description_set_family (font_desc, font_family);
-    pango_font_description_set_size (font_desc, font_size*PANGO_SCALE);
+    pango_font_description_set_family (font_desc, style.family);
+    pango_font_description_set_size (font_desc, style.size*PANGO_SCALE);
     pango_font_description_set_weight (font_desc, font_weight);
+    return font_desc;
+}
 
+PangoLayout* new_pango_layout_from_style (cairo_t *cr, struct font_style_t *font_style)
+{
+    PangoFontDescription *font_desc = new_pango_font_description_from_style (font_style);
     PangoLayout *text_layout = pango_cairo_create_layout (cr);
     pango_layout_set_font_description (text_layout, font_desc);
     pango_font_description_free(font_desc);
     return text_layout;
 }
 
-dvec2 compute_string_size (char *str, struct font_style_t *style)
+// Shaping a string with Pango is by far the slowest thing we do with text, and
+// the strings of a GUI hardly change between frames. Shaped strings are cached
+// as text_run_t, a list of positioned glyphs, keyed by the string and its font
+// style. Renderers look up the image of each glyph by (font_idx, glyph).
+//
+// Strings are shaped with the font options and transform of the cairo context
+// the GUI draws into (gr.cr), the same ones render_text() uses, so sizes from
+// the cache match what is drawn. When they change all runs are dropped.
+//
+// NOTE: The cache is not thread safe, use it only from the render thread.
+#define TEXT_RUN_CACHE_MAX_RUNS 8192
+#define TEXT_RUN_CACHE_MAX_FONTS 256
+
+struct text_run_glyph_t {
+    uint32_t font_idx;
+    PangoGlyph glyph;
+    uint32_t cluster; // byte offset of the glyph's cluster in the string
+
+    // Origin of the glyph (on the baseline), in pixels relative to the origin
+    // of the layout, where render_text() would place _pos_.
+    dvec2 pos;
+    double advance;
+};
+
+struct text_run_t {
+    uint64_t hash;
+    char *str;
+    size_t len;
+    struct font_style_t style; // resolved
+
+    dvec2 size; // logical extents
+    uint32_t num_glyphs;
+    struct text_run_glyph_t *glyphs;
+};
+
+struct text_run_cache_t {
+    PangoContext *context;
+    guint context_serial;
+    PangoLayout *layout;
+
+    // Fonts are never released, so glyph keys stay valid for the lifetime of
+    // the program.
+    uint32_t num_fonts;
+    PangoFont *fonts[TEXT_RUN_CACHE_MAX_FONTS];
+
+    // Open addressing hash table with linear probing. Its size is twice the
+    // maximum number of runs so it never gets more than half full.
+    mem_pool_t pool;
+    uint32_t num_runs;
+    struct text_run_t *table[2*TEXT_RUN_CACHE_MAX_RUNS];
+
+    uint64_t num_shaped;
+    uint64_t num_hits;
+};
+
+struct text_run_cache_t global_text_run_cache;
+
+void text_run_cache_clear (struct text_run_cache_t *cache)
+{
+    mem_pool_destroy (&cache->pool);
+    memset (cache->table, 0, sizeof(cache->table));
+    cache->num_runs = 0;
+}
+
+// Returns the index of _font_ in the font table, or -1 if the table is full.
+int text_run_cache_font_idx (struct text_run_cache_t *cache, PangoFont *font)
+{
+    uint32_t i;
+    for (i=0; i<cache->num_fonts; i++) {
+        if (cache->fonts[i] == font) {
+            return i;
+        }
+    }
+
+    if (cache->num_fonts == TEXT_RUN_CACHE_MAX_FONTS) {
+        printf ("Warning: Too many fonts in use, glyphs will be missing.\n");
+        return -1;
+    }
+
+    cache->fonts[cache->num_fonts] = font;
+    g_object_ref (font);
+    return cache->num_fonts++;
+}
+
+void text_run_cache_update_context (struct text_run_cache_t *cache)
 {
-    dvec2 res;
-    PangoLayout *text_layout =
-        new_pango_layout_from_style (global_gui_st->gr.cr, style);
+    if (cache->context == NULL) {
+        cache->context = pango_font_map_create_context (pango_cairo_font_map_get_default ());
+        cache->layout = pango_layout_new (cache->context);
+    }
+
+    // NOTE: This only changes the serial of the context if something is
+    // different.
+    if (global_gui_st != NULL && global_gui_st->gr.cr != NULL) {
+        pango_cairo_update_context (global_gui_st->gr.cr, cache->context);
+    }
+
+    guint serial = pango_context_get_serial (cache->context);
+    if (serial != cache->context_serial) {
+        pango_layout_context_changed (cache->layout);
+        text_run_cache_clear (cache);
+        cache->context_serial = serial;
+    }
+}
 
-    // NOTE: I have the hunch that calls into Pango will be slow, so we ideally
-    // would like to call this function just once for each string that needs to
-    // be computed.
-    // TODO: Time this function and check if it's really a problem.
-    pango_layout_set_text (text_layout, str, -1);
+void text_run_shape (struct text_run_cache_t *cache, struct text_run_t *run)
+{
+    PangoFontDescription *font_desc = new_pango_font_description_from_style (&run->style);
+    pango_layout_set_font_description (cache->layout, font_desc);
+    pango_font_description_free (font_desc);
+    pango_layout_set_text (cache->layout, run->str, run->len);
 
     PangoRectangle logical;
-    pango_layout_get_pixel_extents (text_layout, NULL, &logical);
+    pango_layout_get_pixel_extents (cache->layout, NULL, &logical);
+    run->size = DVEC2 (logical.width, logical.height);
+
+    // Count the glyphs first so the glyph array is a single allocation.
+    run->num_glyphs = 0;
+    PangoLayoutIter *iter = pango_layout_get_iter (cache->layout);
+    do {
+        PangoLayoutRun *layout_run = pango_layout_iter_get_run_readonly (iter);
+        if (layout_run != NULL) {
+            run->num_glyphs += layout_run->glyphs->num_glyphs;
+        }
+    } while (pango_layout_iter_next_run (iter));
+    pango_layout_iter_free (iter);
+
+    run->glyphs = mem_pool_push_array (&cache->pool, run->num_glyphs, struct text_run_glyph_t);
+
+    uint32_t glyph_idx = 0;
+    iter = pango_layout_get_iter (cache->layout);
+    do {
+        // NOTE: A NULL run marks the end of a line.
+        PangoLayoutRun *layout_run = pango_layout_iter_get_run_readonly (iter);
+        if (layout_run == NULL) {
+            continue;
+        }
 
-    res.x = logical.width;
-    res.y = logical.height;
-    g_object_unref (text_layout);
-    return res;
+        PangoRectangle run_logical;
+        pango_layout_iter_get_run_extents (iter, NULL, &run_logical);
+        int baseline = pango_layout_iter_get_baseline (iter);
+        int font_idx = text_run_cache_font_idx (cache, layout_run->item->analysis.font);
+
+        PangoGlyphString *glyphs = layout_run->glyphs;
+        int x = run_logical.x;
+        int i;
+        for (i=0; i<glyphs->num_glyphs; i++) {
+            PangoGlyphInfo *info = &glyphs->glyphs[i];
+            if (info->glyph != PANGO_GLYPH_EMPTY && font_idx != -1) {
+                struct text_run_glyph_t *glyph = &run->glyphs[glyph_idx++];
+                glyph->font_idx = font_idx;
+                glyph->glyph = info->glyph;
+                glyph->cluster = layout_run->item->offset + glyphs->log_clusters[i];
+                glyph->pos = DVEC2 ((double)(x + info->geometry.x_offset)/PANGO_SCALE,
+                                    (double)(baseline + info->geometry.y_offset)/PANGO_SCALE);
+                glyph->advance = (double)info->geometry.width/PANGO_SCALE;
+            }
+            x += info->geometry.width;
+        }
+    } while (pango_layout_iter_next_run (iter));
+    pango_layout_iter_free (iter);
+
+    // Empty glyphs were skipped.
+    run->num_glyphs = glyph_idx;
+}
+
+// Returns the shaped run for the first _len_ bytes of _str_, shaping it only if
+// it's not in the cache. The returned pointer is valid until the next call.
+//
+// NOTE: len == -1 means the string is null terminated.
+struct text_run_t* text_run_get (char *str, size_t len, struct font_style_t *font_style)
+{
+    struct text_run_cache_t *cache = &global_text_run_cache;
+    text_run_cache_update_context (cache);
+
+    if (len == (size_t)-1) {
+        len = strlen (str);
+    }
+
+    struct font_style_t style = font_style_resolve (font_style);
+    uint64_t hash = fnv1a_64 (FNV1A_64_OFFSET, str, len);
+    hash = fnv1a_64 (hash, style.family, strlen (style.family));
+    hash = fnv1a_64 (hash, &style.size, sizeof(style.size));
+    hash = fnv1a_64 (hash, &style.weight, sizeof(style.weight));
+
+    uint32_t mask = ARRAY_SIZE(cache->table) - 1;
+    uint32_t slot = hash & mask;
+    while (cache->table[slot] != NULL) {
+        struct text_run_t *run = cache->table[slot];
+        if (run->hash == hash && run->len == len &&
+            run->style.size == style.size && run->style.weight == style.weight &&
+            strcmp (run->style.family, style.family) == 0 &&
+            memcmp (run->str, str, len) == 0) {
+            cache->num_hits++;
+            return run;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (cache->num_runs == TEXT_RUN_CACHE_MAX_RUNS) {
+        // NOTE: Eviction drops everything. Nobody holds run pointers across
+        // calls, and a GUI that shows more distinct strings than this per
+        // frame has other problems.
+        text_run_cache_clear (cache);
+        slot = hash & mask;
+    }
+
+    struct text_run_t *run = mem_pool_push_struct (&cache->pool, struct text_run_t);
+    run->hash = hash;
+    run->len = len;
+    run->str = mem_pool_push_size (&cache->pool, len + 1);
+    memcpy (run->str, str, len);
+    run->str[len] = '\0';
+
+    run->style = style;
+    size_t family_len = strlen (style.family);
+    char *family = mem_pool_push_size (&cache->pool, family_len + 1);
+    memcpy (family, style.family, family_len + 1);
+    run->style.family = family;
+
+    text_run_shape (cache, run);
+    cache->num_shaped++;
+
+    cache->table[slot] = run;
+    cache->num_runs++;
+    return run;
+}
+
+dvec2 compute_string_size (char *str, struct font_style_t *style)
+{
+    return text_run_get (str, -1, style)->size;
 }
 
 // NOTE: len == -1 means the string is null terminated.
@@ -632,69 +944,203 @@ bool is_box_visible (box_t *box, app_graphics_t *gr)
         is_point_in_box (box->max.x, box->min.y, 0, 0, gr->width, gr->height);
 }
 
-void update_input (struct gui_state_t *gui_st, app_input_t input)
+// Appends _event_ to the input queue. Motion events that directly follow
+// another motion event replace it, so processing a fast drag costs one event
+// per button press/release and not one per pointer sample.
+void input_event_push (app_input_t *input, mem_pool_t *pool, struct input_event_t *event)
 {
-    // FSM that detects clicks and double clicks
-    assert (input.time_elapsed_ms > 0);
-    gui_st->time_since_last_click[0] += input.time_elapsed_ms;
+    struct input_event_t *last = NULL;
+    if (input->num_events > 0) {
+        last = &input->events[input->num_events-1];
+    }
+
+    if (event->type == INPUT_EVENT_MOTION && last != NULL && last->type == INPUT_EVENT_MOTION) {
+        if (input->keep_motion_samples) {
+            if (input->num_motion_samples == input->motion_samples_size) {
+                int new_size = MAX (64, 2*input->motion_samples_size);
+                dvec2 *new_samples = mem_pool_push_array (pool, new_size, dvec2);
+                memcpy (new_samples, input->motion_samples, input->num_motion_samples*sizeof(dvec2));
+                input->motion_samples = new_samples;
+                input->motion_samples_size = new_size;
+            }
+
+            if (last->num_motion_samples == 0) {
+                last->first_motion_sample = input->num_motion_samples;
+            }
+            input->motion_samples[input->num_motion_samples++] = last->ptr;
+            last->num_motion_samples++;
+        }
+
+        last->time = event->time;
+        last->ptr = event->ptr;
+        return;
+    }
+
+    if (input->num_events == input->events_size) {
+        int new_size = MAX (32, 2*input->events_size);
+        struct input_event_t *new_events = mem_pool_push_array (pool, new_size, struct input_event_t);
+        memcpy (new_events, input->events, input->num_events*sizeof(struct input_event_t));
+        input->events = new_events;
+        input->events_size = new_size;
+    }
+
+    struct input_event_t *new_event = &input->events[input->num_events++];
+    *new_event = *event;
+    new_event->first_motion_sample = 0;
+    new_event->num_motion_samples = 0;
+}
+
+// NOTE: Must be called when the pool used for the queue gets flushed.
+void input_queue_clear (app_input_t *input)
+{
+    input->num_events = 0;
+    input->events_size = 0;
+    input->events = NULL;
+    input->num_motion_samples = 0;
+    input->motion_samples_size = 0;
+    input->motion_samples = NULL;
+}
 
-    static int state = 0;
-    switch (state) {
+void update_dragging (struct gui_state_t *gui_st, int button)
+{
+    // Detect dragging with minimum distance threshold
+    if (gui_st->input.mouse_down[button]) {
+        if (dvec2_distance (&gui_st->input.ptr, &gui_st->click_coord[button]) > gui_st->min_distance_for_drag) {
+            gui_st->dragging[button] = true;
+        }
+    } else {
+        gui_st->dragging[button] = false;
+    }
+}
+
+// FSM that detects clicks and double clicks. States are:
+//  0: Button up.
+//  1: Button down.
+//  2: Button up after a click, waiting for a double click.
+//  3: Button down for a possible double click.
+void update_click_state (struct gui_state_t *gui_st, struct input_event_t *event)
+{
+    int b = event->button;
+    bool down = event->type == INPUT_EVENT_BUTTON_PRESS;
+
+    switch (gui_st->click_state[b]) {
         case 0:
-            gui_st->mouse_clicked[0] = false;
-            gui_st->mouse_double_clicked[0] = false;
-            if (input.mouse_down[0]) {
-                gui_st->click_coord[0] = input.ptr;
-                state = 1;
+            if (down) {
+                gui_st->click_coord[b] = event->ptr;
+                gui_st->click_state[b] = 1;
             }
             break;
         case 1:
-            if (!input.mouse_down[0]) {
-                gui_st->mouse_clicked[0] = true;
-                gui_st->time_since_last_click[0] = 0;
-                state = 2;
+            if (!down) {
+                gui_st->mouse_clicked[b] = true;
+                gui_st->time_since_last_click[b] = 0;
+                gui_st->last_click_time[b] = event->time;
+                gui_st->click_state[b] = 2;
             }
             break;
         case 2:
-            gui_st->mouse_clicked[0] = false;
-            gui_st->mouse_double_clicked[0] = false;
-            if (input.mouse_down[0]) {
-                if (gui_st->time_since_last_click[0] < gui_st->double_click_time) {
-                    gui_st->mouse_double_clicked[0] = true;
-                }
-                gui_st->click_coord[0] = input.ptr;
-                state = 3;
-            } else {
-                if (gui_st->time_since_last_click[0] >= gui_st->double_click_time) {
-                    state = 0;
+            if (down) {
+                if (event->time - gui_st->last_click_time[b] < gui_st->double_click_time) {
+                    gui_st->mouse_double_clicked[b] = true;
                 }
+                gui_st->click_coord[b] = event->ptr;
+                gui_st->click_state[b] = 3;
             }
             break;
         case 3:
-            gui_st->mouse_double_clicked[0] = false;
-            if (!input.mouse_down[0]) {
-                gui_st->mouse_clicked[0] = true;
-                gui_st->time_since_last_click[0] = 0;
-                state = 0;
+            if (!down) {
+                gui_st->mouse_clicked[b] = true;
+                gui_st->time_since_last_click[b] = 0;
+                gui_st->last_click_time[b] = event->time;
+                gui_st->click_state[b] = 0;
             }
             break;
         default:
             invalid_code_path;
     }
+}
 
-    // Detect dragging with minimum distance threshold
-    if (input.mouse_down[0]) {
-        if (dvec2_distance (&input.ptr, &gui_st->click_coord[0]) > gui_st->min_distance_for_drag) {
-            gui_st->dragging[0] = true;
+// Replays the events received during the frame in order. Clicks and double
+// clicks are reported for the frame in which they ended, even if the button
+// was pressed and released between two frames.
+void update_input (struct gui_state_t *gui_st, app_input_t input)
+{
+    assert (input.time_elapsed_ms > 0);
+
+    dvec2 prev_ptr = gui_st->input.ptr;
+
+    // Copy the per frame fields and keep the state computed from the events
+    // of previous frames.
+    app_input_t *curr = &gui_st->input;
+    curr->time_elapsed_ms = input.time_elapsed_ms;
+    curr->force_redraw = input.force_redraw;
+    curr->num_events = input.num_events;
+    curr->events_size = input.events_size;
+    curr->events = input.events;
+    curr->keep_motion_samples = input.keep_motion_samples;
+    curr->num_motion_samples = input.num_motion_samples;
+    curr->motion_samples_size = input.motion_samples_size;
+    curr->motion_samples = input.motion_samples;
+    curr->keycode = 0;
+    curr->wheel = 1;
+    gui_st->clipboard_ready = false;
+
+    int b;
+    for (b=0; b<3; b++) {
+        gui_st->mouse_clicked[b] = false;
+        gui_st->mouse_double_clicked[b] = false;
+        gui_st->time_since_last_click[b] += input.time_elapsed_ms;
+    }
+
+    int i;
+    for (i=0; i<input.num_events; i++) {
+        struct input_event_t *event = &input.events[i];
+        if (event->type != INPUT_EVENT_PASTE) {
+            curr->ptr = event->ptr;
+        }
+
+        switch (event->type) {
+            case INPUT_EVENT_MOTION:
+                for (b=0; b<3; b++) {
+                    update_dragging (gui_st, b);
+                }
+                break;
+            case INPUT_EVENT_BUTTON_PRESS:
+            case INPUT_EVENT_BUTTON_RELEASE:
+                curr->mouse_down[event->button] = event->type == INPUT_EVENT_BUTTON_PRESS;
+                update_click_state (gui_st, event);
+                update_dragging (gui_st, event->button);
+                break;
+            case INPUT_EVENT_KEY_PRESS:
+                curr->keycode = event->keycode;
+                curr->modifiers = event->modifiers;
+                break;
+            case INPUT_EVENT_WHEEL:
+                curr->wheel *= event->wheel;
+                break;
+            case INPUT_EVENT_PASTE:
+                if (event->paste.str != NULL) {
+                    free (gui_st->clipboard_str);
+                    gui_st->clipboard_str = event->paste.str;
+                    gui_st->clipboard_len = event->paste.len;
+                    gui_st->clipboard_ready = true;
+                }
+                break;
+            default:
+                invalid_code_path;
+        }
+    }
+
+    // Stop waiting for a double click once the timeout passed.
+    for (b=0; b<3; b++) {
+        if (gui_st->click_state[b] == 2 &&
+            gui_st->time_since_last_click[b] >= gui_st->double_click_time) {
+            gui_st->click_state[b] = 0;
         }
-    } else {
-        gui_st->dragging[0] = false;
     }
 
-    app_input_t prev_input = gui_st->input;
-    gui_st->ptr_delta.x = input.ptr.x - prev_input.ptr.x;
-    gui_st->ptr_delta.y = input.ptr.y - prev_input.ptr.y;
-    gui_st->input = input;
+    gui_st->ptr_delta.x = curr->ptr.x - prev_ptr.x;
+    gui_st->ptr_delta.y = curr->ptr.y - prev_ptr.y;
 }
 
 void layout_box_print (layout_box_t *lay_box)
@@ -874,6 +1320,97 @@ void focus_chain_remove (struct gui_state_t *gui_st, layout_box_t *lay_box)
     }
 }
 
+void gui_damage_all (struct gui_state_t *gui_st)
+{
+    gui_st->full_damage = true;
+    gui_st->num_damage_rects = 0;
+}
+
+// Adds _box_ to the damaged area. Boxes are rounded out to whole pixels and
+// merged with any damage rectangle they overlap.
+void gui_damage_box (struct gui_state_t *gui_st, box_t box)
+{
+    if (gui_st->full_damage) {
+        return;
+    }
+
+    box.min.x = MAX (0, floor (box.min.x));
+    box.min.y = MAX (0, floor (box.min.y));
+    box.max.x = MIN (gui_st->gr.width, ceil (box.max.x));
+    box.max.y = MIN (gui_st->gr.height, ceil (box.max.y));
+    if (box.min.x >= box.max.x || box.min.y >= box.max.y) {
+        return;
+    }
+
+    int i;
+    for (i=0; i<gui_st->num_damage_rects; i++) {
+        box_t *curr = &gui_st->damage_rects[i];
+        if (box.min.x <= curr->max.x && curr->min.x <= box.max.x &&
+            box.min.y <= curr->max.y && curr->min.y <= box.max.y) {
+            curr->min.x = MIN (curr->min.x, box.min.x);
+            curr->min.y = MIN (curr->min.y, box.min.y);
+            curr->max.x = MAX (curr->max.x, box.max.x);
+            curr->max.y = MAX (curr->max.y, box.max.y);
+            return;
+        }
+    }
+
+    if (gui_st->num_damage_rects == GUI_MAX_DAMAGE_RECTS) {
+        gui_damage_all (gui_st);
+        return;
+    }
+    gui_st->damage_rects[gui_st->num_damage_rects++] = box;
+}
+
+bool gui_has_damage (struct gui_state_t *gui_st)
+{
+    return gui_st->full_damage || gui_st->num_damage_rects > 0;
+}
+
+// NOTE: Called by the platform once the damage has been presented.
+void gui_damage_clear (struct gui_state_t *gui_st)
+{
+    gui_st->full_damage = false;
+    gui_st->num_damage_rects = 0;
+}
+
+// Restricts drawing in _cr_ to the damaged area.
+void gui_damage_clip (struct gui_state_t *gui_st, cairo_t *cr)
+{
+    cairo_reset_clip (cr);
+    if (gui_st->full_damage) {
+        return;
+    }
+
+    int i;
+    for (i=0; i<gui_st->num_damage_rects; i++) {
+        box_t *rect = &gui_st->damage_rects[i];
+        cairo_rectangle (cr, rect->min.x, rect->min.y, BOX_WIDTH(*rect), BOX_HEIGHT(*rect));
+    }
+    cairo_clip (cr);
+}
+
+// Area css_box_draw() may touch when drawing _layout_ with _css_, this
+// includes outset shadows.
+box_t css_box_paint_extents (struct css_box_t *css, layout_box_t *layout)
+{
+    box_t res = layout->box;
+    if (css == NULL) {
+        return res;
+    }
+
+    struct box_shadow_t *shadow = css->outset_shadows;
+    while (shadow != NULL) {
+        double extent = shadow->blur_radius + shadow->spread_distance;
+        res.min.x = MIN (res.min.x, layout->box.min.x + shadow->h_offset - extent);
+        res.min.y = MIN (res.min.y, layout->box.min.y + shadow->v_offset - extent);
+        res.max.x = MAX (res.max.x, layout->box.max.x + shadow->h_offset + extent);
+        res.max.y = MAX (res.max.y, layout->box.max.y + shadow->v_offset + extent);
+        shadow = shadow->next;
+    }
+    return res;
+}
+
 void update_selectors (struct gui_state_t *gui_st, layout_box_t *layout_boxes, int num_layout_boxes)
 {
     int i;
@@ -952,6 +1489,7 @@ void update_layout_boxes (struct gui_state_t *gui_st, layout_box_t *layout_boxes
     int i;
     for (i=0; i<num_layout_boxes; i++) {
         layout_box_t *curr_box = layout_boxes + i;
+        struct css_box_t *old_style = curr_box->style;
 
         struct css_box_t *active_style =
             gui_st->css_styles[curr_box->base_style_id].selector_active;
@@ -985,6 +1523,12 @@ void update_layout_boxes (struct gui_state_t *gui_st, layout_box_t *layout_boxes
             }
             *changed = true;
         }
+
+        // The old style may have larger shadows than the new one, damage both.
+        if (curr_box->style != old_style || curr_box->content_changed) {
+            gui_damage_box (gui_st, css_box_paint_extents (old_style, curr_box));
+            gui_damage_box (gui_st, css_box_paint_extents (curr_box->style, curr_box));
+        }
     }
 }
 
@@ -1360,6 +1904,42 @@ void draw_text_shadows (app_graphics_t *gr, struct css_box_t *css,
     }
 }
 
+// Position of the content of _layout_ relative to the top left corner of its
+// box. It's aligned horizontally following text-align and centered vertically.
+//
+// NOTE: The content size must have been computed with compute_content_size().
+dvec2 css_box_content_pos (struct css_box_t *box, layout_box_t *layout)
+{
+    // NOTE: This is the css content+padding.
+    double content_width = BOX_WIDTH(layout->box) - 2*(box->border_width);
+    double content_height = BOX_HEIGHT(layout->box) - 2*(box->border_width);
+
+    css_text_align_t effective_text_align;
+    if (layout->text_align_override != CSS_TEXT_ALIGN_INITIAL) {
+        effective_text_align = layout->text_align_override;
+    } else {
+        effective_text_align = box->text_align;
+    }
+
+    double text_pos_x = box->border_width, text_pos_y = box->border_width;
+    switch (effective_text_align) {
+        case CSS_TEXT_ALIGN_LEFT:
+            break;
+        case CSS_TEXT_ALIGN_RIGHT:
+            text_pos_x += content_width - layout->content.width;
+            break;
+        case CSS_TEXT_ALIGN_INITIAL:
+        case CSS_TEXT_ALIGN_CENTER:
+            text_pos_x += (content_width - layout->content.width)/2;
+            break;
+        default:
+            invalid_code_path;
+    }
+    text_pos_y += (content_height - layout->content.height)/2;
+
+    return DVEC2(text_pos_x, text_pos_y);
+}
+
 // NOTE: We draw assuming the option box-sizing: border-box. Which means
 // BOX_WIDTH(layout->box) includes the content width, x_padding and border_width.
 void css_box_draw (app_graphics_t *gr, struct css_box_t *box, layout_box_t *layout)
@@ -1370,10 +1950,6 @@ void css_box_draw (app_graphics_t *gr, struct css_box_t *box, layout_box_t *layo
     cairo_save (cr);
     cairo_translate (cr, layout->box.min.x, layout->box.min.y);
 
-    // NOTE: This is the css content+padding.
-    double content_width = BOX_WIDTH(layout->box) - 2*(box->border_width);
-    double content_height = BOX_HEIGHT(layout->box) - 2*(box->border_width);
-
     struct rounded_box_t border_box = css_get_border_box (box, layout);
     draw_outset_shadows (gr, box, layout, &border_box);
 
@@ -1425,31 +2001,8 @@ void css_box_draw (app_graphics_t *gr, struct css_box_t *box, layout_box_t *layo
 
         compute_content_size (layout);
 
-        css_text_align_t effective_text_align;
-        if (layout->text_align_override != CSS_TEXT_ALIGN_INITIAL) {
-            effective_text_align = layout->text_align_override;
-        } else {
-            effective_text_align = box->text_align;
-        }
-
-        double text_pos_x = box->border_width, text_pos_y = box->border_width;
-        switch (effective_text_align) {
-            case CSS_TEXT_ALIGN_LEFT:
-                break;
-            case CSS_TEXT_ALIGN_RIGHT:
-                text_pos_x += content_width - layout->content.width;
-                break;
-            case CSS_TEXT_ALIGN_INITIAL:
-            case CSS_TEXT_ALIGN_CENTER:
-                text_pos_x += (content_width - layout->content.width)/2;
-                break;
-            default:
-                invalid_code_path;
-        }
-        text_pos_y += (content_height - layout->content.height)/2;
-
         struct selection_t *selection = &global_gui_st->selection;
-        dvec2 pos = DVEC2(text_pos_x, text_pos_y);
+        dvec2 pos = css_box_content_pos (box, layout);
         draw_text_shadows (gr, box, pos, layout->content.str, -1);
 
         struct font_style_t font_style = FONT_STYLE_CSS(box);
@@ -1475,12 +2028,16 @@ void css_box_draw (app_graphics_t *gr, struct css_box_t *box, layout_box_t *layo
         }
 
 #if 0
+        // NOTE: This is the css content+padding.
+        double content_width = BOX_WIDTH(layout->box) - 2*(box->border_width);
+        double content_height = BOX_HEIGHT(layout->box) - 2*(box->border_width);
         cairo_set_source_rgba (cr, 1.0, 0.0, 0.0, 0.3);
         cairo_rectangle (cr, box->border_width, box->border_width, content_width, content_height);
         cairo_fill (cr);
 
         cairo_set_source_rgba (cr, 0.0, 1.0, 0.0, 0.3);
-        cairo_rectangle (cr, text_pos_x, text_pos_y,
+        dvec2 text_pos = css_box_content_pos (box, layout);
+        cairo_rectangle (cr, text_pos.x, text_pos.y,
                          layout->str.width, layout->str.height);
         cairo_fill (cr);
 #endif
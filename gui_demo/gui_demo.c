@@ -0,0 +1,164 @@
+//gcc -DGUI_DEMO -DCAIRO_SHM_BACKEND -O3 -g -Wall -o gui_demo ../x11_platform.c -lGL -lcairo -lX11-xcb -lX11 -lxcb -lxcb-sync -lxcb-randr -lxcb-shm -lpthread -lm $(pkg-config --cflags --libs pangocairo)
+
+#ifdef GUI_DEMO
+
+// A grid of buttons drawn only with cairo, it's meant to be built with
+// CAIRO_SHM_BACKEND. Pressing a button changes its style, update_layout_boxes()
+// damages it and only the damaged area is redrawn and presented.
+//
+// Above the grid there is a text entry that holds the clipboard. Ctrl+V pastes
+// into it and Ctrl+C copies its text back. Pasting a large selection from
+// another client and copying it back exercises the INCR transfers both ways.
+//
+// NOTE: Nothing here uses GL, it still has to be linked because of the unity
+// build but no context is created.
+
+#define GUI_DEMO_ROWS 4
+#define GUI_DEMO_COLUMNS 5
+#define GUI_DEMO_BUTTON_WIDTH 100
+#define GUI_DEMO_BUTTON_HEIGHT 32
+#define GUI_DEMO_BUTTON_GAP 12
+
+struct gui_demo_t {
+    layout_box_t *background;
+
+    // _text_ is what gets copied. It points to gui_st->clipboard_str after a
+    // paste, that's valid until the next one. Only a summary of it is shown.
+    layout_box_t *entry;
+    char *text;
+    size_t text_len;
+    char summary[64];
+
+    layout_box_t *buttons[GUI_DEMO_ROWS*GUI_DEMO_COLUMNS];
+    char labels[GUI_DEMO_ROWS*GUI_DEMO_COLUMNS][16];
+};
+
+void app_prepare (struct app_state_t *st)
+{
+}
+
+// Shows the first line of the entry's text, and its size if it doesn't fit.
+void gui_demo_set_text (struct gui_demo_t *demo, char *text, size_t len)
+{
+    demo->text = text;
+    demo->text_len = len;
+
+    size_t line_len = 0;
+    while (line_len < len && line_len < 32 && text[line_len] != '\n') {
+        line_len++;
+    }
+
+    if (line_len == len) {
+        snprintf (demo->summary, ARRAY_SIZE(demo->summary), "%.*s", (int)line_len, text);
+    } else {
+        snprintf (demo->summary, ARRAY_SIZE(demo->summary), "%.*s... (%zu bytes)", (int)line_len, text, len);
+    }
+    layout_set_content_str (demo->entry, demo->summary);
+    demo->entry->content_changed = true;
+}
+
+// Centers the grid of buttons in a _width_ x _height_ window, with the entry
+// above it.
+void gui_demo_layout (struct gui_demo_t *demo, uint16_t width, uint16_t height)
+{
+    BOX_X_Y_W_H (demo->background->box, 0, 0, width, height);
+
+    double grid_width = GUI_DEMO_COLUMNS*(GUI_DEMO_BUTTON_WIDTH + GUI_DEMO_BUTTON_GAP) - GUI_DEMO_BUTTON_GAP;
+    double grid_height = GUI_DEMO_ROWS*(GUI_DEMO_BUTTON_HEIGHT + GUI_DEMO_BUTTON_GAP) - GUI_DEMO_BUTTON_GAP;
+    double x = MAX (0, floor ((width - grid_width)/2));
+    double y = MAX (0, floor ((height - grid_height)/2));
+    BOX_X_Y_W_H (demo->entry->box, x, MAX (0, y - GUI_DEMO_BUTTON_HEIGHT - GUI_DEMO_BUTTON_GAP),
+                 grid_width, GUI_DEMO_BUTTON_HEIGHT);
+
+    int i;
+    for (i=0; i<ARRAY_SIZE(demo->buttons); i++) {
+        int row = i/GUI_DEMO_COLUMNS;
+        int column = i%GUI_DEMO_COLUMNS;
+        BOX_X_Y_W_H (demo->buttons[i]->box,
+                     x + column*(GUI_DEMO_BUTTON_WIDTH + GUI_DEMO_BUTTON_GAP),
+                     y + row*(GUI_DEMO_BUTTON_HEIGHT + GUI_DEMO_BUTTON_GAP),
+                     GUI_DEMO_BUTTON_WIDTH, GUI_DEMO_BUTTON_HEIGHT);
+    }
+}
+
+bool update_and_render (struct app_state_t *st, app_graphics_t *graphics, app_input_t input)
+{
+    struct gui_state_t *gui_st = &st->gui_st;
+    gui_st->gr = *graphics;
+
+    static struct gui_demo_t demo;
+    if (!st->is_initialized) {
+        st->end_execution = false;
+        st->is_initialized = true;
+
+        global_gui_st = gui_st;
+        default_gui_init (gui_st);
+
+        demo.background = next_layout_box (CSS_BACKGROUND);
+
+        static char initial_text[] = "Ctrl+V pastes here, Ctrl+C copies it";
+        demo.entry = next_layout_box (CSS_TEXT_ENTRY);
+        gui_demo_set_text (&demo, initial_text, strlen (initial_text));
+
+        int i;
+        for (i=0; i<ARRAY_SIZE(demo.buttons); i++) {
+            demo.buttons[i] = next_layout_box (CSS_BUTTON);
+            snprintf (demo.labels[i], ARRAY_SIZE(demo.labels[i]), "Button %d", i+1);
+            layout_set_content_str (demo.buttons[i], demo.labels[i]);
+        }
+    }
+
+    update_input (gui_st, input);
+
+    bool ctrl = gui_st->input.modifiers & XCB_MOD_MASK_CONTROL;
+    switch (gui_st->input.keycode) {
+        case 24: //KEY_Q
+            st->end_execution = true;
+            break;
+        case 54: //KEY_C
+            if (ctrl) {
+                gui_clipboard_copy (gui_st, demo.text, demo.text_len);
+            }
+            break;
+        case 55: //KEY_V
+            if (ctrl) {
+                gui_clipboard_paste (gui_st);
+            }
+            break;
+    }
+
+    if (gui_st->clipboard_ready) {
+        gui_demo_set_text (&demo, gui_st->clipboard_str, gui_st->clipboard_len);
+    }
+
+    static uint16_t last_width, last_height;
+    if (input.force_redraw || graphics->width != last_width || graphics->height != last_height) {
+        last_width = graphics->width;
+        last_height = graphics->height;
+        gui_demo_layout (&demo, graphics->width, graphics->height);
+        gui_damage_all (gui_st);
+    }
+
+    bool changed = false;
+    update_layout_boxes (gui_st, gui_st->layout_boxes, gui_st->num_layout_boxes, &changed);
+
+    // NOTE: cr is NULL while the server is still reading the back buffer, the
+    // damage is kept and we try again in the next frame instead of sleeping.
+    cairo_t *cr = graphics->cr;
+    st->idle = cr != NULL || !gui_has_damage (gui_st);
+    st->wakeup_ms = 0;
+
+    if (cr != NULL && gui_has_damage (gui_st)) {
+        gui_damage_clip (gui_st, cr);
+
+        int i;
+        for (i=0; i<gui_st->num_layout_boxes; i++) {
+            layout_box_t *box = &gui_st->layout_boxes[i];
+            css_box_draw (graphics, box->style, box);
+        }
+    }
+
+    layout_boxes_end_frame (gui_st->layout_boxes, gui_st->num_layout_boxes);
+    return false;
+}
+#endif // GUI_DEMO
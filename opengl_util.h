@@ -19,57 +19,980 @@ void debug_message_callback( GLenum source,
 
 static char *global_shader_folder = NULL;
 
-GLuint gl_program (const char *vertex_shader_source, const char *fragment_shader_source)
+// Directory where linked program binaries are cached, NULL disables the cache.
+// See gl_program_build_begin().
+static char *global_program_cache_dir = NULL;
+
+// Shader sources can be read ahead of time with gl_preload_shader_sources(),
+// this doesn't need a GL context so it can run in a different thread while
+// the context is being created. Then gl_program() won't have to touch the disk.
+//
+// NOTE: Preloading is NOT thread safe with respect to gl_program(), make sure
+// the thread calling gl_preload_shader_sources() finished before compiling.
+#define MAX_PRELOADED_SHADERS 64
+struct shader_source_cache_t {
+    mem_pool_t pool;
+    int num_sources;
+    char *names[MAX_PRELOADED_SHADERS];
+    char *sources[MAX_PRELOADED_SHADERS];
+};
+
+struct shader_source_cache_t global_shader_sources;
+
+char* gl_preloaded_shader_source (const char *name)
 {
-    bool compilation_failed = false;
-    GLuint program_id = 0;
-    mem_pool_t pool = {0};
+    int i;
+    for (i=0; i<global_shader_sources.num_sources; i++) {
+        if (strcmp (global_shader_sources.names[i], name) == 0) {
+            return global_shader_sources.sources[i];
+        }
+    }
+    return NULL;
+}
+
+void gl_preload_shader_folder (const char *folder)
+{
+    struct shader_source_cache_t *cache = &global_shader_sources;
+    DIR *dir = opendir (folder);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir (dir)) != NULL && cache->num_sources < MAX_PRELOADED_SHADERS) {
+        char *ext = get_extension (entry->d_name);
+        if (ext == NULL || strcmp (ext, "glsl") != 0 ||
+            gl_preloaded_shader_source (entry->d_name) != NULL) {
+            continue;
+        }
 
-    // Vertex shader
-    const char* vertex_source = full_file_read_prefix (&pool, vertex_shader_source, &global_shader_folder, 1);
+        size_t folder_len = strlen (folder);
+        char *path = (char*)mem_pool_push_size (&cache->pool, folder_len + strlen(entry->d_name) + 1);
+        strcpy (path, folder);
+        strcpy (path + folder_len, entry->d_name);
 
-    GLuint vertex_shader = glCreateShader (GL_VERTEX_SHADER);
-    glShaderSource (vertex_shader, 1, &vertex_source, NULL);
-    glCompileShader (vertex_shader);
+        char *source = full_file_read (&cache->pool, path);
+        if (source != NULL) {
+            cache->names[cache->num_sources] = path + folder_len;
+            cache->sources[cache->num_sources] = source;
+            cache->num_sources++;
+        }
+    }
+    closedir (dir);
+}
+
+// Reads all .glsl files from the current directory and global_shader_folder,
+// in the same order gl_program() looks for them.
+void gl_preload_shader_sources ()
+{
+    gl_preload_shader_folder ("./");
+    if (global_shader_folder != NULL) {
+        gl_preload_shader_folder (global_shader_folder);
+    }
+}
+
+const char* gl_shader_source (mem_pool_t *pool, const char *name)
+{
+    const char *source = gl_preloaded_shader_source (name);
+    if (source == NULL) {
+        source = full_file_read_prefix (pool, name, &global_shader_folder, 1);
+    }
+    return source;
+}
+
+// Compilation errors are only checked by gl_shader_check(), the driver may
+// still be compiling when this returns.
+GLuint gl_shader_begin (GLenum type, const char *source)
+{
+    GLuint shader = glCreateShader (type);
+    glShaderSource (shader, 1, &source, NULL);
+    glCompileShader (shader);
+    return shader;
+}
+
+bool gl_shader_check (GLuint shader, const char *name)
+{
     GLint shader_status;
-    glGetShaderiv (vertex_shader, GL_COMPILE_STATUS, &shader_status);
+    glGetShaderiv (shader, GL_COMPILE_STATUS, &shader_status);
     if (shader_status != GL_TRUE) {
-        printf ("Compilation of \"%s\" failed.\n", vertex_shader_source);
+        printf ("Compilation of \"%s\" failed.\n", name);
         char buffer[512];
-        glGetShaderInfoLog(vertex_shader, 512, NULL, buffer);
+        glGetShaderInfoLog(shader, 512, NULL, buffer);
         printf ("%s", buffer);
-        compilation_failed = true;
+        return false;
     }
+    return true;
+}
 
-    // Fragment shader
-    const char* fragment_source = full_file_read_prefix (&pool, fragment_shader_source, &global_shader_folder, 1);
+// State cache. Binds and state changes go through these wrappers, which skip
+// the GL call if it wouldn't change anything. Uniform locations are reflected
+// once when a program is linked, gl_uniform_location() looks them up without
+// calling into the driver.
+//
+// The cache starts out unknown, the first change of each piece of state is
+// always issued. Code that changes tracked state with raw GL calls must call
+// gl_state_invalidate() afterwards.
+//
+// NOTE: Texture bindings are not tracked, names of deleted textures get reused
+// by glGenTextures() and a stale cache would skip binding the new one.
+#define GL_STATE_MAX_CAPS 16
+#define GL_STATE_MAX_PROGRAMS 64
+#define GL_STATE_MAX_UNIFORMS 32
+#define GL_STATE_MAX_UNIFORM_NAME 64
 
-    GLuint fragment_shader = glCreateShader (GL_FRAGMENT_SHADER);
-    glShaderSource (fragment_shader, 1, &fragment_source, NULL);
-    glCompileShader (fragment_shader);
-    glGetShaderiv (fragment_shader, GL_COMPILE_STATUS, &shader_status);
-    if (shader_status != GL_TRUE) {
-        printf ("Compilation of \"%s\" failed.\n", fragment_shader_source);
-        char buffer[512];
-        glGetShaderInfoLog(fragment_shader, 512, NULL, buffer);
-        printf ("%s", buffer);
-        compilation_failed = true;
+struct gl_uniform_t {
+    uint64_t name_hash;
+    char name[GL_STATE_MAX_UNIFORM_NAME];
+    GLint location;
+};
+
+struct gl_program_uniforms_t {
+    GLuint program_id;
+    bool complete; // false if some uniform didn't fit in the table
+    int num_uniforms;
+    struct gl_uniform_t uniforms[GL_STATE_MAX_UNIFORMS];
+};
+
+struct gl_state_t {
+    bool program_valid;
+    GLuint program_id;
+    bool vao_valid;
+    GLuint vao;
+    bool active_texture_valid;
+    GLenum active_texture;
+
+    int num_caps;
+    GLenum caps[GL_STATE_MAX_CAPS];
+    bool cap_enabled[GL_STATE_MAX_CAPS];
+
+    bool blend_func_valid;
+    GLenum blend_src, blend_dst;
+    bool blend_equation_valid;
+    GLenum blend_equation;
+    bool depth_mask_valid;
+    GLboolean depth_mask;
+    bool color_mask_valid;
+    GLboolean color_mask[4];
+    bool stencil_mask_valid;
+    GLuint stencil_mask;
+    bool scissor_valid;
+    GLint scissor[4];
+    bool viewport_valid;
+    GLint viewport[4];
+
+    int num_programs;
+    struct gl_program_uniforms_t programs[GL_STATE_MAX_PROGRAMS];
+    struct gl_program_uniforms_t *last_program; // of the last uniform lookup
+
+    // Calls that went through the cache. Counters of the current frame, and
+    // of the one before it, see gl_state_begin_frame().
+    uint32_t num_issued, num_skipped;
+    uint32_t last_frame_issued, last_frame_skipped;
+};
+
+struct gl_state_t global_gl_state;
+
+void gl_state_invalidate ()
+{
+    struct gl_state_t *st = &global_gl_state;
+    st->program_valid = false;
+    st->vao_valid = false;
+    st->active_texture_valid = false;
+    st->num_caps = 0;
+    st->blend_func_valid = false;
+    st->blend_equation_valid = false;
+    st->depth_mask_valid = false;
+    st->color_mask_valid = false;
+    st->stencil_mask_valid = false;
+    st->scissor_valid = false;
+    st->viewport_valid = false;
+}
+
+void gl_state_begin_frame ()
+{
+    struct gl_state_t *st = &global_gl_state;
+    st->last_frame_issued = st->num_issued;
+    st->last_frame_skipped = st->num_skipped;
+    st->num_issued = 0;
+    st->num_skipped = 0;
+}
+
+// Returns true if the call has to be issued, and counts it.
+static inline
+bool gl_state_changed (bool changed)
+{
+    if (changed) {
+        global_gl_state.num_issued++;
+    } else {
+        global_gl_state.num_skipped++;
     }
+    return changed;
+}
 
-    // Program creation
-    if (!compilation_failed) {
-        program_id = glCreateProgram();
-        glAttachShader (program_id, vertex_shader);
-        glAttachShader (program_id, fragment_shader);
-        glBindFragDataLocation (program_id, 0, "out_color");
-        glLinkProgram (program_id);
+void gl_use_program (GLuint program_id)
+{
+    struct gl_state_t *st = &global_gl_state;
+    if (gl_state_changed (!st->program_valid || st->program_id != program_id)) {
         glUseProgram (program_id);
+        st->program_valid = true;
+        st->program_id = program_id;
+    }
+}
+
+void gl_bind_vertex_array (GLuint vao)
+{
+    struct gl_state_t *st = &global_gl_state;
+    if (gl_state_changed (!st->vao_valid || st->vao != vao)) {
+        glBindVertexArray (vao);
+        st->vao_valid = true;
+        st->vao = vao;
+    }
+}
+
+void gl_active_texture (GLenum texture_unit)
+{
+    struct gl_state_t *st = &global_gl_state;
+    if (gl_state_changed (!st->active_texture_valid || st->active_texture != texture_unit)) {
+        glActiveTexture (texture_unit);
+        st->active_texture_valid = true;
+        st->active_texture = texture_unit;
+    }
+}
+
+void gl_set_capability (GLenum cap, bool enabled)
+{
+    struct gl_state_t *st = &global_gl_state;
+    int i;
+    for (i=0; i<st->num_caps && st->caps[i] != cap; i++);
+
+    if (gl_state_changed (i == st->num_caps || st->cap_enabled[i] != enabled)) {
+        if (enabled) {
+            glEnable (cap);
+        } else {
+            glDisable (cap);
+        }
+
+        if (i == st->num_caps && st->num_caps < GL_STATE_MAX_CAPS) {
+            st->caps[st->num_caps++] = cap;
+        }
+        if (i < st->num_caps) {
+            st->cap_enabled[i] = enabled;
+        }
+    }
+}
+
+void gl_enable (GLenum cap)
+{
+    gl_set_capability (cap, true);
+}
+
+void gl_disable (GLenum cap)
+{
+    gl_set_capability (cap, false);
+}
+
+void gl_blend_func (GLenum src, GLenum dst)
+{
+    struct gl_state_t *st = &global_gl_state;
+    if (gl_state_changed (!st->blend_func_valid || st->blend_src != src || st->blend_dst != dst)) {
+        glBlendFunc (src, dst);
+        st->blend_func_valid = true;
+        st->blend_src = src;
+        st->blend_dst = dst;
+    }
+}
+
+// Per draw buffer blend functions are not tracked, after setting one the next
+// gl_blend_func() is always issued.
+void gl_blend_funci (GLuint buffer, GLenum src, GLenum dst)
+{
+    glBlendFunci (buffer, src, dst);
+    global_gl_state.blend_func_valid = false;
+    global_gl_state.num_issued++;
+}
+
+void gl_blend_equation (GLenum mode)
+{
+    struct gl_state_t *st = &global_gl_state;
+    if (gl_state_changed (!st->blend_equation_valid || st->blend_equation != mode)) {
+        glBlendEquation (mode);
+        st->blend_equation_valid = true;
+        st->blend_equation = mode;
+    }
+}
+
+// Same as gl_blend_funci(), the next gl_blend_equation() is always issued.
+void gl_blend_equationi (GLuint buffer, GLenum mode)
+{
+    glBlendEquationi (buffer, mode);
+    global_gl_state.blend_equation_valid = false;
+    global_gl_state.num_issued++;
+}
+
+void gl_depth_mask (GLboolean flag)
+{
+    struct gl_state_t *st = &global_gl_state;
+    if (gl_state_changed (!st->depth_mask_valid || st->depth_mask != flag)) {
+        glDepthMask (flag);
+        st->depth_mask_valid = true;
+        st->depth_mask = flag;
+    }
+}
+
+void gl_color_mask (GLboolean r, GLboolean g, GLboolean b, GLboolean a)
+{
+    struct gl_state_t *st = &global_gl_state;
+    GLboolean *mask = st->color_mask;
+    if (gl_state_changed (!st->color_mask_valid ||
+                          mask[0] != r || mask[1] != g || mask[2] != b || mask[3] != a)) {
+        glColorMask (r, g, b, a);
+        st->color_mask_valid = true;
+        mask[0] = r;
+        mask[1] = g;
+        mask[2] = b;
+        mask[3] = a;
+    }
+}
+
+void gl_stencil_mask (GLuint mask)
+{
+    struct gl_state_t *st = &global_gl_state;
+    if (gl_state_changed (!st->stencil_mask_valid || st->stencil_mask != mask)) {
+        glStencilMask (mask);
+        st->stencil_mask_valid = true;
+        st->stencil_mask = mask;
+    }
+}
+
+static inline
+bool gl_rect_equal (GLint *rect, GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    return rect[0] == x && rect[1] == y && rect[2] == width && rect[3] == height;
+}
+
+void gl_scissor (GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    struct gl_state_t *st = &global_gl_state;
+    if (gl_state_changed (!st->scissor_valid || !gl_rect_equal (st->scissor, x, y, width, height))) {
+        glScissor (x, y, width, height);
+        st->scissor_valid = true;
+        st->scissor[0] = x;
+        st->scissor[1] = y;
+        st->scissor[2] = width;
+        st->scissor[3] = height;
+    }
+}
+
+void gl_viewport (GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    struct gl_state_t *st = &global_gl_state;
+    if (gl_state_changed (!st->viewport_valid || !gl_rect_equal (st->viewport, x, y, width, height))) {
+        glViewport (x, y, width, height);
+        st->viewport_valid = true;
+        st->viewport[0] = x;
+        st->viewport[1] = y;
+        st->viewport[2] = width;
+        st->viewport[3] = height;
+    }
+}
+
+struct gl_program_uniforms_t* gl_state_find_program (GLuint program_id)
+{
+    struct gl_state_t *st = &global_gl_state;
+    if (st->last_program != NULL && st->last_program->program_id == program_id) {
+        return st->last_program;
+    }
+
+    int i;
+    for (i=0; i<st->num_programs; i++) {
+        if (st->programs[i].program_id == program_id) {
+            st->last_program = &st->programs[i];
+            return st->last_program;
+        }
+    }
+    return NULL;
+}
+
+// Marks the table of _program_ as missing some uniform, lookups that miss will
+// query the driver.
+void gl_uniform_table_overflow (struct gl_program_uniforms_t *program)
+{
+    if (program->complete) {
+        printf ("Uniforms of program %u don't fit in the state cache, missing ones will be queried every time.\n",
+                program->program_id);
+    }
+    program->complete = false;
+}
+
+void gl_uniform_table_add (struct gl_program_uniforms_t *program, const char *name, GLint location)
+{
+    if (program->num_uniforms == GL_STATE_MAX_UNIFORMS || strlen (name) >= GL_STATE_MAX_UNIFORM_NAME) {
+        gl_uniform_table_overflow (program);
+        return;
+    }
+
+    struct gl_uniform_t *uniform = &program->uniforms[program->num_uniforms++];
+    strcpy (uniform->name, name);
+    uniform->name_hash = fnv1a_64 (FNV1A_64_OFFSET, name, strlen (name));
+    uniform->location = location;
+}
+
+// Stores the locations of all active uniforms of a linked program. Arrays can
+// be looked up by their name with and without "[0]".
+void gl_program_reflect_uniforms (GLuint program_id)
+{
+    struct gl_state_t *st = &global_gl_state;
+    if (st->num_programs == GL_STATE_MAX_PROGRAMS) {
+        printf ("Too many programs, uniforms of %u will be queried every time.\n", program_id);
+        return;
+    }
+
+    struct gl_program_uniforms_t *program = &st->programs[st->num_programs++];
+    program->program_id = program_id;
+    program->complete = true;
+    program->num_uniforms = 0;
+
+    GLint num_active;
+    glGetProgramiv (program_id, GL_ACTIVE_UNIFORMS, &num_active);
+
+    GLint i;
+    for (i=0; i<num_active; i++) {
+        char name[GL_STATE_MAX_UNIFORM_NAME];
+        GLsizei length;
+        GLint size;
+        GLenum type;
+        glGetActiveUniform (program_id, i, ARRAY_SIZE(name), &length, &size, &type, name);
+
+        // NOTE: The name may have been truncated, it can't be stored.
+        if (length >= ARRAY_SIZE(name) - 1) {
+            gl_uniform_table_overflow (program);
+            continue;
+        }
+
+        // NOTE: Members of uniform blocks don't have a location.
+        GLint location = glGetUniformLocation (program_id, name);
+        if (location == -1) {
+            continue;
+        }
+        gl_uniform_table_add (program, name, location);
+
+        size_t len = strlen (name);
+        if (len > 3 && strcmp (name + len - 3, "[0]") == 0) {
+            name[len - 3] = '\0';
+            gl_uniform_table_add (program, name, location);
+        }
+    }
+}
+
+// Location of a uniform, -1 if the program doesn't have it. Programs that were
+// not reflected, and uniforms that didn't fit in the table of their program,
+// fall back to glGetUniformLocation().
+GLint gl_uniform_location (GLuint program_id, const char *name)
+{
+    struct gl_program_uniforms_t *program = gl_state_find_program (program_id);
+    if (program == NULL) {
+        global_gl_state.num_issued++;
+        return glGetUniformLocation (program_id, name);
+    }
+
+    uint64_t hash = fnv1a_64 (FNV1A_64_OFFSET, name, strlen (name));
+    int i;
+    for (i=0; i<program->num_uniforms; i++) {
+        struct gl_uniform_t *uniform = &program->uniforms[i];
+        if (uniform->name_hash == hash && strcmp (uniform->name, name) == 0) {
+            global_gl_state.num_skipped++;
+            return uniform->location;
+        }
+    }
+
+    if (!program->complete) {
+        global_gl_state.num_issued++;
+        return glGetUniformLocation (program_id, name);
+    }
+    global_gl_state.num_skipped++;
+    return -1;
+}
+
+void gl_delete_program (GLuint program_id)
+{
+    struct gl_state_t *st = &global_gl_state;
+    struct gl_program_uniforms_t *program = gl_state_find_program (program_id);
+    if (program != NULL) {
+        *program = st->programs[--st->num_programs];
+        st->last_program = NULL;
+    }
+
+    // NOTE: A deleted program stays in use until another one is bound, its
+    // name could be reused before that.
+    if (st->program_id == program_id) {
+        st->program_valid = false;
+    }
+    glDeleteProgram (program_id);
+}
+
+bool gl_has_extension (const char *name)
+{
+    GLint num_extensions = 0;
+    glGetIntegerv (GL_NUM_EXTENSIONS, &num_extensions);
+
+    int i;
+    for (i=0; i<num_extensions; i++) {
+        if (strcmp ((const char*)glGetStringi (GL_EXTENSIONS, i), name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Program binary cache. Linked programs are stored with glGetProgramBinary()
+// in global_program_cache_dir, in a file named after the hash of everything
+// that affects the result: the source of each shader (defines included) and
+// the vendor, renderer and version strings of the driver. Binaries the driver
+// rejects, for example after an update that didn't change the version string,
+// are compiled again from source and replace the cached ones.
+#define GL_PROGRAM_CACHE_MAGIC 0x31484341434d5250ULL // "PRMCACH1"
+struct gl_program_cache_header_t {
+    uint64_t magic;
+    uint64_t hash;
+    uint32_t binary_format;
+    uint32_t binary_size;
+};
+
+struct gl_program_cache_t {
+    bool initialized;
+    bool enabled;
+    uint64_t driver_hash;
+};
+
+struct gl_program_cache_t global_program_cache;
+
+// Creates _path_ and its parents, _path_ must end in '/'.
+bool gl_program_cache_create_dir (const char *path)
+{
+    char *expanded = sh_expand (path, NULL);
+    bool success = true;
+    char *c;
+    for (c = expanded + 1; *c != '\0' && success; c++) {
+        if (*c == '/') {
+            *c = '\0';
+            success = ensure_dir_exists (expanded);
+            *c = '/';
+        }
+    }
+    free (expanded);
+    return success;
+}
+
+// Called before building the first program, needs a GL context.
+void gl_programs_init ()
+{
+    struct gl_program_cache_t *cache = &global_program_cache;
+    if (cache->initialized) {
+        return;
+    }
+    cache->initialized = true;
+
+    // NOTE: Compile on as many threads as the driver wants, programs built
+    // with gl_program_build_begin() get compiled concurrently.
+    if (gl_has_extension ("GL_KHR_parallel_shader_compile")) {
+        glMaxShaderCompilerThreadsKHR (0xFFFFFFFF);
+    }
+
+    GLint num_formats = 0;
+    glGetIntegerv (GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    cache->enabled = global_program_cache_dir != NULL && num_formats > 0 &&
+        gl_program_cache_create_dir (global_program_cache_dir);
+
+    GLenum strings[] = {GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION};
+    cache->driver_hash = FNV1A_64_OFFSET;
+    int i;
+    for (i=0; i<ARRAY_SIZE(strings); i++) {
+        const char *str = (const char*)glGetString (strings[i]);
+        if (str != NULL) {
+            cache->driver_hash = fnv1a_64 (cache->driver_hash, str, strlen (str) + 1);
+        }
+    }
+}
+
+bool gl_program_cache_path (char *path, size_t size, uint64_t hash)
+{
+    char *dir = sh_expand (global_program_cache_dir, NULL);
+    int len = snprintf (path, size, "%s%016" PRIx64 ".bin", dir, hash);
+    free (dir);
+    return len < size;
+}
+
+// Returns 0 if the program is not cached or the driver rejected the binary.
+GLuint gl_program_cache_load (uint64_t hash)
+{
+    char path[1024];
+    if (!gl_program_cache_path (path, ARRAY_SIZE(path), hash)) {
+        return 0;
+    }
+
+    int file = open (path, O_RDONLY);
+    if (file == -1) {
+        return 0;
+    }
+
+    // NOTE: binary_size comes from the file, a truncated or corrupt one must
+    // be a miss, not a huge allocation.
+    struct stat st;
+    GLuint program_id = 0;
+    mem_pool_t pool = {0};
+    struct gl_program_cache_header_t header;
+    if (fstat (file, &st) == 0 &&
+        read (file, &header, sizeof(header)) == sizeof(header) &&
+        header.magic == GL_PROGRAM_CACHE_MAGIC && header.hash == hash &&
+        st.st_size == sizeof(header) + (off_t)header.binary_size) {
+        void *binary = mem_pool_push_size (&pool, header.binary_size);
+        if (read (file, binary, header.binary_size) == header.binary_size) {
+            program_id = glCreateProgram ();
+            glProgramBinary (program_id, header.binary_format, binary, header.binary_size);
+
+            GLint link_status;
+            glGetProgramiv (program_id, GL_LINK_STATUS, &link_status);
+            if (link_status != GL_TRUE) {
+                glDeleteProgram (program_id);
+                program_id = 0;
+            }
+        }
+    }
+
+    close (file);
+    mem_pool_destroy (&pool);
+    return program_id;
+}
+
+// NOTE: The binary is written to a temporary file and renamed, another
+// instance loading the same program never sees a partial file.
+void gl_program_cache_store (GLuint program_id, uint64_t hash)
+{
+    char path[1024], tmp_path[1024];
+    if (!gl_program_cache_path (path, ARRAY_SIZE(path), hash) ||
+        snprintf (tmp_path, ARRAY_SIZE(tmp_path), "%s.%d", path, (int)getpid ()) >= ARRAY_SIZE(tmp_path)) {
+        return;
+    }
+
+    GLint binary_size = 0;
+    glGetProgramiv (program_id, GL_PROGRAM_BINARY_LENGTH, &binary_size);
+    if (binary_size == 0) {
+        return;
+    }
+
+    mem_pool_t pool = {0};
+    struct gl_program_cache_header_t header = {0};
+    header.magic = GL_PROGRAM_CACHE_MAGIC;
+    header.hash = hash;
+    void *binary = mem_pool_push_size (&pool, binary_size);
+    GLsizei length;
+    GLenum binary_format;
+    glGetProgramBinary (program_id, binary_size, &length, &binary_format, binary);
+    header.binary_format = binary_format;
+    header.binary_size = length;
+
+    int file = open (tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (file != -1) {
+        file_write (file, &header, sizeof(header));
+        file_write (file, binary, length);
+        close (file);
+        if (rename (tmp_path, path) == -1) {
+            printf ("Could not store program binary %s: %s\n", path, strerror (errno));
+            unlink (tmp_path);
+        }
+    }
+    mem_pool_destroy (&pool);
+}
+
+// Inserts _defines_ after the #version line of _source_, followed by a #line
+// directive so errors still refer to lines of the file.
+const char* gl_source_with_defines (mem_pool_t *pool, const char *source, const char *defines)
+{
+    if (defines == NULL || *defines == '\0') {
+        return source;
+    }
+
+    const char *body = source;
+    int first_line = 1;
+    if (strncmp (source, "#version", 8) == 0) {
+        body = strchr (source, '\n');
+        body = body == NULL ? source + strlen (source) : body + 1;
+        first_line = 2;
+    }
+
+    size_t size = strlen (source) + strlen (defines) + 32;
+    char *res = (char*)mem_pool_push_size (pool, size);
+    snprintf (res, size, "%.*s%s\n#line %d\n%s", (int)(body - source), source, defines, first_line, body);
+    return res;
+}
+
+// Building a program is split in 2 halves so several programs can be compiled
+// at the same time. gl_program_build_begin() issues the compilation and
+// linking, gl_program_build_end() waits for the result and checks for errors.
+// To build a set of programs, begin all of them before ending any.
+//
+// Each file is compiled into its own shader object and all of them are linked
+// together. This allows splitting a stage into a file with main() that only
+// declares some functions, and several files with alternative implementations
+// of them.
+//
+// Every shader gets _defines_ (#define lines, can be NULL) after its #version.
+//
+// NOTE: File names are kept for error messages, they must stay valid until
+// gl_program_build_end().
+#define GL_PROGRAM_MAX_SHADERS 8
+struct gl_program_build_t {
+    GLuint program_id;
+    uint64_t hash;
+    bool failed;
+    bool from_cache;
+
+    int num_shaders;
+    GLuint shaders[GL_PROGRAM_MAX_SHADERS];
+    const char *shader_names[GL_PROGRAM_MAX_SHADERS];
+    const char *name; // of the program, the first fragment shader
+};
+
+void gl_program_build_begin (struct gl_program_build_t *build,
+                             const char **vertex_shader_sources, int num_vertex_shaders,
+                             const char **fragment_shader_sources, int num_fragment_shaders,
+                             const char *defines)
+{
+    *build = (struct gl_program_build_t){0};
+    build->name = fragment_shader_sources[0];
+    gl_programs_init ();
+
+    int num_shaders = num_vertex_shaders + num_fragment_shaders;
+    if (num_shaders > GL_PROGRAM_MAX_SHADERS) {
+        printf ("Program \"%s\" has too many shaders.\n", build->name);
+        build->failed = true;
+        return;
+    }
+
+    mem_pool_t pool = {0};
+    const char *sources[GL_PROGRAM_MAX_SHADERS];
+    GLenum types[GL_PROGRAM_MAX_SHADERS];
+    build->hash = global_program_cache.driver_hash;
+
+    int i;
+    for (i=0; i<num_shaders; i++) {
+        bool is_vertex = i < num_vertex_shaders;
+        const char *name = is_vertex ?
+            vertex_shader_sources[i] : fragment_shader_sources[i - num_vertex_shaders];
+        types[i] = is_vertex ? GL_VERTEX_SHADER : GL_FRAGMENT_SHADER;
+        build->shader_names[i] = name;
+
+        sources[i] = gl_shader_source (&pool, name);
+        if (sources[i] == NULL) {
+            printf ("Could not read shader \"%s\".\n", name);
+            build->failed = true;
+        } else {
+            sources[i] = gl_source_with_defines (&pool, sources[i], defines);
+            build->hash = fnv1a_64 (build->hash, &types[i], sizeof(types[i]));
+            build->hash = fnv1a_64 (build->hash, sources[i], strlen (sources[i]) + 1);
+        }
+    }
+
+    if (!build->failed && global_program_cache.enabled) {
+        build->program_id = gl_program_cache_load (build->hash);
+        build->from_cache = build->program_id != 0;
+    }
+
+    if (!build->failed && !build->from_cache) {
+        build->program_id = glCreateProgram();
+        for (i=0; i<num_shaders; i++) {
+            build->shaders[i] = gl_shader_begin (types[i], sources[i]);
+            glAttachShader (build->program_id, build->shaders[i]);
+        }
+        build->num_shaders = num_shaders;
+
+        glBindFragDataLocation (build->program_id, 0, "out_color");
+        if (global_program_cache.enabled) {
+            glProgramParameteri (build->program_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+        glLinkProgram (build->program_id);
     }
 
     mem_pool_destroy (&pool);
+}
+
+// Returns the program, or 0 if building it failed. The program is left in use.
+GLuint gl_program_build_end (struct gl_program_build_t *build)
+{
+    if (build->failed) {
+        return 0;
+    }
+
+    GLuint program_id = build->program_id;
+    if (!build->from_cache) {
+        bool compilation_failed = false;
+        int i;
+        for (i=0; i<build->num_shaders; i++) {
+            if (!gl_shader_check (build->shaders[i], build->shader_names[i])) {
+                compilation_failed = true;
+            }
+        }
+
+        GLint link_status = GL_FALSE;
+        if (!compilation_failed) {
+            glGetProgramiv (program_id, GL_LINK_STATUS, &link_status);
+            if (link_status != GL_TRUE) {
+                printf ("Linking of \"%s\" failed.\n", build->name);
+                char buffer[512];
+                glGetProgramInfoLog (program_id, 512, NULL, buffer);
+                printf ("%s", buffer);
+            }
+        }
+
+        // NOTE: Shaders attached to a program are only flagged for deletion.
+        for (i=0; i<build->num_shaders; i++) {
+            glDeleteShader (build->shaders[i]);
+        }
+
+        if (link_status != GL_TRUE) {
+            glDeleteProgram (program_id);
+            return 0;
+        }
+
+        if (global_program_cache.enabled) {
+            gl_program_cache_store (program_id, build->hash);
+        }
+    }
+
+    gl_program_reflect_uniforms (program_id);
+    gl_use_program (program_id);
     return program_id;
 }
 
+GLuint gl_program_files (const char **vertex_shader_sources, int num_vertex_shaders,
+                         const char **fragment_shader_sources, int num_fragment_shaders)
+{
+    struct gl_program_build_t build;
+    gl_program_build_begin (&build, vertex_shader_sources, num_vertex_shaders,
+                            fragment_shader_sources, num_fragment_shaders, NULL);
+    return gl_program_build_end (&build);
+}
+
+// Set of programs built from the same files with different #defines. Each
+// option is a define that is 1 in the variants whose key has its bit set, and
+// 0 in the rest, shaders select code with #if. This replaces branches on
+// uniforms that are constant for a whole draw.
+//
+// A variant is built the first time it's selected and kept until the set is
+// destroyed. gl_program_variants_build_all() builds them all at once, in
+// parallel, and avoids compiling in the middle of a frame.
+//
+// NOTE: Variants don't share uniform values, set them after selecting one.
+#define GL_PROGRAM_MAX_OPTIONS 4
+#define GL_PROGRAM_MAX_VARIANTS (1<<GL_PROGRAM_MAX_OPTIONS)
+struct gl_program_variants_t {
+    int num_vertex_shaders;
+    const char *vertex_shaders[GL_PROGRAM_MAX_SHADERS];
+    int num_fragment_shaders;
+    const char *fragment_shaders[GL_PROGRAM_MAX_SHADERS];
+    int num_options;
+    const char *options[GL_PROGRAM_MAX_OPTIONS];
+
+    GLuint programs[GL_PROGRAM_MAX_VARIANTS];
+    bool failed[GL_PROGRAM_MAX_VARIANTS]; // not retried every time it's selected
+};
+
+void gl_program_variants_init (struct gl_program_variants_t *variants,
+                               const char **vertex_shaders, int num_vertex_shaders,
+                               const char **fragment_shaders, int num_fragment_shaders,
+                               const char **options, int num_options)
+{
+    assert (num_vertex_shaders <= GL_PROGRAM_MAX_SHADERS &&
+            num_fragment_shaders <= GL_PROGRAM_MAX_SHADERS &&
+            num_options <= GL_PROGRAM_MAX_OPTIONS);
+
+    *variants = (struct gl_program_variants_t){0};
+    variants->num_vertex_shaders = num_vertex_shaders;
+    memcpy (variants->vertex_shaders, vertex_shaders, num_vertex_shaders*sizeof(*vertex_shaders));
+    variants->num_fragment_shaders = num_fragment_shaders;
+    memcpy (variants->fragment_shaders, fragment_shaders, num_fragment_shaders*sizeof(*fragment_shaders));
+    variants->num_options = num_options;
+    memcpy (variants->options, options, num_options*sizeof(*options));
+}
+
+void gl_program_variant_defines (struct gl_program_variants_t *variants, uint32_t key,
+                                 char *buff, size_t size)
+{
+    size_t len = 0;
+    buff[0] = '\0';
+    int i;
+    for (i=0; i<variants->num_options && len < size; i++) {
+        len += snprintf (buff + len, size - len, "#define %s %d\n",
+                         variants->options[i], (key & (1<<i)) ? 1 : 0);
+    }
+}
+
+void gl_program_variant_begin (struct gl_program_variants_t *variants, uint32_t key,
+                               struct gl_program_build_t *build)
+{
+    char defines[512];
+    gl_program_variant_defines (variants, key, defines, ARRAY_SIZE(defines));
+    gl_program_build_begin (build, variants->vertex_shaders, variants->num_vertex_shaders,
+                            variants->fragment_shaders, variants->num_fragment_shaders, defines);
+}
+
+void gl_program_variant_end (struct gl_program_variants_t *variants, uint32_t key,
+                             struct gl_program_build_t *build)
+{
+    variants->programs[key] = gl_program_build_end (build);
+    variants->failed[key] = variants->programs[key] == 0;
+}
+
+// Returns the program of the variant with _key_, 0 if it could not be built.
+GLuint gl_program_variant (struct gl_program_variants_t *variants, uint32_t key)
+{
+    assert (key < (1U<<variants->num_options));
+    if (variants->programs[key] == 0 && !variants->failed[key]) {
+        struct gl_program_build_t build;
+        gl_program_variant_begin (variants, key, &build);
+        gl_program_variant_end (variants, key, &build);
+    }
+    return variants->programs[key];
+}
+
+// Returns false if any variant failed to build.
+bool gl_program_variants_build_all (struct gl_program_variants_t *variants)
+{
+    struct gl_program_build_t builds[GL_PROGRAM_MAX_VARIANTS];
+    uint32_t num_variants = 1<<variants->num_options;
+    uint32_t key;
+    for (key=0; key<num_variants; key++) {
+        if (variants->programs[key] == 0) {
+            gl_program_variant_begin (variants, key, &builds[key]);
+        }
+    }
+
+    bool success = true;
+    for (key=0; key<num_variants; key++) {
+        if (variants->programs[key] == 0) {
+            gl_program_variant_end (variants, key, &builds[key]);
+        }
+        success = success && variants->programs[key] != 0;
+    }
+    return success;
+}
+
+void gl_program_variants_destroy (struct gl_program_variants_t *variants)
+{
+    int i;
+    for (i=0; i<GL_PROGRAM_MAX_VARIANTS; i++) {
+        if (variants->programs[i]) {
+            gl_delete_program (variants->programs[i]);
+        }
+    }
+    *variants = (struct gl_program_variants_t){0};
+}
+
+GLuint gl_program (const char *vertex_shader_source, const char *fragment_shader_source)
+{
+    return gl_program_files (&vertex_shader_source, 1, &fragment_shader_source, 1);
+}
+
 void create_color_texture (GLuint *id, float width, float height, int num_samples)
 {
     glGenTextures (1, id);
@@ -121,7 +1044,9 @@ void create_depth_texture (GLuint *id, float width, float height, int num_sample
 struct gl_framebuffer_t {
     GLuint fb_id;
     GLuint tex_color_buffer;
+    GLuint depth_stencil; // a texture if multisampled, a renderbuffer otherwise
     bool multisampled;
+    int num_samples; // 0 if not multisampled
     float width;
     float height;
 };
@@ -130,6 +1055,7 @@ struct gl_framebuffer_t create_framebuffer (float width, float height)
 {
     struct gl_framebuffer_t framebuffer;
     framebuffer.multisampled = false;
+    framebuffer.num_samples = 0;
     framebuffer.width = width;
     framebuffer.height = height;
     glGenFramebuffers (1, &framebuffer.fb_id);
@@ -152,9 +1078,8 @@ struct gl_framebuffer_t create_framebuffer (float width, float height)
         GL_TEXTURE_2D, framebuffer.tex_color_buffer, 0
     );
 
-    GLuint depth_stencil;
-    glGenRenderbuffers (1, &depth_stencil);
-    glBindRenderbuffer (GL_RENDERBUFFER, depth_stencil);
+    glGenRenderbuffers (1, &framebuffer.depth_stencil);
+    glBindRenderbuffer (GL_RENDERBUFFER, framebuffer.depth_stencil);
     glRenderbufferStorage (
         GL_RENDERBUFFER, GL_DEPTH24_STENCIL8,
         width, height
@@ -162,7 +1087,7 @@ struct gl_framebuffer_t create_framebuffer (float width, float height)
 
     glFramebufferRenderbuffer (
         GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
-        GL_RENDERBUFFER, depth_stencil
+        GL_RENDERBUFFER, framebuffer.depth_stencil
     );
 
     return framebuffer;
@@ -172,6 +1097,7 @@ struct gl_framebuffer_t create_multisampled_framebuffer (float width, float heig
 {
     struct gl_framebuffer_t framebuffer;
     framebuffer.multisampled = true;
+    framebuffer.num_samples = num_samples;
     framebuffer.width = width;
     framebuffer.height = height;
     glGenFramebuffers (1, &framebuffer.fb_id);
@@ -208,9 +1134,8 @@ struct gl_framebuffer_t create_multisampled_framebuffer (float width, float heig
         GL_RENDERBUFFER, depth_stencil
     );
 #else
-    GLuint depth_stencil;
-    glGenTextures (1, &depth_stencil);
-    glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, depth_stencil);
+    glGenTextures (1, &framebuffer.depth_stencil);
+    glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, framebuffer.depth_stencil);
     glTexImage2DMultisample (
         GL_TEXTURE_2D_MULTISAMPLE, num_samples, GL_DEPTH24_STENCIL8,
         width, height, GL_FALSE
@@ -218,18 +1143,242 @@ struct gl_framebuffer_t create_multisampled_framebuffer (float width, float heig
 
     glFramebufferTexture2D (
         GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
-        GL_TEXTURE_2D_MULTISAMPLE, depth_stencil, 0
+        GL_TEXTURE_2D_MULTISAMPLE, framebuffer.depth_stencil, 0
     );
 #endif
     return framebuffer;
 }
 
+void destroy_framebuffer (struct gl_framebuffer_t *framebuffer)
+{
+    if (framebuffer->multisampled) {
+        glDeleteTextures (1, &framebuffer->depth_stencil);
+    } else {
+        glDeleteRenderbuffers (1, &framebuffer->depth_stencil);
+    }
+    glDeleteTextures (1, &framebuffer->tex_color_buffer);
+    glDeleteFramebuffers (1, &framebuffer->fb_id);
+    *framebuffer = (struct gl_framebuffer_t){0};
+}
+
+// Bytes used by a sample of a texture with the sized _internal_format_. Only
+// the formats used for render targets are known, others count as 4 bytes.
+int gl_internal_format_size (GLenum internal_format)
+{
+    switch (internal_format) {
+        case GL_R16F:
+            return 2;
+        case GL_RGBA8:
+        case GL_R32F:
+        case GL_R32UI:
+        case GL_DEPTH_COMPONENT32F:
+        case GL_DEPTH24_STENCIL8:
+            return 4;
+        case GL_RG32F:
+        case GL_RGBA16F:
+            return 8;
+        default:
+            return 4;
+    }
+}
+
+// Pool of render target textures keyed by internal format, size and number of
+// samples. Targets are acquired when a renderer needs them and released when
+// it doesn't anymore, usually because the window or the number of samples
+// changed. A released texture is handed to the next acquire with the same key,
+// and deleted if nobody asks for it in GL_RENDER_TARGET_MAX_AGE_MS
+// milliseconds. Going back and forth between two configurations reuses the
+// textures of both, and memory follows what's actually in use.
+//
+// NOTE: Age is wall clock time, not frames. An app that only renders on
+// demand could otherwise keep released textures forever once it goes idle,
+// see gl_render_target_pool_trim().
+//
+// Renderers should size their targets with gl_render_target_bucket(), so every
+// small change in window size doesn't create a new key.
+//
+// NOTE: Textures are acquired with a sized internal format, their storage is
+// immutable unless they are multisampled.
+#define GL_RENDER_TARGET_POOL_SIZE 64
+#define GL_RENDER_TARGET_MAX_AGE_MS 2000
+#define GL_RENDER_TARGET_BUCKET 256
+#define GL_RENDER_TARGET_SHRINK 0.75
+struct gl_render_target_t {
+    GLuint texture;
+    GLenum internal_format;
+    int width, height;
+    int num_samples; // 0 for a GL_TEXTURE_2D
+    uint64_t size;   // in bytes
+
+    bool in_use;
+    struct timespec released_time;
+};
+
+struct gl_render_target_pool_t {
+    struct gl_render_target_t targets[GL_RENDER_TARGET_POOL_SIZE];
+    int num_targets;
+
+    uint64_t allocated_bytes;
+    uint64_t in_use_bytes;
+    uint32_t num_allocations; // since the pool was created
+};
+
+// Dimension of a render target that fits _needed_ pixels, currently
+// _current_. It only changes if the current one is too small or much larger
+// than needed, then it's rounded up to a multiple of GL_RENDER_TARGET_BUCKET.
+int gl_render_target_bucket (int current, int needed)
+{
+    if (needed <= current && needed >= current*GL_RENDER_TARGET_SHRINK) {
+        return current;
+    }
+    return (needed + GL_RENDER_TARGET_BUCKET - 1)/GL_RENDER_TARGET_BUCKET*GL_RENDER_TARGET_BUCKET;
+}
+
+void gl_render_target_free (struct gl_render_target_pool_t *pool, int idx)
+{
+    struct gl_render_target_t *target = &pool->targets[idx];
+    glDeleteTextures (1, &target->texture);
+    pool->allocated_bytes -= target->size;
+    pool->targets[idx] = pool->targets[--pool->num_targets];
+}
+
+GLuint gl_render_target_acquire (struct gl_render_target_pool_t *pool, GLenum internal_format,
+                                 int width, int height, int num_samples)
+{
+    int i;
+    for (i=0; i<pool->num_targets; i++) {
+        struct gl_render_target_t *target = &pool->targets[i];
+        if (!target->in_use && target->internal_format == internal_format &&
+            target->width == width && target->height == height &&
+            target->num_samples == num_samples) {
+            target->in_use = true;
+            pool->in_use_bytes += target->size;
+            return target->texture;
+        }
+    }
+
+    // NOTE: When the pool is full make room by deleting the texture released
+    // the longest time ago.
+    if (pool->num_targets == GL_RENDER_TARGET_POOL_SIZE) {
+        struct timespec now;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+
+        int oldest = -1;
+        float oldest_age_ms = 0;
+        for (i=0; i<pool->num_targets; i++) {
+            struct gl_render_target_t *target = &pool->targets[i];
+            if (target->in_use) {
+                continue;
+            }
+
+            float age_ms = time_elapsed_in_ms (&target->released_time, &now);
+            if (oldest == -1 || age_ms > oldest_age_ms) {
+                oldest = i;
+                oldest_age_ms = age_ms;
+            }
+        }
+
+        if (oldest == -1) {
+            printf ("Render target pool is full, all %d targets are in use.\n", GL_RENDER_TARGET_POOL_SIZE);
+            return 0;
+        }
+        gl_render_target_free (pool, oldest);
+    }
+
+    struct gl_render_target_t *target = &pool->targets[pool->num_targets++];
+    *target = (struct gl_render_target_t){0};
+    target->internal_format = internal_format;
+    target->width = width;
+    target->height = height;
+    target->num_samples = num_samples;
+    target->size = (uint64_t)width*height*MAX (num_samples, 1)*gl_internal_format_size (internal_format);
+    target->in_use = true;
+
+    glGenTextures (1, &target->texture);
+    if (num_samples > 0) {
+        glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, target->texture);
+        glTexImage2DMultisample (
+            GL_TEXTURE_2D_MULTISAMPLE, num_samples, internal_format,
+            width, height, GL_FALSE
+        );
+    } else {
+        glBindTexture (GL_TEXTURE_2D, target->texture);
+        glTexStorage2D (GL_TEXTURE_2D, 1, internal_format, width, height);
+        glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+
+    pool->allocated_bytes += target->size;
+    pool->in_use_bytes += target->size;
+    pool->num_allocations++;
+    return target->texture;
+}
+
+void gl_render_target_release (struct gl_render_target_pool_t *pool, GLuint texture)
+{
+    if (texture == 0) {
+        return;
+    }
+
+    int i;
+    for (i=0; i<pool->num_targets; i++) {
+        struct gl_render_target_t *target = &pool->targets[i];
+        if (target->texture == texture) {
+            assert (target->in_use);
+            target->in_use = false;
+            clock_gettime (CLOCK_MONOTONIC, &target->released_time);
+            pool->in_use_bytes -= target->size;
+            return;
+        }
+    }
+    invalid_code_path;
+}
+
+// Deletes the textures that have been released for more than
+// GL_RENDER_TARGET_MAX_AGE_MS. Returns the time in milliseconds until the next
+// released texture expires, or 0 if there is none. Apps that go idle should
+// schedule a wakeup after that long and trim again.
+float gl_render_target_pool_trim (struct gl_render_target_pool_t *pool)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+
+    float next_expiry_ms = 0;
+    int i = 0;
+    while (i < pool->num_targets) {
+        struct gl_render_target_t *target = &pool->targets[i];
+        if (target->in_use) {
+            i++;
+            continue;
+        }
+
+        float remaining_ms = GL_RENDER_TARGET_MAX_AGE_MS - time_elapsed_in_ms (&target->released_time, &now);
+        if (remaining_ms <= 0) {
+            gl_render_target_free (pool, i);
+        } else {
+            if (next_expiry_ms == 0 || remaining_ms < next_expiry_ms) {
+                next_expiry_ms = remaining_ms;
+            }
+            i++;
+        }
+    }
+    return next_expiry_ms;
+}
+
+void gl_render_target_pool_destroy (struct gl_render_target_pool_t *pool)
+{
+    while (pool->num_targets > 0) {
+        gl_render_target_free (pool, pool->num_targets - 1);
+    }
+    *pool = (struct gl_render_target_pool_t){0};
+}
+
 static inline
 void draw_into_full_framebuffer (struct gl_framebuffer_t framebuffer)
 {
     glBindFramebuffer (GL_FRAMEBUFFER, framebuffer.fb_id);
-    glViewport (0, 0, framebuffer.width, framebuffer.height);
-    glScissor (0, 0, framebuffer.width, framebuffer.height);
+    gl_viewport (0, 0, framebuffer.width, framebuffer.height);
+    gl_scissor (0, 0, framebuffer.width, framebuffer.height);
 }
 
 static inline
@@ -237,21 +1386,30 @@ void draw_into_framebuffer_clip (struct gl_framebuffer_t framebuffer,
                                  float x, float y, float width, float height)
 {
     glBindFramebuffer (GL_FRAMEBUFFER, framebuffer.fb_id);
-    glViewport (x, y, width, height);
-    glScissor (x, y, width, height);
+    gl_viewport (x, y, width, height);
+    gl_scissor (x, y, width, height);
 }
 
 static inline
 void draw_into_window (app_graphics_t *graphics)
 {
     glBindFramebuffer (GL_FRAMEBUFFER, 0);
-    glViewport (0, 0, graphics->width, graphics->height);
-    glScissor (0, 0, graphics->width, graphics->height);
+    gl_viewport (0, 0, graphics->width, graphics->height);
+    gl_scissor (0, 0, graphics->width, graphics->height);
 }
 
+// Options of 2Dfragment_shader.glsl, bits of the key of a quad renderer
+// variant. See quad_renderer_use().
+#define QUAD_MULTISAMPLED (1<<0)
+#define QUAD_IGNORE_ALPHA (1<<1)
+const char *quad_renderer_options[] = {"MULTISAMPLED", "IGNORE_ALPHA"};
+
 struct quad_renderer_t {
     GLuint vao;
-    GLuint program_id;
+    GLuint vbo;
+    GLuint program_id; // variant without options
+    struct gl_program_variants_t variants;
+    mat4f transf;      // set by set_texture_clip()
 };
 
 struct quad_renderer_t init_quad_renderer ()
@@ -269,14 +1427,22 @@ struct quad_renderer_t init_quad_renderer ()
     };
 
     glGenVertexArrays (1, &res.vao);
-    glBindVertexArray (res.vao);
+    gl_bind_vertex_array (res.vao);
 
-    GLuint quad;
-    glGenBuffers (1, &quad);
-    glBindBuffer (GL_ARRAY_BUFFER, quad);
+    glGenBuffers (1, &res.vbo);
+    glBindBuffer (GL_ARRAY_BUFFER, res.vbo);
     glBufferData (GL_ARRAY_BUFFER, sizeof(quad_v), quad_v, GL_STATIC_DRAW);
 
-    res.program_id = gl_program ("2Dvertex_shader.glsl", "2Dfragment_shader.glsl");
+    // NOTE: All variants are built upfront so none gets compiled in the
+    // middle of a frame. They share the VAO, attribute locations are explicit
+    // in 2Dvertex_shader.glsl.
+    const char *vertex_shaders[] = {"2Dvertex_shader.glsl"};
+    const char *fragment_shaders[] = {"2Dfragment_shader.glsl"};
+    gl_program_variants_init (&res.variants, vertex_shaders, ARRAY_SIZE(vertex_shaders),
+                              fragment_shaders, ARRAY_SIZE(fragment_shaders),
+                              quad_renderer_options, ARRAY_SIZE(quad_renderer_options));
+    gl_program_variants_build_all (&res.variants);
+    res.program_id = res.variants.programs[0];
     if (!res.program_id) {
         return res;
     }
@@ -289,19 +1455,36 @@ struct quad_renderer_t init_quad_renderer ()
     glEnableVertexAttribArray (tex_coord_loc);
     glVertexAttribPointer (tex_coord_loc, 2, GL_FLOAT, GL_FALSE, 4*sizeof(float), (void*)(2*sizeof(float)));
 
-    GLuint tex_loc = glGetUniformLocation (res.program_id, "tex");
-    glUniform1i (tex_loc, 0);
-
     mat4f transf = {{
          1, 0, 0, 0,
          0, 1, 0, 0,
          0, 0, 1, 0,
          0, 0, 0, 1
     }};
-    glUniformMatrix4fv (glGetUniformLocation (res.program_id, "transf"), 1, GL_TRUE, transf.E);
+    res.transf = transf;
     return res;
 }
 
+// Creates a VAO that feeds the vertices of the quad renderer to another
+// program. It must take the "position" and "tex_coord_in" attributes like
+// 2Dvertex_shader.glsl does.
+GLuint quad_renderer_vao (struct quad_renderer_t *quad, GLuint program_id)
+{
+    GLuint vao;
+    glGenVertexArrays (1, &vao);
+    gl_bind_vertex_array (vao);
+    glBindBuffer (GL_ARRAY_BUFFER, quad->vbo);
+
+    GLuint pos_loc = glGetAttribLocation (program_id, "position");
+    glEnableVertexAttribArray (pos_loc);
+    glVertexAttribPointer (pos_loc, 2, GL_FLOAT, GL_FALSE, 4*sizeof(float), 0);
+
+    GLuint tex_coord_loc = glGetAttribLocation (program_id, "tex_coord_in");
+    glEnableVertexAttribArray (tex_coord_loc);
+    glVertexAttribPointer (tex_coord_loc, 2, GL_FLOAT, GL_FALSE, 4*sizeof(float), (void*)(2*sizeof(float)));
+    return vao;
+}
+
 // Sets the square (in texture coordinates) from the texture with which to fill
 // the quad rendered by quad_prog.
 //
@@ -311,11 +1494,9 @@ void set_texture_clip (struct quad_renderer_t *quad_prog,
                        float texture_width, float texture_height,
                        float x, float y, float width, float height)
 {
-    glUseProgram (quad_prog->program_id);
     dvec3 s1 = DVEC3(-1 + 2*x/texture_width, -1 + 2*y/texture_height, 0);
     dvec3 s2 = DVEC3(s1.x + 2*width/texture_width, s1.y + 2*height/texture_height, 0);
-    mat4f transf = transform_from_2_points (s1, s2, DVEC3(-1,-1,0), DVEC3(1,1,0));
-    glUniformMatrix4fv (glGetUniformLocation (quad_prog->program_id, "transf"), 1, GL_TRUE, transf.E);
+    quad_prog->transf = transform_from_2_points (s1, s2, DVEC3(-1,-1,0), DVEC3(1,1,0));
 }
 
 // Sets the square (in texture coordinates) from the framebuffer with which to
@@ -327,57 +1508,66 @@ void set_framebuffer_clip (struct quad_renderer_t *quad_prog,
     set_texture_clip (quad_prog, fb->width, fb->height, x, y, width, height);
 }
 
-void blend_premul_quad (struct quad_renderer_t *quad_prog,
-                        GLuint texture, bool multisampled,
-                        app_graphics_t *graphics,
-                        float x, float y, float width_px, float height_px)
+// Binds the texture sampled by a quad renderer variant. Multisampled textures
+// are resolved by the shader averaging their _num_samples_ samples, 0 means
+// _texture_ is a GL_TEXTURE_2D.
+//
+// NOTE: The caller passes the number of samples, querying it from the texture
+// would be a driver round trip every draw.
+void quad_renderer_bind_texture (GLuint program_id, GLuint texture, int num_samples)
 {
-    glBindVertexArray (quad_prog->vao);
-    glUseProgram (quad_prog->program_id);
-    glDisable (GL_DEPTH_TEST);
-    glActiveTexture (GL_TEXTURE0);
+    gl_active_texture (GL_TEXTURE0);
 
-    if (multisampled) {
+    if (num_samples > 0) {
         glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, texture);
-        glUniform1i (glGetUniformLocation (quad_prog->program_id, "texMS"), 0);
-        glUniform1i (glGetUniformLocation (quad_prog->program_id, "multisampled_texture"), 1);
+        glUniform1i (gl_uniform_location (program_id, "num_samples"), num_samples);
     } else {
         glBindTexture (GL_TEXTURE_2D, texture);
-        glUniform1i (glGetUniformLocation (quad_prog->program_id, "tex"), 0);
-        glUniform1i (glGetUniformLocation (quad_prog->program_id, "multisampled_texture"), 0);
+    }
+    glUniform1i (gl_uniform_location (program_id, "tex"), 0);
+}
+
+// Makes current the variant of the quad program for _options_ (QUAD_*), with
+// the transform of the last set_texture_clip() and _texture_ bound. A
+// _texture_ with _num_samples_ > 0 is multisampled, QUAD_MULTISAMPLED is added
+// to the options.
+void quad_renderer_use (struct quad_renderer_t *quad_prog, GLuint texture, int num_samples,
+                        uint32_t options)
+{
+    if (num_samples > 0) {
+        options |= QUAD_MULTISAMPLED;
     }
 
-    glViewport (x, graphics->height - y - height_px, width_px, height_px);
-    glScissor (x, graphics->height - y - height_px, width_px, height_px);
+    GLuint program_id = gl_program_variant (&quad_prog->variants, options);
+    gl_bind_vertex_array (quad_prog->vao);
+    gl_use_program (program_id);
+    glUniformMatrix4fv (gl_uniform_location (program_id, "transf"), 1, GL_TRUE, quad_prog->transf.E);
+    quad_renderer_bind_texture (program_id, texture, num_samples);
+}
 
-    glUniform1i (glGetUniformLocation (quad_prog->program_id, "ignore_alpha"), 0);
+void blend_premul_quad (struct quad_renderer_t *quad_prog,
+                        GLuint texture, int num_samples,
+                        app_graphics_t *graphics,
+                        float x, float y, float width_px, float height_px)
+{
+    gl_disable (GL_DEPTH_TEST);
+    quad_renderer_use (quad_prog, texture, num_samples, 0);
+
+    gl_viewport (x, graphics->height - y - height_px, width_px, height_px);
+    gl_scissor (x, graphics->height - y - height_px, width_px, height_px);
     glDrawArrays (GL_TRIANGLES, 0, 6);
 }
 
 void render_opaque_quad (struct quad_renderer_t *quad_prog,
-                         GLuint texture, bool multisampled,
+                         GLuint texture, int num_samples,
                          app_graphics_t *graphics,
                          float x, float y, float width_px, float height_px)
 {
-    glBindVertexArray (quad_prog->vao);
-    glUseProgram (quad_prog->program_id);
-    glDisable (GL_DEPTH_TEST);
-    glActiveTexture (GL_TEXTURE0);
+    gl_disable (GL_DEPTH_TEST);
+    quad_renderer_use (quad_prog, texture, num_samples, QUAD_IGNORE_ALPHA);
 
-    if (multisampled) {
-        glBindTexture (GL_TEXTURE_2D_MULTISAMPLE, texture);
-        glUniform1i (glGetUniformLocation (quad_prog->program_id, "texMS"), 0);
-        glUniform1i (glGetUniformLocation (quad_prog->program_id, "multisampled_texture"), 1);
-    } else {
-        glBindTexture (GL_TEXTURE_2D, texture);
-        glUniform1i (glGetUniformLocation (quad_prog->program_id, "tex"), 0);
-        glUniform1i (glGetUniformLocation (quad_prog->program_id, "multisampled_texture"), 0);
-    }
-
-    glViewport (x, graphics->height - y - height_px, width_px, height_px);
-    glScissor (x, graphics->height - y - height_px, width_px, height_px);
-
-    glUniform1i (glGetUniformLocation (quad_prog->program_id, "ignore_alpha"), 1);
+    gl_viewport (x, graphics->height - y - height_px, width_px, height_px);
+    gl_scissor (x, graphics->height - y - height_px, width_px, height_px);
     glDrawArrays (GL_TRIANGLES, 0, 6);
 }
 
@@ -387,14 +1577,363 @@ void render_framebuffer (struct quad_renderer_t *quad_prog,
                          float x, float y, float width_px, float height_px)
 {
     if (blend) {
-        blend_premul_quad (quad_prog, fb->tex_color_buffer, fb->multisampled, graphics,
+        blend_premul_quad (quad_prog, fb->tex_color_buffer, fb->num_samples, graphics,
                            x, y, width_px, height_px);
     } else {
-        glDisable (GL_BLEND);
-        render_opaque_quad (quad_prog, fb->tex_color_buffer, fb->multisampled, graphics,
+        gl_disable (GL_BLEND);
+        render_opaque_quad (quad_prog, fb->tex_color_buffer, fb->num_samples, graphics,
                            x, y, width_px, height_px);
     }
 }
 
+// Streams rectangles of a CPU side image into a texture without stalling.
+//
+// Pixels are written into one of a ring of pixel buffer objects and the
+// texture is updated from it with glTexSubImage2D(), so the copy into the
+// texture happens asynchronously on the GPU. Each buffer is guarded by a fence,
+// it's only written again once the GPU finished reading it. If the next buffer
+// in the ring is still in use we don't wait, the upload is skipped and the
+// caller should try again next frame.
+//
+// When ARB_buffer_storage is available buffers are mapped once, persistently.
+// Otherwise they are mapped every upload with glMapBufferRange(), unsynchronized
+// because the fence already tells us the GPU is done with them.
+//
+// NOTE: Source images are expected in cairo's ARGB32 format (premultiplied,
+// native endian) with the first row at the top. Rows are flipped while copying,
+// so row 0 of the texture is the bottom of the image as usual in GL.
+#define GL_TEXTURE_STREAM_RING_SIZE 3
+struct gl_texture_stream_t {
+    GLuint texture;
+    int width;
+    int height;
+
+    bool persistent;
+    uint32_t pbo_size;
+    GLuint pbos[GL_TEXTURE_STREAM_RING_SIZE];
+    uint8_t *mapped[GL_TEXTURE_STREAM_RING_SIZE];
+    GLsync fences[GL_TEXTURE_STREAM_RING_SIZE];
+    int next;
+};
+
+void gl_texture_stream_init (struct gl_texture_stream_t *stream, int width, int height)
+{
+    *stream = (struct gl_texture_stream_t){0};
+    stream->width = width;
+    stream->height = height;
+    create_color_texture (&stream->texture, width, height, 0);
+
+    stream->pbo_size = width*height*4;
+    stream->persistent = gl_has_extension ("GL_ARB_buffer_storage");
+
+    glGenBuffers (GL_TEXTURE_STREAM_RING_SIZE, stream->pbos);
+    int i;
+    for (i=0; i<GL_TEXTURE_STREAM_RING_SIZE; i++) {
+        glBindBuffer (GL_PIXEL_UNPACK_BUFFER, stream->pbos[i]);
+        if (stream->persistent) {
+            GLbitfield flags = GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+            glBufferStorage (GL_PIXEL_UNPACK_BUFFER, stream->pbo_size, NULL, flags);
+            stream->mapped[i] = glMapBufferRange (GL_PIXEL_UNPACK_BUFFER, 0, stream->pbo_size, flags);
+        } else {
+            glBufferData (GL_PIXEL_UNPACK_BUFFER, stream->pbo_size, NULL, GL_STREAM_DRAW);
+        }
+    }
+    glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void gl_texture_stream_destroy (struct gl_texture_stream_t *stream)
+{
+    int i;
+    for (i=0; i<GL_TEXTURE_STREAM_RING_SIZE; i++) {
+        if (stream->fences[i] != NULL) {
+            glDeleteSync (stream->fences[i]);
+        }
+        if (stream->persistent) {
+            glBindBuffer (GL_PIXEL_UNPACK_BUFFER, stream->pbos[i]);
+            glUnmapBuffer (GL_PIXEL_UNPACK_BUFFER);
+        }
+    }
+    glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers (GL_TEXTURE_STREAM_RING_SIZE, stream->pbos);
+    glDeleteTextures (1, &stream->texture);
+    *stream = (struct gl_texture_stream_t){0};
+}
+
+// Uploads the _rects_ of _data_ (in pixels, origin at the top left) into the
+// texture. Returns false if no buffer was free, nothing is uploaded then.
+bool gl_texture_stream_upload (struct gl_texture_stream_t *stream,
+                               uint8_t *data, int stride,
+                               box_t *rects, int num_rects)
+{
+    int slot = stream->next;
+    if (stream->fences[slot] != NULL) {
+        GLenum status = glClientWaitSync (stream->fences[slot], 0, 0);
+        if (status == GL_TIMEOUT_EXPIRED) {
+            return false;
+        }
+        glDeleteSync (stream->fences[slot]);
+        stream->fences[slot] = NULL;
+    }
+
+    // Clamp rectangles to the texture, if together they don't fit in the
+    // buffer (only possible if they overlap) upload everything.
+    box_t full_rect = {{{0, 0}}, {{stream->width, stream->height}}};
+    uint32_t total_size = 0;
+    int i;
+    for (i=0; i<num_rects; i++) {
+        box_t *r = &rects[i];
+        r->min.x = CLAMP (r->min.x, 0, stream->width);
+        r->max.x = CLAMP (r->max.x, 0, stream->width);
+        r->min.y = CLAMP (r->min.y, 0, stream->height);
+        r->max.y = CLAMP (r->max.y, 0, stream->height);
+        total_size += BOX_WIDTH(*r)*BOX_HEIGHT(*r)*4;
+    }
+    if (total_size > stream->pbo_size) {
+        rects = &full_rect;
+        num_rects = 1;
+        total_size = stream->pbo_size;
+    }
+
+    // NOTE: Mapping an empty range is an error, and there is nothing to do.
+    if (total_size == 0) {
+        return true;
+    }
+
+    glBindBuffer (GL_PIXEL_UNPACK_BUFFER, stream->pbos[slot]);
+    uint8_t *dst;
+    if (stream->persistent) {
+        dst = stream->mapped[slot];
+    } else {
+        dst = glMapBufferRange (GL_PIXEL_UNPACK_BUFFER, 0, total_size,
+                                GL_MAP_WRITE_BIT|GL_MAP_UNSYNCHRONIZED_BIT|GL_MAP_INVALIDATE_RANGE_BIT);
+    }
+
+    if (dst == NULL) {
+        glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+        return false;
+    }
+
+    // Copy all rectangles into the buffer, tightly packed and flipped.
+    uint32_t offset = 0;
+    uint32_t offsets[num_rects];
+    for (i=0; i<num_rects; i++) {
+        box_t *r = &rects[i];
+        int x = r->min.x, w = BOX_WIDTH(*r), h = BOX_HEIGHT(*r);
+        offsets[i] = offset;
+
+        int row;
+        for (row=0; row<h; row++) {
+            int src_y = r->max.y - 1 - row;
+            memcpy (dst + offset, data + src_y*stride + x*4, w*4);
+            offset += w*4;
+        }
+    }
+
+    if (!stream->persistent) {
+        glUnmapBuffer (GL_PIXEL_UNPACK_BUFFER);
+    }
+
+    glBindTexture (GL_TEXTURE_2D, stream->texture);
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+    for (i=0; i<num_rects; i++) {
+        box_t *r = &rects[i];
+        int w = BOX_WIDTH(*r), h = BOX_HEIGHT(*r);
+        if (w == 0 || h == 0) {
+            continue;
+        }
+
+        glTexSubImage2D (GL_TEXTURE_2D, 0,
+                         r->min.x, stream->height - r->max.y, w, h,
+                         GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
+                         (void*)(uintptr_t)offsets[i]);
+    }
+    glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+
+    stream->fences[slot] = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    stream->next = (slot+1)%GL_TEXTURE_STREAM_RING_SIZE;
+    return true;
+}
+
+// Ring of copies of a uniform block, in a single buffer bound to _binding_
+// with glBindBufferRange(). Every program that declares the block reads it
+// from there, it is written once no matter how many programs use it.
+//
+// Writes go to the next copy so the GPU can keep reading the previous ones.
+// Like in gl_texture_stream_t each copy is guarded by a fence, set by
+// gl_uniform_ring_fence() after the draws that read it. With 3 copies waiting
+// for one should be rare.
+//
+// NOTE: The buffer is mapped once, persistently, when ARB_buffer_storage is
+// available. Otherwise copies are written with glBufferSubData().
+#define GL_UNIFORM_RING_SIZE 3
+struct gl_uniform_ring_t {
+    GLuint buffer;
+    GLuint binding;
+    uint32_t block_size;
+    uint32_t stride; // block_size aligned to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+
+    bool persistent;
+    uint8_t *mapped;
+    GLsync fences[GL_UNIFORM_RING_SIZE];
+    int current; // copy bound to binding, -1 before the first write
+};
+
+void gl_uniform_ring_init (struct gl_uniform_ring_t *ring, GLuint binding, uint32_t block_size)
+{
+    *ring = (struct gl_uniform_ring_t){0};
+    ring->binding = binding;
+    ring->block_size = block_size;
+    ring->current = -1;
+
+    GLint alignment;
+    glGetIntegerv (GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    ring->stride = (block_size + alignment - 1)/alignment*alignment;
+
+    uint32_t size = GL_UNIFORM_RING_SIZE*ring->stride;
+    ring->persistent = gl_has_extension ("GL_ARB_buffer_storage");
+    glGenBuffers (1, &ring->buffer);
+    glBindBuffer (GL_UNIFORM_BUFFER, ring->buffer);
+    if (ring->persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+        glBufferStorage (GL_UNIFORM_BUFFER, size, NULL, flags);
+        ring->mapped = glMapBufferRange (GL_UNIFORM_BUFFER, 0, size, flags);
+    } else {
+        glBufferData (GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    }
+}
+
+void gl_uniform_ring_destroy (struct gl_uniform_ring_t *ring)
+{
+    int i;
+    for (i=0; i<GL_UNIFORM_RING_SIZE; i++) {
+        if (ring->fences[i] != NULL) {
+            glDeleteSync (ring->fences[i]);
+        }
+    }
+    if (ring->persistent) {
+        glBindBuffer (GL_UNIFORM_BUFFER, ring->buffer);
+        glUnmapBuffer (GL_UNIFORM_BUFFER);
+    }
+    glDeleteBuffers (1, &ring->buffer);
+    *ring = (struct gl_uniform_ring_t){0};
+}
+
+// Copies _block_size_ bytes of _data_ into the next copy and binds it.
+void gl_uniform_ring_write (struct gl_uniform_ring_t *ring, void *data)
+{
+    int slot = (ring->current + 1)%GL_UNIFORM_RING_SIZE;
+    if (ring->fences[slot] != NULL) {
+        glClientWaitSync (ring->fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+        glDeleteSync (ring->fences[slot]);
+        ring->fences[slot] = NULL;
+    }
+
+    uint32_t offset = slot*ring->stride;
+    glBindBuffer (GL_UNIFORM_BUFFER, ring->buffer);
+    if (ring->persistent) {
+        memcpy (ring->mapped + offset, data, ring->block_size);
+    } else {
+        glBufferSubData (GL_UNIFORM_BUFFER, offset, ring->block_size, data);
+    }
+
+    glBindBufferRange (GL_UNIFORM_BUFFER, ring->binding, ring->buffer, offset, ring->block_size);
+    ring->current = slot;
+}
+
+// Called after the draws that read the current copy, it won't be written
+// again until the GPU is done with them.
+void gl_uniform_ring_fence (struct gl_uniform_ring_t *ring)
+{
+    if (ring->current == -1) {
+        return;
+    }
+
+    GLsync *fence = &ring->fences[ring->current];
+    if (*fence != NULL) {
+        glDeleteSync (*fence);
+    }
+    *fence = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Binds the block of a linked program to the binding of _ring_. Programs
+// without the block are left alone.
+void gl_uniform_ring_bind_program (struct gl_uniform_ring_t *ring, GLuint program_id,
+                                   const char *block_name)
+{
+    GLuint block_index = glGetUniformBlockIndex (program_id, block_name);
+    if (block_index != GL_INVALID_INDEX) {
+        glUniformBlockBinding (program_id, block_index, ring->binding);
+    }
+}
+
+// A cairo image surface composited on top of the GL scene. Only the damage
+// recorded in the gui state is uploaded each frame.
+struct gl_cairo_overlay_t {
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    struct gl_texture_stream_t stream;
+};
+
+void gl_cairo_overlay_init (struct gl_cairo_overlay_t *overlay, int width, int height)
+{
+    overlay->surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+    overlay->cr = cairo_create (overlay->surface);
+    gl_texture_stream_init (&overlay->stream, width, height);
+
+    // NOTE: Textures are created with undefined contents, start from a
+    // transparent one.
+    box_t full = {{{0, 0}}, {{width, height}}};
+    cairo_surface_flush (overlay->surface);
+    gl_texture_stream_upload (&overlay->stream, cairo_image_surface_get_data (overlay->surface),
+                              cairo_image_surface_get_stride (overlay->surface), &full, 1);
+}
+
+void gl_cairo_overlay_destroy (struct gl_cairo_overlay_t *overlay)
+{
+    cairo_destroy (overlay->cr);
+    cairo_surface_destroy (overlay->surface);
+    gl_texture_stream_destroy (&overlay->stream);
+}
+
+// Uploads the damaged areas of the overlay. The damage is cleared only if the
+// upload happened, otherwise it's kept for the next frame.
+void gl_cairo_overlay_upload (struct gl_cairo_overlay_t *overlay, struct gui_state_t *gui_st)
+{
+    if (!gui_st->full_damage && gui_st->num_damage_rects == 0) {
+        return;
+    }
+
+    box_t full = {{{0, 0}}, {{overlay->stream.width, overlay->stream.height}}};
+    box_t rects[GUI_MAX_DAMAGE_RECTS];
+    int num_rects = 1;
+    if (gui_st->full_damage) {
+        rects[0] = full;
+    } else {
+        num_rects = gui_st->num_damage_rects;
+        memcpy (rects, gui_st->damage_rects, num_rects*sizeof(box_t));
+    }
+
+    cairo_surface_flush (overlay->surface);
+    if (gl_texture_stream_upload (&overlay->stream, cairo_image_surface_get_data (overlay->surface),
+                                  cairo_image_surface_get_stride (overlay->surface),
+                                  rects, num_rects)) {
+        gui_damage_clear (gui_st);
+    }
+}
+
+// Blends the overlay over the window with the OVER operator.
+void gl_cairo_overlay_draw (struct quad_renderer_t *quad_prog, struct gl_cairo_overlay_t *overlay,
+                            app_graphics_t *graphics)
+{
+    gl_enable (GL_BLEND);
+    gl_blend_func (GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    draw_into_window (graphics);
+    set_texture_clip (quad_prog, overlay->stream.width, overlay->stream.height,
+                      0, overlay->stream.height - graphics->height,
+                      graphics->width, graphics->height);
+    blend_premul_quad (quad_prog, overlay->stream.texture, 0, graphics,
+                       0, 0, graphics->width, graphics->height);
+}
+
 #define OPENGL_UTIL_H
 #endif
@@ -1,31 +1,40 @@
 #version 150 core
 
+// Variants, set by quad_renderer_use().
+#ifndef MULTISAMPLED
+#define MULTISAMPLED 0
+#endif
+#ifndef IGNORE_ALPHA
+#define IGNORE_ALPHA 0
+#endif
+
 in vec2 tex_coord;
 
 out vec4 out_color;
 
+#if MULTISAMPLED
+uniform sampler2DMS tex;
+uniform int num_samples;
+#else
 uniform sampler2D tex;
-uniform sampler2DMS texMS;
-uniform bool ignore_alpha;
-uniform bool multisampled_texture;
+#endif
 
 void main ()
 {
-    vec4 r_texel;
-    if (multisampled_texture) {
-        ivec2 sample_coord = ivec2(textureSize (texMS) * tex_coord);
-        r_texel = vec4 (0,0,0,0);
-        for (int i=0; i<4; i++) {
-            r_texel += texelFetch (texMS, sample_coord, i);
-        }
-        r_texel /= 4;
-    } else {
-        r_texel = texture (tex, tex_coord);
+#if MULTISAMPLED
+    ivec2 sample_coord = ivec2(textureSize (tex) * tex_coord);
+    vec4 r_texel = vec4 (0,0,0,0);
+    for (int i=0; i<num_samples; i++) {
+        r_texel += texelFetch (tex, sample_coord, i);
     }
+    r_texel /= num_samples;
+#else
+    vec4 r_texel = texture (tex, tex_coord);
+#endif
 
-    if (ignore_alpha) {
-        out_color = vec4 (r_texel.r, r_texel.g, r_texel.b, 1);
-    } else {
-        out_color = r_texel;
-    }
+#if IGNORE_ALPHA
+    out_color = vec4 (r_texel.r, r_texel.g, r_texel.b, 1);
+#else
+    out_color = r_texel;
+#endif
 }
@@ -1,7 +1,10 @@
 #version 150 core
+#extension GL_ARB_explicit_attrib_location : require
 
-in vec2 position;
-in vec2 tex_coord_in;
+// NOTE: Locations are explicit so all variants of the quad renderer (and
+// full screen programs) can share a VAO, see quad_renderer_vao().
+layout(location = 0) in vec2 position;
+layout(location = 1) in vec2 tex_coord_in;
 
 out vec2 tex_coord;
 
@@ -0,0 +1,199 @@
+#version 150 core
+
+// Draws a css_box_t the same way css_box_draw() does with cairo. Everything is
+// computed analytically from the box description: rounded boxes are signed
+// distance fields and blurred shadows use the closed form integral of a
+// gaussian over a box (with an erf approximation).
+//
+// Output is premultiplied alpha, to be blended with the OVER operator.
+
+flat in int box_idx;
+in vec2 frag_pos;
+
+out vec4 out_color;
+
+uniform samplerBuffer box_data;
+
+#define BOX_STRIDE 26
+#define BOX_RECT 0
+#define BOX_PARAMS 2
+#define BOX_COUNTS 3
+#define BOX_BACKGROUND 4
+#define BOX_BORDER_COLOR 5
+#define BOX_GRADIENT_STOPS 6
+#define BOX_OUTSET_SHADOWS 10
+#define BOX_INSET_SHADOWS 18
+
+vec4 fetch (int i)
+{
+    return texelFetch (box_data, box_idx*BOX_STRIDE + i);
+}
+
+// Signed distance to a rounded box, rect is (x, y, width, height).
+float rounded_box_sdf (vec2 p, vec4 rect, float radius)
+{
+    vec2 half_size = rect.zw/2;
+    radius = min (radius, min (half_size.x, half_size.y));
+    vec2 q = abs (p - (rect.xy + half_size)) - half_size + radius;
+    return length (max (q, 0)) + min (max (q.x, q.y), 0) - radius;
+}
+
+float coverage (float sdf)
+{
+    return clamp (0.5 - sdf, 0, 1);
+}
+
+vec4 erf (vec4 x)
+{
+    vec4 s = sign (x), a = abs (x);
+    x = 1 + (0.278393 + (0.230389 + 0.078108*(a*a))*a)*a;
+    x *= x;
+    return s - s/(x*x);
+}
+
+vec2 erf (vec2 x)
+{
+    vec2 s = sign (x), a = abs (x);
+    x = 1 + (0.278393 + (0.230389 + 0.078108*(a*a))*a)*a;
+    x *= x;
+    return s - s/(x*x);
+}
+
+float gaussian (float x, float sigma)
+{
+    const float pi = 3.141592653589793;
+    return exp (-(x*x)/(2*sigma*sigma))/(sqrt (2*pi)*sigma);
+}
+
+// Integral along x of the gaussian blurred rounded box, for a fixed y.
+float rounded_box_shadow_x (float x, float y, float sigma, float radius, vec2 half_size)
+{
+    float delta = min (half_size.y - radius - abs (y), 0);
+    float curved = half_size.x - radius + sqrt (max (0, radius*radius - delta*delta));
+    vec2 integral = 0.5 + 0.5*erf ((x + vec2 (-curved, curved))*(sqrt (0.5)/sigma));
+    return integral.y - integral.x;
+}
+
+// Coverage of a rounded box convolved with a gaussian. For square corners the
+// result is exact, otherwise the integral along y is approximated with a few
+// samples.
+float blurred_box_coverage (vec2 p, vec4 rect, float radius, float sigma)
+{
+    vec2 lower = rect.xy;
+    vec2 upper = rect.xy + rect.zw;
+
+    if (radius <= 0) {
+        vec4 query = vec4 (p - lower, p - upper);
+        vec4 integral = 0.5 + 0.5*erf (query*(sqrt (0.5)/sigma));
+        return (integral.z - integral.x)*(integral.w - integral.y);
+    }
+
+    vec2 half_size = rect.zw/2;
+    radius = min (radius, min (half_size.x, half_size.y));
+    p -= lower + half_size;
+
+    float low = p.y - half_size.y;
+    float high = p.y + half_size.y;
+    float start = clamp (-3*sigma, low, high);
+    float end = clamp (3*sigma, low, high);
+    float step = (end - start)/4;
+    float y = start + step/2;
+    float value = 0;
+    for (int i=0; i<4; i++) {
+        value += rounded_box_shadow_x (p.x, p.y - y, sigma, radius, half_size)*gaussian (y, sigma)*step;
+        y += step;
+    }
+    return value;
+}
+
+float shadow_coverage (vec2 p, vec4 rect, float radius, float blur)
+{
+    if (blur <= 0) {
+        return coverage (rounded_box_sdf (p, rect, radius));
+    } else {
+        // NOTE: Like css_gaussian_blur() we use the CSS definition where the
+        // blur radius is twice the standard deviation.
+        return blurred_box_coverage (p, rect, radius, blur/2);
+    }
+}
+
+vec4 premul (vec4 c)
+{
+    return vec4 (c.rgb*c.a, c.a);
+}
+
+vec4 over (vec4 src, vec4 dst)
+{
+    return src + dst*(1 - src.a);
+}
+
+void main ()
+{
+    vec2 p = frag_pos;
+    vec4 rect = fetch (BOX_RECT);
+    vec4 params = fetch (BOX_PARAMS);
+    vec4 counts = fetch (BOX_COUNTS);
+    float radius = params.x;
+    float border_width = params.y;
+    int num_stops = int (params.z);
+    int num_outset = int (counts.x);
+    int num_inset = int (counts.y);
+
+    vec4 padding_rect = vec4 (rect.xy + border_width, rect.zw - 2*border_width);
+    float padding_radius = max (radius - border_width, 0);
+
+    float border_cov = coverage (rounded_box_sdf (p, rect, radius));
+    float padding_cov = coverage (rounded_box_sdf (p, padding_rect, padding_radius));
+
+    vec4 color = vec4 (0);
+
+    // Outset shadows are composited together and masked out of the border box.
+    vec4 shadows = vec4 (0);
+    for (int i=0; i<num_outset; i++) {
+        vec4 shadow = fetch (BOX_OUTSET_SHADOWS + 2*i);
+        vec4 shadow_color = fetch (BOX_OUTSET_SHADOWS + 2*i + 1);
+        float spread = shadow.w;
+        vec4 shadow_rect = vec4 (rect.xy + shadow.xy - spread, max (rect.zw + 2*spread, 0));
+        float cov = shadow_coverage (p, shadow_rect, max (radius + spread, 0), shadow.z);
+        shadows = over (premul (shadow_color)*cov, shadows);
+    }
+    color = over (shadows*(1 - border_cov), color);
+
+    color = over (premul (fetch (BOX_BACKGROUND))*border_cov, color);
+
+    if (border_width > 0) {
+        float ring_cov = max (border_cov - padding_cov, 0);
+        color = over (premul (fetch (BOX_BORDER_COLOR))*ring_cov, color);
+    }
+
+    // NOTE: css_box_draw() clips the gradient and inset shadows to the
+    // padding box as a rectangle, not a rounded one.
+    vec2 clip_d = abs (p - (padding_rect.xy + padding_rect.zw/2)) - padding_rect.zw/2;
+    float clip_cov = coverage (max (clip_d.x, clip_d.y));
+
+    if (num_stops > 0) {
+        float t = clamp ((p.y - padding_rect.y)/padding_rect.w, 0, 1);
+        vec4 gradient = fetch (BOX_GRADIENT_STOPS);
+        if (num_stops > 1) {
+            float pos = t*(num_stops - 1);
+            int stop = min (int (pos), num_stops - 2);
+            gradient = mix (premul (fetch (BOX_GRADIENT_STOPS + stop)),
+                            premul (fetch (BOX_GRADIENT_STOPS + stop + 1)),
+                            pos - stop);
+        } else {
+            gradient = premul (gradient);
+        }
+        color = over (gradient*clip_cov, color);
+    }
+
+    for (int i=0; i<num_inset; i++) {
+        vec4 shadow = fetch (BOX_INSET_SHADOWS + 2*i);
+        vec4 shadow_color = fetch (BOX_INSET_SHADOWS + 2*i + 1);
+        float spread = shadow.w;
+        vec4 hole_rect = vec4 (padding_rect.xy + shadow.xy + spread, max (padding_rect.zw - 2*spread, 0));
+        float hole_cov = shadow_coverage (p, hole_rect, max (padding_radius - spread, 0), shadow.z);
+        color = over (premul (shadow_color)*(1 - hole_cov)*padding_cov*clip_cov, color);
+    }
+
+    out_color = color;
+}
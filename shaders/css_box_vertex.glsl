@@ -0,0 +1,27 @@
+#version 150 core
+
+// Vertices come from quad_renderer_t, we only use the texture coordinates as
+// the corner of the quad. Per box data is read from box_data, see gl_gui.h for
+// the layout.
+
+in vec2 position;
+in vec2 tex_coord_in;
+
+flat out int box_idx;
+out vec2 frag_pos; // In window pixels, origin at the top left.
+
+uniform samplerBuffer box_data;
+uniform vec2 window_size;
+
+#define BOX_STRIDE 26
+#define BOX_EXTENTS 1
+
+void main ()
+{
+    box_idx = gl_InstanceID;
+    vec4 extents = texelFetch (box_data, gl_InstanceID*BOX_STRIDE + BOX_EXTENTS);
+    frag_pos = extents.xy + vec2 (tex_coord_in.x, 1 - tex_coord_in.y)*extents.zw;
+
+    vec2 ndc = 2*frag_pos/window_size - 1;
+    gl_Position = vec4 (ndc.x, -ndc.y, 0, 1);
+}
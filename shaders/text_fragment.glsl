@@ -0,0 +1,21 @@
+#version 150 core
+
+// Glyph coverage comes from the red channel of the glyph atlas. Output is
+// premultiplied alpha, to be blended with the OVER operator.
+
+in vec2 uv;
+flat in vec4 color;
+flat in int solid;
+
+out vec4 out_color;
+
+uniform sampler2D atlas;
+
+void main ()
+{
+    float coverage = 1;
+    if (solid == 0) {
+        coverage = texture (atlas, uv).r;
+    }
+    out_color = vec4 (color.rgb*color.a, color.a)*coverage;
+}
@@ -0,0 +1,38 @@
+#version 150 core
+
+// Each instance is a glyph (or a solid rectangle) of gl_text_renderer_t. Per
+// instance data is read from instance_data, see gl_gui.h for the layout.
+
+in vec2 position;
+in vec2 tex_coord_in;
+
+out vec2 uv;
+flat out vec4 color;
+flat out int solid;
+
+uniform samplerBuffer instance_data;
+uniform vec2 window_size;
+
+#define INSTANCE_STRIDE 3
+#define INSTANCE_RECT 0
+#define INSTANCE_UV_RECT 1
+#define INSTANCE_COLOR 2
+
+void main ()
+{
+    int base = gl_InstanceID*INSTANCE_STRIDE;
+    vec4 rect = texelFetch (instance_data, base + INSTANCE_RECT);
+    vec4 uv_rect = texelFetch (instance_data, base + INSTANCE_UV_RECT);
+    color = texelFetch (instance_data, base + INSTANCE_COLOR);
+
+    // NOTE: Rectangles with an empty uv rectangle are solid fills, like the
+    // background of selected text.
+    solid = uv_rect.z == 0 ? 1 : 0;
+
+    vec2 corner = vec2 (tex_coord_in.x, 1 - tex_coord_in.y);
+    uv = uv_rect.xy + corner*uv_rect.zw;
+
+    vec2 pos = rect.xy + corner*rect.zw;
+    vec2 ndc = 2*pos/window_size - 1;
+    gl_Position = vec4 (ndc.x, -ndc.y, 0, 1);
+}
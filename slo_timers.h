@@ -87,5 +87,66 @@ struct timespec wall_ticks_end;
     wall_ticks_start = wall_ticks_end;\
     }
 
+// Phase profiler
+// Records how long each phase of a sequence took (wall clock) so they can be
+// printed together at the end, instead of interleaving prints with the code
+// being measured.
+// Usage:
+//   struct phase_profile_t prof;
+//   phase_profile_begin (&prof);
+//   <some code to measure>
+//   phase_profile_mark (&prof, "Name of phase 1");
+//   <some code to measure>
+//   phase_profile_mark (&prof, "Name of phase 2");
+//   phase_profile_print (&prof, "Title");
+
+#define PHASE_PROFILE_MAX_PHASES 32
+struct phase_profile_t {
+    struct timespec start;
+    struct timespec last;
+    int num_phases;
+    const char *names[PHASE_PROFILE_MAX_PHASES];
+    float start_ms[PHASE_PROFILE_MAX_PHASES]; // relative to _start_
+    float length_ms[PHASE_PROFILE_MAX_PHASES];
+};
+
+void phase_profile_begin (struct phase_profile_t *prof)
+{
+    prof->num_phases = 0;
+    clock_gettime (CLOCK_MONOTONIC, &prof->start);
+    prof->last = prof->start;
+}
+
+void phase_profile_mark (struct phase_profile_t *prof, const char *name)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    if (prof->num_phases < PHASE_PROFILE_MAX_PHASES) {
+        prof->names[prof->num_phases] = name;
+        prof->start_ms[prof->num_phases] = time_elapsed_in_ms (&prof->start, &prof->last);
+        prof->length_ms[prof->num_phases] = time_elapsed_in_ms (&prof->last, &now);
+        prof->num_phases++;
+    }
+    prof->last = now;
+}
+
+float phase_profile_total_ms (struct phase_profile_t *prof)
+{
+    return time_elapsed_in_ms (&prof->start, &prof->last);
+}
+
+// NOTE: _offset_ms_ is added to the start time of each phase, it's useful when
+// printing profiles that started at different times (other threads).
+void phase_profile_print_offset (struct phase_profile_t *prof, const char *title, float offset_ms)
+{
+    printf ("%s (%.3f ms)\n", title, phase_profile_total_ms (prof));
+    int i;
+    for (i=0; i<prof->num_phases; i++) {
+        printf ("  [%9.3f ms +%9.3f ms] %s\n",
+                prof->start_ms[i] + offset_ms, prof->length_ms[i], prof->names[i]);
+    }
+}
+#define phase_profile_print(prof,title) phase_profile_print_offset(prof,title,0)
+
 #define SLO_TIMERS_H
 #endif
@@ -16,11 +16,26 @@
 #include <GL/gl.h>
 #include <GL/glext.h>
 #include <cairo/cairo-xlib.h>
+// Build with `pkg-config --cflags --libs pangocairo`
+#include <pango/pangocairo.h>
 
 #include <inttypes.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
+#ifdef CAIRO_SHM_BACKEND
+// Link with -lxcb-shm
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <xcb/shm.h>
+#endif
 //#define NDEBUG
 #include <assert.h>
 #include <errno.h>
@@ -34,8 +49,10 @@
 
 // NOTE: This is a unity build
 #include "opengl_util.h"
+#include "gl_gui.h"
 #include "app_api.h"
 #include "depth_peeling/depth_peeling.c"
+#include "gui_demo/gui_demo.c"
 
 
 struct x_state {
@@ -51,21 +68,92 @@ struct x_state {
 
     xcb_gcontext_t gc;
 
-    xcb_timestamp_t last_timestamp; // Last server time received in an event.
     xcb_sync_counter_t counters[2];
     xcb_sync_int64_t counter_val;
+    bool sync_request_pending;
     mem_pool_temp_marker_t transient_pool_flush;
     mem_pool_t transient_pool;
-
-    xcb_timestamp_t clipboard_ownership_timestamp;
-    bool have_clipboard_ownership;
 };
 
 struct x_state global_x11_state;
 
-xcb_atom_t get_x11_atom (xcb_connection_t *c, const char *value)
+// Bidirectional atom <-> name cache. Atom names never change during the
+// lifetime of the server so once we know one we don't need to ask again. This
+// avoids round trips every time we want to print an atom or intern one we
+// already know.
+//
+// NOTE: Lookups are linear, we expect just a few dozen atoms in here. The
+// cache is used from both the event and render threads, _lock_ protects it.
+#define X11_ATOM_CACHE_SIZE 256
+struct x11_atom_cache_t {
+    volatile int lock;
+    mem_pool_t pool;
+    int num_atoms;
+    xcb_atom_t atoms[X11_ATOM_CACHE_SIZE];
+    char *names[X11_ATOM_CACHE_SIZE];
+};
+
+struct x11_atom_cache_t x11_atom_cache;
+
+void x11_atom_cache_add (xcb_atom_t atom, const char *name, size_t len)
+{
+    if (atom == XCB_ATOM_NONE) {
+        return;
+    }
+
+    start_mutex (&x11_atom_cache.lock);
+    if (x11_atom_cache.num_atoms == X11_ATOM_CACHE_SIZE) {
+        end_mutex (&x11_atom_cache.lock);
+        return;
+    }
+
+    char *name_cpy = (char*)mem_pool_push_size (&x11_atom_cache.pool, len+1);
+    memcpy (name_cpy, name, len);
+    name_cpy[len] = '\0';
+
+    x11_atom_cache.atoms[x11_atom_cache.num_atoms] = atom;
+    x11_atom_cache.names[x11_atom_cache.num_atoms] = name_cpy;
+    x11_atom_cache.num_atoms++;
+    end_mutex (&x11_atom_cache.lock);
+}
+
+char* x11_atom_cache_lookup_name (xcb_atom_t atom)
+{
+    char *res = NULL;
+    start_mutex (&x11_atom_cache.lock);
+    int i;
+    for (i=0; i<x11_atom_cache.num_atoms; i++) {
+        if (x11_atom_cache.atoms[i] == atom) {
+            res = x11_atom_cache.names[i];
+            break;
+        }
+    }
+    end_mutex (&x11_atom_cache.lock);
+    return res;
+}
+
+xcb_atom_t x11_atom_cache_lookup_atom (const char *name)
 {
     xcb_atom_t res = XCB_ATOM_NONE;
+    start_mutex (&x11_atom_cache.lock);
+    int i;
+    for (i=0; i<x11_atom_cache.num_atoms; i++) {
+        if (strcmp (x11_atom_cache.names[i], name) == 0) {
+            res = x11_atom_cache.atoms[i];
+            break;
+        }
+    }
+    end_mutex (&x11_atom_cache.lock);
+    return res;
+}
+
+xcb_atom_t get_x11_atom (xcb_connection_t *c, const char *value)
+{
+    xcb_atom_t res = x11_atom_cache_lookup_atom (value);
+    if (res != XCB_ATOM_NONE) {
+        return res;
+    }
+
     xcb_generic_error_t *err = NULL;
     xcb_intern_atom_cookie_t ck = xcb_intern_atom (c, 0, strlen(value), value);
     xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply (c, ck, &err);
@@ -76,6 +164,8 @@ xcb_atom_t get_x11_atom (xcb_connection_t *c, const char *value)
     }
     res = reply->atom;
     free(reply);
+
+    x11_atom_cache_add (res, value, strlen(value));
     return res;
 }
 
@@ -103,6 +193,7 @@ enum cached_atom_names_t {
     LOC_ATOM_TEXT_MIME,
     LOC_ATOM_TEXT_MIME_CHARSET,
     LOC_ATOM_ATOM_PAIR,
+    LOC_ATOM_INCR,
 
     NUM_ATOMS_CACHE
 };
@@ -114,37 +205,43 @@ struct atom_enum_name_t {
     const char *name;
 };
 
-void init_x11_atoms (struct x_state *x_st)
-{
-    struct atom_enum_name_t atom_arr[] = {
-        {LOC_ATOM_WM_DELETE_WINDOW, "WM_DELETE_WINDOW"},
-        {LOC_ATOM__NET_WM_SYNC_REQUEST, "_NET_WM_SYNC_REQUEST"},
-        {LOC_ATOM__NET_WM_SYNC__REQUEST_COUNTER, "_NET_WM_SYNC__REQUEST_COUNTER"},
-        {LOC_ATOM__NET_WM_SYNC, "_NET_WM_SYNC"},
-        {LOC_ATOM__NET_WM_FRAME_DRAWN, "_NET_WM_FRAME_DRAWN"},
-        {LOC_ATOM__NET_WM_FRAME_TIMINGS, "_NET_WM_FRAME_TIMINGS"},
-        {LOC_ATOM_WM_PROTOCOLS, "WM_PROTOCOLS"},
-        {LOC_ATOM_CLIPBOARD, "CLIPBOARD"},
-        {LOC_ATOM__CLIPBOARD_CONTENT, "_CLIPBOARD_CONTENT"},
-        {LOC_ATOM_TARGETS, "TARGETS"},
-        {LOC_ATOM_TIMESTAMP, "TIMESTAMP"},
-        {LOC_ATOM_MULTIPLE, "MULTIPLE"},
-        {LOC_ATOM_UTF8_STRING, "UTF8_STRING"},
-        {LOC_ATOM_TEXT, "TEXT"},
-        {LOC_ATOM_TEXT_MIME, "text/plain"},
-        {LOC_ATOM_TEXT_MIME_CHARSET, "text/plain;charset=utf-8"},
-        {LOC_ATOM_ATOM_PAIR, "ATOM_PAIR"}
-    };
-
-    xcb_intern_atom_cookie_t cookies[ARRAY_SIZE(atom_arr)];
+struct atom_enum_name_t cached_atom_names[] = {
+    {LOC_ATOM_WM_DELETE_WINDOW, "WM_DELETE_WINDOW"},
+    {LOC_ATOM__NET_WM_SYNC_REQUEST, "_NET_WM_SYNC_REQUEST"},
+    {LOC_ATOM__NET_WM_SYNC__REQUEST_COUNTER, "_NET_WM_SYNC__REQUEST_COUNTER"},
+    {LOC_ATOM__NET_WM_SYNC, "_NET_WM_SYNC"},
+    {LOC_ATOM__NET_WM_FRAME_DRAWN, "_NET_WM_FRAME_DRAWN"},
+    {LOC_ATOM__NET_WM_FRAME_TIMINGS, "_NET_WM_FRAME_TIMINGS"},
+    {LOC_ATOM_WM_PROTOCOLS, "WM_PROTOCOLS"},
+    {LOC_ATOM_CLIPBOARD, "CLIPBOARD"},
+    {LOC_ATOM__CLIPBOARD_CONTENT, "_CLIPBOARD_CONTENT"},
+    {LOC_ATOM_TARGETS, "TARGETS"},
+    {LOC_ATOM_TIMESTAMP, "TIMESTAMP"},
+    {LOC_ATOM_MULTIPLE, "MULTIPLE"},
+    {LOC_ATOM_UTF8_STRING, "UTF8_STRING"},
+    {LOC_ATOM_TEXT, "TEXT"},
+    {LOC_ATOM_TEXT_MIME, "text/plain"},
+    {LOC_ATOM_TEXT_MIME_CHARSET, "text/plain;charset=utf-8"},
+    {LOC_ATOM_ATOM_PAIR, "ATOM_PAIR"},
+    {LOC_ATOM_INCR, "INCR"}
+};
 
+// Interning atoms is split in two so that other startup work can be done while
+// we wait for the server. x11_request_atoms() sends all intern requests without
+// waiting, x11_collect_atoms() then gets all replies in a single round trip.
+void x11_request_atoms (struct x_state *x_st, xcb_intern_atom_cookie_t *cookies)
+{
     uint32_t i;
-    for (i=0; i<ARRAY_SIZE(atom_arr); i++) {
-        const char *name = atom_arr[i].name;
+    for (i=0; i<ARRAY_SIZE(cached_atom_names); i++) {
+        const char *name = cached_atom_names[i].name;
         cookies[i] = xcb_intern_atom (x_st->xcb_c, 0, strlen(name), name);
     }
+}
 
-    for (i=0; i<ARRAY_SIZE(atom_arr); i++) {
+void x11_collect_atoms (struct x_state *x_st, xcb_intern_atom_cookie_t *cookies)
+{
+    uint32_t i;
+    for (i=0; i<ARRAY_SIZE(cached_atom_names); i++) {
         xcb_generic_error_t *err = NULL;
         xcb_intern_atom_reply_t *reply = xcb_intern_atom_reply (x_st->xcb_c, cookies[i], &err);
         if (err != NULL) {
@@ -152,31 +249,52 @@ void init_x11_atoms (struct x_state *x_st)
             free (err);
             continue;
         }
-        xcb_atoms_cache[atom_arr[i].id] = reply->atom;
+        xcb_atoms_cache[cached_atom_names[i].id] = reply->atom;
+        x11_atom_cache_add (reply->atom, cached_atom_names[i].name,
+                            strlen (cached_atom_names[i].name));
         free (reply);
     }
 }
 
+void init_x11_atoms (struct x_state *x_st)
+{
+    xcb_intern_atom_cookie_t cookies[ARRAY_SIZE(cached_atom_names)];
+    x11_request_atoms (x_st, cookies);
+    x11_collect_atoms (x_st, cookies);
+}
+
 char* get_x11_atom_name (xcb_connection_t *c, xcb_atom_t atom, mem_pool_t *pool)
 {
     if (atom == XCB_ATOM_NONE) {
         return NULL;
     }
 
+    char *res;
+    char *cached_name = x11_atom_cache_lookup_name (atom);
+    if (cached_name != NULL) {
+        size_t len = strlen (cached_name);
+        res = (char*)mem_pool_push_size (pool, len+1);
+        memcpy (res, cached_name, len+1);
+        return res;
+    }
+
     xcb_get_atom_name_cookie_t ck = xcb_get_atom_name (c, atom);
     xcb_generic_error_t *err = NULL;
     xcb_get_atom_name_reply_t *reply = xcb_get_atom_name_reply (c, ck, &err);
     if (err != NULL) {
         printf ("Error while requesting atom's name.\n");
         free (err);
+        return NULL;
     }
 
     char *name = xcb_get_atom_name_name (reply);
     size_t len = xcb_get_atom_name_name_length (reply);
+    x11_atom_cache_add (atom, name, len);
 
-    char *res = (char*)mem_pool_push_size (pool, len+1);
+    res = (char*)mem_pool_push_size (pool, len+1);
     memcpy (res, name, len);
     res[len] = '\0';
+    free (reply);
 
     return res;
 }
@@ -196,20 +314,53 @@ void get_x11_property_part (xcb_connection_t *c, xcb_drawable_t window,
     }
 }
 
+// Size in 32 bit words of the first request made when reading a property. It
+// grows to fit the largest property read so far (up to a limit), so that most
+// reads finish in a single round trip.
+#define X11_PROPERTY_REQUEST_MAX_WORDS 65536
+uint32_t x11_property_request_words = 256;
+
+// Reads the full value of _property_. If it didn't fit in the first request
+// a second one is done for the rest, in that case *reply_2 is not NULL.
+// Returns false if the property could not be read.
+bool get_x11_property_replies (xcb_connection_t *c, xcb_drawable_t window,
+                               xcb_atom_t property,
+                               xcb_get_property_reply_t **reply_1,
+                               xcb_get_property_reply_t **reply_2)
+{
+    uint32_t first_request_size = x11_property_request_words;
+    *reply_2 = NULL;
+    get_x11_property_part (c, window, property, 0, first_request_size, reply_1);
+    if (*reply_1 == NULL) {
+        return false;
+    }
+
+    if ((*reply_1)->bytes_after != 0) {
+        uint32_t words_after = I_CEIL_DIVIDE((*reply_1)->bytes_after,4);
+        get_x11_property_part (c, window, property, first_request_size,
+                               words_after, reply_2);
+        x11_property_request_words =
+            MIN (first_request_size + words_after, X11_PROPERTY_REQUEST_MAX_WORDS);
+    }
+    return true;
+}
+
 char* get_x11_text_property (xcb_connection_t *c, mem_pool_t *pool,
                              xcb_drawable_t window, xcb_atom_t property,
                              size_t *len)
 {
+    if (len != NULL) {
+        *len = 0;
+    }
 
-    xcb_get_property_reply_t *reply_1, *reply_2 = NULL;
-    uint32_t first_request_size = 10;
-    get_x11_property_part (c, window, property, 0, first_request_size, &reply_1);
-
-    uint32_t len_1, len_total;
-    len_1 = len_total = xcb_get_property_value_length (reply_1);
+    xcb_get_property_reply_t *reply_1, *reply_2;
+    if (!get_x11_property_replies (c, window, property, &reply_1, &reply_2)) {
+        return NULL;
+    }
 
     if (reply_1->type == XCB_ATOM_NONE) {
-        *len = 0;
+        free (reply_1);
+        free (reply_2);
         return NULL;
     }
 
@@ -220,19 +371,21 @@ char* get_x11_text_property (xcb_connection_t *c, mem_pool_t *pool,
         mem_pool_t temp_pool = {0};
         printf ("Invalid text property (%s)\n", get_x11_atom_name (c, reply_1->type, &temp_pool));
         mem_pool_destroy (&temp_pool);
+        free (reply_1);
+        free (reply_2);
         return NULL;
     }
 
-    if (reply_1->bytes_after != 0) {
-        get_x11_property_part (c, window, property, first_request_size,
-                               I_CEIL_DIVIDE(reply_1->bytes_after,4), &reply_2);
+    uint32_t len_1, len_total;
+    len_1 = len_total = xcb_get_property_value_length (reply_1);
+    if (reply_2 != NULL) {
         len_total += xcb_get_property_value_length (reply_2);
     }
 
     char *res = (char*)pom_push_size (pool, len_total+1);
 
     memcpy (res, xcb_get_property_value (reply_1), len_1);
-    if (reply_1->bytes_after != 0) {
+    if (reply_2 != NULL) {
         memcpy ((char*)res+len_1, xcb_get_property_value (reply_2), len_total-len_1);
         free (reply_2);
     }
@@ -249,14 +402,15 @@ char* get_x11_text_property (xcb_connection_t *c, mem_pool_t *pool,
 void* get_x11_property (xcb_connection_t *c, mem_pool_t *pool, xcb_drawable_t window,
                         xcb_atom_t property, size_t *len, xcb_atom_t *type)
 {
+    xcb_get_property_reply_t *reply_1, *reply_2;
+    if (!get_x11_property_replies (c, window, property, &reply_1, &reply_2)) {
+        *len = 0;
+        *type = XCB_ATOM_NONE;
+        return NULL;
+    }
 
-    xcb_get_property_reply_t *reply_1, *reply_2 = NULL;
-    uint32_t first_request_size = 10;
-    get_x11_property_part (c, window, property, 0, first_request_size, &reply_1);
     uint32_t len_1 = *len = xcb_get_property_value_length (reply_1);
-    if (reply_1->bytes_after != 0) {
-        get_x11_property_part (c, window, property, first_request_size,
-                               I_CEIL_DIVIDE(reply_1->bytes_after,4), &reply_2);
+    if (reply_2 != NULL) {
         *len += xcb_get_property_value_length (reply_2);
     }
 
@@ -264,7 +418,7 @@ void* get_x11_property (xcb_connection_t *c, mem_pool_t *pool, xcb_drawable_t wi
     *type = reply_1->type;
 
     memcpy (res, xcb_get_property_value (reply_1), len_1);
-    if (reply_1->bytes_after != 0) {
+    if (reply_2 != NULL) {
         memcpy ((char*)res+len_1, xcb_get_property_value (reply_2), *len-len_1);
         free (reply_2);
     }
@@ -570,28 +724,34 @@ void x11_setup_icccm_and_ewmh_protocols (struct x_state *x_st)
                          false);
 }
 
-void blocking_xcb_sync_set_counter (xcb_connection_t *c, xcb_sync_counter_t counter, xcb_sync_int64_t *val)
+// NOTE: Counter updates happen at least twice every frame, so we don't wait
+// for the server to check them. Errors, if any, arrive asynchronously through
+// the event queue like those of any other unchecked request.
+void x11_sync_set_counter (xcb_connection_t *c, xcb_sync_counter_t counter, xcb_sync_int64_t *val)
 {
-    xcb_void_cookie_t ck = xcb_sync_set_counter_checked (c, counter, *val);
-    xcb_generic_error_t *error;
-    if ((error = xcb_request_check(c, ck))) {
-        printf("Error setting counter %d\n", error->error_code);
-        free(error);
-    }
+    xcb_sync_set_counter (c, counter, *val);
 }
 
 void x11_notify_start_of_frame (struct x_state *x_st)
 {
     increment_sync_counter (&x_st->counter_val);
     assert (x_st->counter_val.lo % 2 == 1);
-    blocking_xcb_sync_set_counter (x_st->xcb_c, x_st->counters[1], &x_st->counter_val);
+    x11_sync_set_counter (x_st->xcb_c, x_st->counters[1], &x_st->counter_val);
 }
 
 void x11_notify_end_of_frame (struct x_state *x_st)
 {
     increment_sync_counter (&x_st->counter_val);
     assert (x_st->counter_val.lo % 2 == 0);
-    blocking_xcb_sync_set_counter (x_st->xcb_c, x_st->counters[1], &x_st->counter_val);
+    x11_sync_set_counter (x_st->xcb_c, x_st->counters[1], &x_st->counter_val);
+
+    // If the WM asked for this frame with _NET_WM_SYNC_REQUEST it is waiting
+    // for the counter to change, send it right away instead of waiting for
+    // the flush at the end of the frame.
+    if (x_st->sync_request_pending) {
+        xcb_flush (x_st->xcb_c);
+        x_st->sync_request_pending = false;
+    }
 }
 
 void x11_print_window_name (struct x_state *x_st, xcb_drawable_t window)
@@ -613,6 +773,1155 @@ void x11_send_event (xcb_connection_t *c, xcb_drawable_t window, void *event)
     }
 }
 
+// Arms timer_fd to expire after _ms_ milliseconds, a value <= 0 disarms it.
+void x11_set_wakeup_timer (int timer_fd, float ms)
+{
+    if (timer_fd == -1) {
+        return;
+    }
+
+    struct itimerspec timer_spec = {0};
+    if (ms > 0) {
+        timer_spec.it_value.tv_sec = (time_t)(ms/1000);
+        timer_spec.it_value.tv_nsec = (long)((ms - timer_spec.it_value.tv_sec*1000)*1000000);
+    }
+    timerfd_settime (timer_fd, 0, &timer_spec, NULL);
+}
+
+// Window state tracked by the event thread and read by the render thread
+// through a triple buffer, so the render thread always sees the latest state
+// without waiting. One shot notifications are counters, the render thread
+// reacts when they differ from the last value it saw.
+struct x11_window_state_t {
+    uint16_t width;
+    uint16_t height;
+
+    xcb_timestamp_t last_timestamp; // Last server time received in an event.
+
+    // Result of the last x11_clipboard_copy(), false again once another
+    // client takes the clipboard.
+    bool have_clipboard_ownership;
+
+    uint32_t expose_serial;
+
+    uint32_t sync_request_serial;
+    xcb_sync_int64_t sync_counter_val;
+
+    bool close_requested;
+};
+
+// Clipboard transfers following ICCCM. Everything here runs in the event
+// thread except for x11_clipboard_copy() and x11_clipboard_paste() which are
+// called by the render thread when the application requests it. Neither of
+// them waits for the server, ownership of the selection is taken by the event
+// thread.
+//
+// Data larger than X11_CLIPBOARD_CHUNK_SIZE is transferred with the INCR
+// protocol, one chunk per PropertyNotify, so a multi megabyte selection never
+// needs a single huge request and is streamed while the render thread keeps
+// drawing frames.
+#define X11_CLIPBOARD_CHUNK_SIZE (256*1024)
+#define X11_CLIPBOARD_MAX_TRANSFERS 8
+
+// Copy of the data we offer. The application's buffer is only valid until its
+// next copy, but INCR transfers can outlive it, each one holds a reference.
+// Only the event thread changes _refs_.
+//
+// NOTE: Offers are not served zero-copy from the application's memory. That
+// would need the application to pin the buffer until every transfer
+// referencing it finished, which it can't know about. This costs one memcpy
+// per copy, not one per transfer.
+struct x11_clipboard_offer_t {
+    int refs;
+    size_t len;
+    char *data;
+};
+
+// An outgoing INCR transfer to some requestor.
+struct x11_incr_transfer_t {
+    xcb_window_t requestor;
+    xcb_atom_t property;
+    xcb_atom_t type;
+    struct x11_clipboard_offer_t *offer;
+    size_t offset;
+};
+
+struct x11_clipboard_t {
+    // Offer of the last x11_clipboard_copy() not yet taken by the event
+    // thread, protected by _lock_.
+    volatile int lock;
+    struct x11_clipboard_offer_t *pending_offer;
+
+    // Offer served to requestors, NULL if we don't own CLIPBOARD.
+    struct x11_clipboard_offer_t *offer;
+    xcb_timestamp_t ownership_timestamp;
+
+    struct x11_incr_transfer_t transfers[X11_CLIPBOARD_MAX_TRANSFERS];
+    int num_transfers;
+
+    // Incoming data of a paste in progress.
+    bool receiving;
+    bool receiving_incr;
+    cont_buff_t received;
+};
+
+struct x11_clipboard_t x11_clipboard;
+
+void x11_clipboard_offer_release (struct x11_clipboard_offer_t *offer)
+{
+    if (offer != NULL && --offer->refs == 0) {
+        free (offer);
+    }
+}
+
+// Called from the render thread. _str_ is copied, the event thread takes
+// ownership of CLIPBOARD for it when it gets our ClientMessage, see
+// x11_clipboard_take_ownership().
+void x11_clipboard_copy (struct x_state *x_st, char *str, size_t len)
+{
+    struct x11_clipboard_offer_t *offer = malloc (sizeof(struct x11_clipboard_offer_t) + len);
+    if (offer == NULL) {
+        printf ("Could not allocate clipboard offer.\n");
+        return;
+    }
+    offer->refs = 1;
+    offer->len = len;
+    offer->data = (char*)(offer + 1);
+    memcpy (offer->data, str, len);
+
+    start_mutex (&x11_clipboard.lock);
+    struct x11_clipboard_offer_t *prev = x11_clipboard.pending_offer;
+    x11_clipboard.pending_offer = offer;
+    end_mutex (&x11_clipboard.lock);
+
+    // NOTE: Pending offers are not referenced by any transfer.
+    free (prev);
+
+    xcb_client_message_event_t client_message = {0};
+    client_message.response_type = XCB_CLIENT_MESSAGE;
+    client_message.format = 32;
+    client_message.window = x_st->window;
+    client_message.type = xcb_atoms_cache[LOC_ATOM_CLIPBOARD];
+    xcb_send_event (x_st->xcb_c, 0, x_st->window,
+                    XCB_EVENT_MASK_NO_EVENT, (const char*)&client_message);
+    xcb_flush (x_st->xcb_c);
+}
+
+// Called from the event thread. Takes ownership of CLIPBOARD for the pending
+// offer, the result is published in the window state.
+void x11_clipboard_take_ownership (struct x_state *x_st, struct x11_window_state_t *win_st)
+{
+    start_mutex (&x11_clipboard.lock);
+    struct x11_clipboard_offer_t *offer = x11_clipboard.pending_offer;
+    x11_clipboard.pending_offer = NULL;
+    end_mutex (&x11_clipboard.lock);
+
+    if (offer == NULL) {
+        return;
+    }
+
+    xcb_timestamp_t timestamp = win_st->last_timestamp;
+    xcb_set_selection_owner (x_st->xcb_c, x_st->window,
+                             xcb_atoms_cache[LOC_ATOM_CLIPBOARD], timestamp);
+
+    xcb_get_selection_owner_cookie_t ck =
+        xcb_get_selection_owner (x_st->xcb_c, xcb_atoms_cache[LOC_ATOM_CLIPBOARD]);
+    xcb_get_selection_owner_reply_t *reply = xcb_get_selection_owner_reply (x_st->xcb_c, ck, NULL);
+    if (reply != NULL && reply->owner == x_st->window) {
+        x11_clipboard_offer_release (x11_clipboard.offer);
+        x11_clipboard.offer = offer;
+        x11_clipboard.ownership_timestamp = timestamp;
+        win_st->have_clipboard_ownership = true;
+    } else {
+        printf ("Could not get clipboard ownership.\n");
+        x11_clipboard_offer_release (offer);
+    }
+    free (reply);
+}
+
+// Called from the event thread when another client takes CLIPBOARD.
+void x11_clipboard_lose_ownership (struct x11_window_state_t *win_st)
+{
+    // NOTE: Transfers in progress keep their own reference.
+    x11_clipboard_offer_release (x11_clipboard.offer);
+    x11_clipboard.offer = NULL;
+    win_st->have_clipboard_ownership = false;
+}
+
+// Called once the event thread finished.
+void x11_clipboard_destroy ()
+{
+    int i;
+    for (i=0; i<x11_clipboard.num_transfers; i++) {
+        x11_clipboard_offer_release (x11_clipboard.transfers[i].offer);
+    }
+    x11_clipboard_offer_release (x11_clipboard.offer);
+    free (x11_clipboard.pending_offer);
+    cont_buff_destroy (&x11_clipboard.received);
+    x11_clipboard = (struct x11_clipboard_t){0};
+}
+
+// Called from the render thread. The result arrives as an INPUT_EVENT_PASTE.
+void x11_clipboard_paste (struct x_state *x_st, xcb_timestamp_t timestamp)
+{
+    xcb_convert_selection (x_st->xcb_c, x_st->window,
+                           xcb_atoms_cache[LOC_ATOM_CLIPBOARD],
+                           xcb_atoms_cache[LOC_ATOM_UTF8_STRING],
+                           xcb_atoms_cache[LOC_ATOM__CLIPBOARD_CONTENT],
+                           timestamp);
+    xcb_flush (x_st->xcb_c);
+}
+
+// NOTE: The chunk size can't exceed the maximum request size of the server,
+// the ChangeProperty request header takes 24 bytes.
+size_t x11_clipboard_chunk_size (xcb_connection_t *c)
+{
+    size_t max_request_bytes = (size_t)xcb_get_maximum_request_length (c)*4 - 24;
+    return MIN (X11_CLIPBOARD_CHUNK_SIZE, max_request_bytes);
+}
+
+bool x11_is_text_target (xcb_atom_t target)
+{
+    return target == xcb_atoms_cache[LOC_ATOM_UTF8_STRING] ||
+           target == xcb_atoms_cache[LOC_ATOM_TEXT] ||
+           target == xcb_atoms_cache[LOC_ATOM_TEXT_MIME] ||
+           target == xcb_atoms_cache[LOC_ATOM_TEXT_MIME_CHARSET] ||
+           target == XCB_ATOM_STRING;
+}
+
+void x11_clipboard_handle_selection_request (struct x_state *x_st,
+                                             xcb_selection_request_event_t *request)
+{
+    xcb_connection_t *c = x_st->xcb_c;
+
+    xcb_selection_notify_event_t notify = {0};
+    notify.response_type = XCB_SELECTION_NOTIFY;
+    notify.time = request->time;
+    notify.requestor = request->requestor;
+    notify.selection = request->selection;
+    notify.target = request->target;
+    // NOTE: Obsolete clients send None as property, ICCCM says to use the
+    // target atom in that case.
+    notify.property = request->property != XCB_ATOM_NONE ? request->property : request->target;
+
+    struct x11_clipboard_offer_t *offer = x11_clipboard.offer;
+    if (offer == NULL ||
+        request->selection != xcb_atoms_cache[LOC_ATOM_CLIPBOARD]) {
+        notify.property = XCB_ATOM_NONE;
+
+    } else if (request->target == xcb_atoms_cache[LOC_ATOM_TARGETS]) {
+        xcb_atom_t targets[] = {
+            xcb_atoms_cache[LOC_ATOM_TARGETS],
+            xcb_atoms_cache[LOC_ATOM_TIMESTAMP],
+            xcb_atoms_cache[LOC_ATOM_UTF8_STRING],
+            xcb_atoms_cache[LOC_ATOM_TEXT],
+            xcb_atoms_cache[LOC_ATOM_TEXT_MIME],
+            xcb_atoms_cache[LOC_ATOM_TEXT_MIME_CHARSET],
+            XCB_ATOM_STRING
+        };
+        xcb_change_property (c, XCB_PROP_MODE_REPLACE, request->requestor, notify.property,
+                             XCB_ATOM_ATOM, 32, ARRAY_SIZE(targets), targets);
+
+    } else if (request->target == xcb_atoms_cache[LOC_ATOM_TIMESTAMP]) {
+        xcb_change_property (c, XCB_PROP_MODE_REPLACE, request->requestor, notify.property,
+                             XCB_ATOM_INTEGER, 32, 1, &x11_clipboard.ownership_timestamp);
+
+    } else if (x11_is_text_target (request->target)) {
+        if (offer->len <= x11_clipboard_chunk_size (c)) {
+            xcb_change_property (c, XCB_PROP_MODE_REPLACE, request->requestor, notify.property,
+                                 request->target, 8, offer->len, offer->data);
+
+        } else if (x11_clipboard.num_transfers < X11_CLIPBOARD_MAX_TRANSFERS) {
+            // Start an INCR transfer. We need to know when the requestor
+            // deletes the property to send the next chunk.
+            uint32_t event_mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+            xcb_change_window_attributes (c, request->requestor, XCB_CW_EVENT_MASK, &event_mask);
+
+            uint32_t size_lower_bound = offer->len > UINT32_MAX ? UINT32_MAX : offer->len;
+            xcb_change_property (c, XCB_PROP_MODE_REPLACE, request->requestor, notify.property,
+                                 xcb_atoms_cache[LOC_ATOM_INCR], 32, 1, &size_lower_bound);
+
+            struct x11_incr_transfer_t *transfer = &x11_clipboard.transfers[x11_clipboard.num_transfers++];
+            transfer->requestor = request->requestor;
+            transfer->property = notify.property;
+            transfer->type = request->target;
+            transfer->offer = offer;
+            transfer->offset = 0;
+            offer->refs++;
+
+        } else {
+            printf ("Too many simultaneous clipboard transfers, refusing request.\n");
+            notify.property = XCB_ATOM_NONE;
+        }
+
+    } else {
+        // TODO: Support MULTIPLE.
+        notify.property = XCB_ATOM_NONE;
+    }
+
+    xcb_send_event (c, 0, request->requestor, XCB_EVENT_MASK_NO_EVENT, (const char*)&notify);
+    xcb_flush (c);
+}
+
+// Called when a requestor deletes the property of an INCR transfer, meaning
+// it has read the previous chunk. Returns false if the event is not related to
+// an ongoing transfer.
+bool x11_clipboard_continue_transfer (struct x_state *x_st, xcb_property_notify_event_t *event)
+{
+    if (event->state != XCB_PROPERTY_DELETE) {
+        return false;
+    }
+
+    int i;
+    for (i=0; i<x11_clipboard.num_transfers; i++) {
+        struct x11_incr_transfer_t *transfer = &x11_clipboard.transfers[i];
+        if (transfer->requestor != event->window || transfer->property != event->atom) {
+            continue;
+        }
+
+        // NOTE: A zero length chunk marks the end of the transfer.
+        size_t chunk_len = MIN (transfer->offer->len - transfer->offset,
+                                x11_clipboard_chunk_size (x_st->xcb_c));
+        xcb_change_property (x_st->xcb_c, XCB_PROP_MODE_REPLACE, transfer->requestor,
+                             transfer->property, transfer->type, 8,
+                             chunk_len, transfer->offer->data + transfer->offset);
+        transfer->offset += chunk_len;
+
+        if (chunk_len == 0) {
+            uint32_t event_mask = XCB_EVENT_MASK_NO_EVENT;
+            xcb_change_window_attributes (x_st->xcb_c, transfer->requestor,
+                                          XCB_CW_EVENT_MASK, &event_mask);
+            x11_clipboard_offer_release (transfer->offer);
+            x11_clipboard.transfers[i] = x11_clipboard.transfers[--x11_clipboard.num_transfers];
+        }
+        xcb_flush (x_st->xcb_c);
+        return true;
+    }
+    return false;
+}
+
+// Gets and deletes _property_ from _window_.
+xcb_get_property_reply_t* x11_take_property (xcb_connection_t *c, xcb_window_t window, xcb_atom_t property)
+{
+    xcb_get_property_cookie_t ck = xcb_get_property (c, 1, window, property,
+                                                     XCB_GET_PROPERTY_TYPE_ANY, 0, UINT32_MAX/4);
+    xcb_generic_error_t *err = NULL;
+    xcb_get_property_reply_t *reply = xcb_get_property_reply (c, ck, &err);
+    if (err != NULL) {
+        printf ("Error reading property.\n");
+        free (err);
+        return NULL;
+    }
+    return reply;
+}
+
+void x11_clipboard_append_received (xcb_get_property_reply_t *reply)
+{
+    int len = xcb_get_property_value_length (reply);
+    if (len > 0) {
+        void *dest = cont_buff_push (&x11_clipboard.received, len);
+        if (dest != NULL) {
+            memcpy (dest, xcb_get_property_value (reply), len);
+        }
+    }
+}
+
+// Ends the paste in progress and sends the result to the render thread. On
+// success ownership of the received buffer goes with the event.
+void x11_clipboard_finish_paste (struct input_event_t *paste_event, bool success)
+{
+    paste_event->type = INPUT_EVENT_PASTE;
+    paste_event->paste.str = NULL;
+    paste_event->paste.len = 0;
+
+    if (success) {
+        char *end = (char*)cont_buff_push (&x11_clipboard.received, 1);
+        if (end != NULL) {
+            *end = '\0';
+            paste_event->paste.str = (char*)x11_clipboard.received.data;
+            paste_event->paste.len = x11_clipboard.received.used - 1;
+            x11_clipboard.received = (cont_buff_t){0};
+        }
+    }
+
+    cont_buff_destroy (&x11_clipboard.received);
+    x11_clipboard.receiving = false;
+    x11_clipboard.receiving_incr = false;
+}
+
+// Returns true if a paste finished, in which case _paste_event_ is set.
+bool x11_clipboard_handle_selection_notify (struct x_state *x_st, xcb_selection_notify_event_t *notify,
+                                            struct input_event_t *paste_event)
+{
+    if (notify->selection != xcb_atoms_cache[LOC_ATOM_CLIPBOARD]) {
+        return false;
+    }
+
+    if (notify->property == XCB_ATOM_NONE) {
+        // Nobody owns the clipboard or the owner can't convert to UTF-8.
+        x11_clipboard_finish_paste (paste_event, false);
+        return true;
+    }
+
+    xcb_get_property_reply_t *reply = x11_take_property (x_st->xcb_c, x_st->window, notify->property);
+    if (reply == NULL) {
+        x11_clipboard_finish_paste (paste_event, false);
+        return true;
+    }
+
+    // Drop anything left from a previous paste that never finished.
+    cont_buff_destroy (&x11_clipboard.received);
+    x11_clipboard.received.min_size = 0;
+
+    x11_clipboard.receiving = true;
+    if (reply->type == xcb_atoms_cache[LOC_ATOM_INCR]) {
+        // Deleting the property (done by x11_take_property()) starts the
+        // transfer. The value is a lower bound of the size, use it to avoid
+        // reallocations.
+        if (xcb_get_property_value_length (reply) >= 4) {
+            x11_clipboard.received.min_size = *(uint32_t*)xcb_get_property_value (reply);
+        }
+        x11_clipboard.receiving_incr = true;
+        free (reply);
+        return false;
+    }
+
+    x11_clipboard_append_received (reply);
+    free (reply);
+    x11_clipboard_finish_paste (paste_event, true);
+    return true;
+}
+
+// Returns true if a paste finished, in which case _paste_event_ is set.
+bool x11_clipboard_receive_chunk (struct x_state *x_st, xcb_property_notify_event_t *event,
+                                  struct input_event_t *paste_event)
+{
+    if (!x11_clipboard.receiving_incr || event->window != x_st->window ||
+        event->atom != xcb_atoms_cache[LOC_ATOM__CLIPBOARD_CONTENT] ||
+        event->state != XCB_PROPERTY_NEW_VALUE) {
+        return false;
+    }
+
+    xcb_get_property_reply_t *reply = x11_take_property (x_st->xcb_c, x_st->window, event->atom);
+    if (reply == NULL) {
+        x11_clipboard_finish_paste (paste_event, false);
+        return true;
+    }
+
+    bool done = xcb_get_property_value_length (reply) == 0;
+    x11_clipboard_append_received (reply);
+    free (reply);
+
+    if (done) {
+        x11_clipboard_finish_paste (paste_event, true);
+    }
+    return done;
+}
+
+#ifdef CAIRO_SHM_BACKEND
+// Presentation of frames drawn with cairo through MIT-SHM. Cairo draws into
+// image surfaces whose pixels live in shared memory segments attached to the
+// server, so presenting a frame is a ShmPutImage request of the damaged
+// rectangles and no pixels go through the socket.
+//
+// There are two buffers. The front one is the last presented and the server
+// may still be reading it, the application draws into the back one. A buffer
+// is busy from the time it's presented until the server sends the
+// ShmCompletion event, if the back buffer is busy when a frame starts we don't
+// wait, graphics->cr is set to NULL for that frame and the damage is kept for
+// the next one.
+//
+// Without MIT-SHM (remote displays, some containers), or if a segment can't be
+// created, the presenter falls back to a single buffer in client memory. The
+// damaged rectangles are then sent with plain PutImage requests.
+struct x11_shm_buffer_t {
+    xcb_shm_seg_t seg; // 0 for a buffer in client memory, read by the event thread
+    uint8_t *data;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    uint16_t width;
+    uint16_t height;
+    int stride;
+
+    bool busy; // Written by the event thread, use atomics.
+};
+
+struct x11_shm_presenter_t {
+    // MIT-SHM is being used. Read by the event thread, use atomics.
+    bool available;
+    uint8_t completion_event;
+    xcb_gcontext_t gc;
+
+    struct x11_shm_buffer_t buffers[2];
+    int back;
+
+    // Damage presented in the previous frame. The back buffer doesn't have
+    // it, we copy it from the front buffer before drawing.
+    int num_prev_damage;
+    box_t prev_damage[GUI_MAX_DAMAGE_RECTS];
+    bool prev_full_damage;
+
+    // PutImage fallback, only buffers[0] is used. Rows of rectangles narrower
+    // than the buffer are packed into _scratch_.
+    bool fallback;
+    size_t max_request_bytes;
+    uint8_t *scratch;
+    size_t scratch_size;
+};
+
+struct x11_shm_presenter_t x11_shm_presenter;
+
+bool x11_shm_presenter_init (struct x_state *x_st, struct x11_shm_presenter_t *p)
+{
+    xcb_connection_t *c = x_st->xcb_c;
+
+    p->gc = xcb_generate_id (c);
+    xcb_create_gc (c, p->gc, x_st->window, 0, NULL);
+    p->back = 0;
+
+    // NOTE: The PutImage request header takes 24 bytes.
+    p->max_request_bytes = (size_t)xcb_get_maximum_request_length (c)*4 - 24;
+
+    const xcb_query_extension_reply_t *shm_ext = xcb_get_extension_data (c, &xcb_shm_id);
+    if (shm_ext == NULL || !shm_ext->present) {
+        printf ("MIT-SHM is not available, frames will be sent with PutImage.\n");
+        p->fallback = true;
+        return false;
+    }
+
+    xcb_shm_query_version_reply_t *version =
+        xcb_shm_query_version_reply (c, xcb_shm_query_version (c), NULL);
+    if (version == NULL) {
+        printf ("Could not query the MIT-SHM version, frames will be sent with PutImage.\n");
+        p->fallback = true;
+        return false;
+    }
+    free (version);
+
+    p->completion_event = shm_ext->first_event + XCB_SHM_COMPLETION;
+    __atomic_store_n (&p->available, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+void x11_shm_buffer_destroy (struct x_state *x_st, struct x11_shm_buffer_t *buffer)
+{
+    if (buffer->data == NULL) {
+        return;
+    }
+
+    cairo_destroy (buffer->cr);
+    cairo_surface_destroy (buffer->surface);
+    if (buffer->seg != 0) {
+        // NOTE: Requests are processed in order, so a pending ShmPutImage that
+        // uses this segment is done before the server detaches it.
+        xcb_shm_detach (x_st->xcb_c, buffer->seg);
+        shmdt (buffer->data);
+    } else {
+        free (buffer->data);
+    }
+
+    __atomic_store_n (&buffer->seg, 0, __ATOMIC_RELAXED);
+    __atomic_store_n (&buffer->busy, false, __ATOMIC_RELAXED);
+    buffer->data = NULL;
+    buffer->surface = NULL;
+    buffer->cr = NULL;
+    buffer->width = 0;
+    buffer->height = 0;
+    buffer->stride = 0;
+}
+
+void x11_shm_buffer_set_data (struct x11_shm_buffer_t *buffer, uint8_t *data,
+                              uint16_t width, uint16_t height, int stride)
+{
+    buffer->data = data;
+    buffer->width = width;
+    buffer->height = height;
+    buffer->stride = stride;
+    buffer->surface = cairo_image_surface_create_for_data (data, CAIRO_FORMAT_ARGB32,
+                                                           width, height, stride);
+    buffer->cr = cairo_create (buffer->surface);
+    __atomic_store_n (&buffer->busy, false, __ATOMIC_RELAXED);
+}
+
+bool x11_shm_buffer_create (struct x_state *x_st, struct x11_shm_buffer_t *buffer,
+                            uint16_t width, uint16_t height)
+{
+    int stride = cairo_format_stride_for_width (CAIRO_FORMAT_ARGB32, width);
+    int shmid = shmget (IPC_PRIVATE, stride*height, IPC_CREAT|0600);
+    if (shmid == -1) {
+        printf ("Could not create shared memory segment: %s\n", strerror(errno));
+        return false;
+    }
+
+    uint8_t *data = shmat (shmid, NULL, 0);
+    if (data == (void*)-1) {
+        printf ("Could not attach shared memory segment: %s\n", strerror(errno));
+        shmctl (shmid, IPC_RMID, NULL);
+        return false;
+    }
+
+    xcb_shm_seg_t seg = xcb_generate_id (x_st->xcb_c);
+    xcb_void_cookie_t ck = xcb_shm_attach_checked (x_st->xcb_c, seg, shmid, 0);
+    xcb_generic_error_t *error = xcb_request_check (x_st->xcb_c, ck);
+
+    // NOTE: Once both sides are attached we can mark the segment for removal,
+    // it will be destroyed when the last one detaches, even if we crash.
+    shmctl (shmid, IPC_RMID, NULL);
+
+    if (error != NULL) {
+        printf ("Server could not attach shared memory segment (remote display?).\n");
+        free (error);
+        shmdt (data);
+        return false;
+    }
+
+    __atomic_store_n (&buffer->seg, seg, __ATOMIC_RELAXED);
+    x11_shm_buffer_set_data (buffer, data, width, height, stride);
+    return true;
+}
+
+bool x11_image_buffer_create (struct x11_shm_buffer_t *buffer, uint16_t width, uint16_t height)
+{
+    int stride = cairo_format_stride_for_width (CAIRO_FORMAT_ARGB32, width);
+    uint8_t *data = malloc ((size_t)stride*height);
+    if (data == NULL) {
+        printf ("Could not allocate a %dx%d image buffer.\n", width, height);
+        return false;
+    }
+
+    __atomic_store_n (&buffer->seg, 0, __ATOMIC_RELAXED);
+    x11_shm_buffer_set_data (buffer, data, width, height, stride);
+    return true;
+}
+
+// Stops using MIT-SHM, frames from now on are sent with PutImage.
+void x11_shm_presenter_start_fallback (struct x_state *x_st, struct x11_shm_presenter_t *p)
+{
+    printf ("Falling back to PutImage to present frames.\n");
+    __atomic_store_n (&p->available, false, __ATOMIC_RELEASE);
+    x11_shm_buffer_destroy (x_st, &p->buffers[0]);
+    x11_shm_buffer_destroy (x_st, &p->buffers[1]);
+    p->back = 0;
+    p->fallback = true;
+}
+
+// Copies _rect_ from src into dst, both must have the same size.
+void x11_shm_buffer_copy_rect (struct x11_shm_buffer_t *dst, struct x11_shm_buffer_t *src, box_t *rect)
+{
+    int x = rect->min.x;
+    int y = rect->min.y;
+    int w = MIN (BOX_WIDTH(*rect), dst->width - x);
+    int h = MIN (BOX_HEIGHT(*rect), dst->height - y);
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+
+    int i;
+    for (i=0; i<h; i++) {
+        size_t offset = (size_t)(y+i)*dst->stride + x*4;
+        memcpy (dst->data + offset, src->data + offset, w*4);
+    }
+}
+
+// Sends _rect_ of _buffer_ with PutImage requests, in bands of rows that fit
+// in the maximum request size. Rows of full width rectangles are already
+// contiguous, others are packed into p->scratch first.
+void x11_put_image_rect (struct x_state *x_st, struct x11_shm_presenter_t *p,
+                         struct x11_shm_buffer_t *buffer, box_t *rect)
+{
+    int x = rect->min.x;
+    int y = rect->min.y;
+    int w = MIN (BOX_WIDTH(*rect), buffer->width - x);
+    int h = MIN (BOX_HEIGHT(*rect), buffer->height - y);
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+
+    size_t row_size = (size_t)w*4;
+    bool contiguous = row_size == (size_t)buffer->stride;
+    int rows_per_request = CLAMP (p->max_request_bytes/row_size, 1, h);
+
+    size_t scratch_size = rows_per_request*row_size;
+    if (!contiguous && p->scratch_size < scratch_size) {
+        free (p->scratch);
+        p->scratch = malloc (scratch_size);
+        p->scratch_size = p->scratch != NULL ? scratch_size : 0;
+        if (p->scratch == NULL) {
+            printf ("Could not allocate PutImage scratch buffer.\n");
+            return;
+        }
+    }
+
+    int i;
+    for (i=0; i<h; i+=rows_per_request) {
+        int num_rows = MIN (rows_per_request, h - i);
+        uint8_t *src = buffer->data + (size_t)(y+i)*buffer->stride + x*4;
+        if (!contiguous) {
+            int j;
+            for (j=0; j<num_rows; j++) {
+                memcpy (p->scratch + j*row_size, src + (size_t)j*buffer->stride, row_size);
+            }
+            src = p->scratch;
+        }
+
+        // NOTE: xcb copies the data into its output buffer, scratch can be
+        // reused as soon as this returns.
+        xcb_put_image (x_st->xcb_c, XCB_IMAGE_FORMAT_Z_PIXMAP, x_st->window, p->gc,
+                       w, num_rows, x, y+i, 0, x_st->depth, num_rows*row_size, src);
+    }
+}
+
+// Returns the cairo context to draw the frame with, or NULL if the back buffer
+// is still being read by the server.
+cairo_t* x11_shm_presenter_begin_frame (struct x_state *x_st, struct x11_shm_presenter_t *p,
+                                        struct gui_state_t *gui_st, uint16_t width, uint16_t height)
+{
+    struct x11_shm_buffer_t *back = &p->buffers[p->back];
+    struct x11_shm_buffer_t *front = &p->buffers[!p->back];
+    if (__atomic_load_n (&back->busy, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    if (back->width != width || back->height != height) {
+        x11_shm_buffer_destroy (x_st, back);
+        if (!p->fallback && !x11_shm_buffer_create (x_st, back, width, height)) {
+            x11_shm_presenter_start_fallback (x_st, p);
+            back = &p->buffers[p->back];
+        }
+        if (p->fallback && !x11_image_buffer_create (back, width, height)) {
+            return NULL;
+        }
+        // The contents of the new buffer are undefined.
+        gui_damage_all (gui_st);
+
+    } else if (p->fallback) {
+        // There is a single buffer, it already has the previous frame.
+
+    } else if (front->width == width && front->height == height) {
+        cairo_surface_flush (back->surface);
+        if (p->prev_full_damage) {
+            memcpy (back->data, front->data, (size_t)back->stride*back->height);
+        } else {
+            int i;
+            for (i=0; i<p->num_prev_damage; i++) {
+                x11_shm_buffer_copy_rect (back, front, &p->prev_damage[i]);
+            }
+        }
+        cairo_surface_mark_dirty (back->surface);
+
+    } else {
+        gui_damage_all (gui_st);
+    }
+
+    cairo_reset_clip (back->cr);
+    return back->cr;
+}
+
+void x11_shm_presenter_end_frame (struct x_state *x_st, struct x11_shm_presenter_t *p,
+                                  struct gui_state_t *gui_st)
+{
+    struct x11_shm_buffer_t *back = &p->buffers[p->back];
+    if (!gui_has_damage (gui_st)) {
+        return;
+    }
+
+    cairo_surface_flush (back->surface);
+
+    box_t full_rect = {{{0, 0}}, {{back->width, back->height}}};
+    box_t *rects = gui_st->full_damage ? &full_rect : gui_st->damage_rects;
+    int num_rects = gui_st->full_damage ? 1 : gui_st->num_damage_rects;
+
+    if (p->fallback) {
+        int i;
+        for (i=0; i<num_rects; i++) {
+            x11_put_image_rect (x_st, p, back, &rects[i]);
+        }
+        xcb_flush (x_st->xcb_c);
+        gui_damage_clear (gui_st);
+        return;
+    }
+
+    // NOTE: Only the last request asks for a completion event, requests are
+    // processed in order so when it arrives the server is done with all of
+    // them.
+    __atomic_store_n (&back->busy, true, __ATOMIC_RELEASE);
+    int i;
+    for (i=0; i<num_rects; i++) {
+        box_t *rect = &rects[i];
+        xcb_shm_put_image (x_st->xcb_c, x_st->window, p->gc,
+                           back->width, back->height,
+                           rect->min.x, rect->min.y, BOX_WIDTH(*rect), BOX_HEIGHT(*rect),
+                           rect->min.x, rect->min.y,
+                           x_st->depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
+                           i == num_rects-1, back->seg, 0);
+    }
+    xcb_flush (x_st->xcb_c);
+
+    p->prev_full_damage = gui_st->full_damage;
+    p->num_prev_damage = gui_st->num_damage_rects;
+    memcpy (p->prev_damage, gui_st->damage_rects, gui_st->num_damage_rects*sizeof(box_t));
+    gui_damage_clear (gui_st);
+
+    p->back = !p->back;
+}
+
+// Called from the event thread.
+bool x11_shm_presenter_handle_event (struct x11_shm_presenter_t *p, xcb_generic_event_t *event)
+{
+    if (!__atomic_load_n (&p->available, __ATOMIC_ACQUIRE) ||
+        (event->response_type & ~0x80) != p->completion_event) {
+        return false;
+    }
+
+    xcb_shm_completion_event_t *completion = (xcb_shm_completion_event_t*)event;
+    int i;
+    for (i=0; i<2; i++) {
+        if (__atomic_load_n (&p->buffers[i].seg, __ATOMIC_RELAXED) == completion->shmseg) {
+            __atomic_store_n (&p->buffers[i].busy, false, __ATOMIC_RELEASE);
+        }
+    }
+    return true;
+}
+
+void x11_shm_presenter_destroy (struct x_state *x_st, struct x11_shm_presenter_t *p)
+{
+    x11_shm_buffer_destroy (x_st, &p->buffers[0]);
+    x11_shm_buffer_destroy (x_st, &p->buffers[1]);
+    xcb_free_gc (x_st->xcb_c, p->gc);
+    free (p->scratch);
+    __atomic_store_n (&p->available, false, __ATOMIC_RELEASE);
+    *p = ZERO_INIT(struct x11_shm_presenter_t);
+}
+#endif
+
+// X events are read by a dedicated thread so they are handled even if the
+// render thread is in the middle of a long frame. Input events are sent in
+// order through an SPSC ring, everything else goes into the window state.
+#define X11_INPUT_RING_SIZE 4096
+struct x11_event_thread_t {
+    pthread_t thread;
+    struct x_state *x_st;
+    mem_pool_t pool;
+
+    struct spsc_ring_t input_ring;
+    struct triple_buffer_t window_state;
+
+    // State the event thread starts from. It's set before the thread is
+    // created, afterwards the event thread keeps its own copy and only writes
+    // to window_state.
+    struct x11_window_state_t initial_window_state;
+
+    // eventfd written by the event thread every time it publishes something.
+    // The render thread waits on it while idle.
+    int wakeup_fd;
+
+    bool quit;
+};
+
+struct x11_event_thread_t x11_event_thread;
+
+void x11_event_thread_push_input (struct x11_event_thread_t *ev_th, struct input_event_t *input_event)
+{
+    while (!spsc_ring_push (&ev_th->input_ring, input_event)) {
+        // NOTE: If the render thread stops draining the ring, motion events
+        // are the only ones we can drop. The next one will have the current
+        // position anyway.
+        if (input_event->type == INPUT_EVENT_MOTION) {
+            return;
+        }
+        sched_yield ();
+    }
+}
+
+void x11_event_thread_signal (struct x11_event_thread_t *ev_th)
+{
+    uint64_t one = 1;
+    if (write (ev_th->wakeup_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        printf ("Error signaling render thread: %s\n", strerror(errno));
+    }
+}
+
+void x11_handle_event (struct x11_event_thread_t *ev_th, struct x11_window_state_t *win_st,
+                       xcb_generic_event_t *event, mem_pool_t *pool)
+{
+    struct x_state *x_st = ev_th->x_st;
+
+    // NOTE: The most significant bit of event->response_type is set if
+    // the event was generated from a SendEvent request, here we don't
+    // care about the source of the event.
+    switch (event->response_type & ~0x80) {
+        case XCB_CONFIGURE_NOTIFY:
+            {
+                win_st->width = ((xcb_configure_notify_event_t*)event)->width;
+                win_st->height = ((xcb_configure_notify_event_t*)event)->height;
+            } break;
+        case XCB_MOTION_NOTIFY:
+            {
+                xcb_motion_notify_event_t *motion = (xcb_motion_notify_event_t*)event;
+                win_st->last_timestamp = motion->time;
+
+                struct input_event_t input_event = {0};
+                input_event.type = INPUT_EVENT_MOTION;
+                input_event.time = motion->time;
+                input_event.ptr = DVEC2 (motion->event_x, motion->event_y);
+                x11_event_thread_push_input (ev_th, &input_event);
+            } break;
+        case XCB_KEY_PRESS:
+            {
+                xcb_key_press_event_t *key_press = (xcb_key_press_event_t*)event;
+                win_st->last_timestamp = key_press->time;
+
+                struct input_event_t input_event = {0};
+                input_event.type = INPUT_EVENT_KEY_PRESS;
+                input_event.time = key_press->time;
+                input_event.ptr = DVEC2 (key_press->event_x, key_press->event_y);
+                input_event.keycode = key_press->detail;
+                input_event.modifiers = key_press->state;
+                x11_event_thread_push_input (ev_th, &input_event);
+            } break;
+        case XCB_EXPOSE:
+            {
+                // We should tell which areas need exposing
+                win_st->expose_serial++;
+            } break;
+        case XCB_BUTTON_PRESS:
+        case XCB_BUTTON_RELEASE:
+            {
+                // NOTE: Press and release events have the same layout.
+                xcb_button_press_event_t *button_event = (xcb_button_press_event_t*)event;
+                win_st->last_timestamp = button_event->time;
+                bool is_press = (event->response_type & ~0x80) == XCB_BUTTON_PRESS;
+
+                struct input_event_t input_event = {0};
+                input_event.time = button_event->time;
+                input_event.ptr = DVEC2 (button_event->event_x, button_event->event_y);
+
+                char button_pressed = button_event->detail;
+                if (button_pressed == 4 || button_pressed == 5) {
+                    // Scroll wheel, ignore the release events.
+                    if (is_press) {
+                        input_event.type = INPUT_EVENT_WHEEL;
+                        input_event.wheel = button_pressed == 4? 1.2 : 1/1.2;
+                        x11_event_thread_push_input (ev_th, &input_event);
+                    }
+                } else if (button_pressed >= 1 && button_pressed <= 3) {
+                    input_event.type = is_press? INPUT_EVENT_BUTTON_PRESS : INPUT_EVENT_BUTTON_RELEASE;
+                    input_event.button = button_pressed-1;
+                    x11_event_thread_push_input (ev_th, &input_event);
+                }
+            } break;
+        case XCB_CLIENT_MESSAGE:
+            {
+                bool handled = false;
+                xcb_client_message_event_t *client_message = ((xcb_client_message_event_t*)event);
+
+                // WM_DELETE_WINDOW protocol
+                if (client_message->type == xcb_atoms_cache[LOC_ATOM_WM_PROTOCOLS]) {
+                    if (client_message->data.data32[0] == xcb_atoms_cache[LOC_ATOM_WM_DELETE_WINDOW]) {
+                        win_st->close_requested = true;
+                    }
+                    handled = true;
+                }
+
+                // _NET_WM_SYNC_REQUEST protocol using the extended mode
+                if (client_message->type == xcb_atoms_cache[LOC_ATOM_WM_PROTOCOLS] &&
+                    client_message->data.data32[0] == xcb_atoms_cache[LOC_ATOM__NET_WM_SYNC_REQUEST]) {
+
+                    win_st->sync_counter_val.lo = client_message->data.data32[2];
+                    win_st->sync_counter_val.hi = client_message->data.data32[3];
+                    if (win_st->sync_counter_val.lo % 2 != 0) {
+                        increment_sync_counter (&win_st->sync_counter_val);
+                    }
+                    win_st->sync_request_serial++;
+                    handled = true;
+                } else if (client_message->type == xcb_atoms_cache[LOC_ATOM__NET_WM_FRAME_DRAWN]) {
+                    handled = true;
+                } else if (client_message->type == xcb_atoms_cache[LOC_ATOM__NET_WM_FRAME_TIMINGS]) {
+                    handled = true;
+                } else if (client_message->type == xcb_atoms_cache[LOC_ATOM_CLIPBOARD]) {
+                    // Sent by x11_clipboard_copy().
+                    x11_clipboard_take_ownership (x_st, win_st);
+                    handled = true;
+                } else if (client_message->type == XCB_ATOM_NONE) {
+                    // Sent by x11_event_thread_stop() to wake us up.
+                    handled = true;
+                }
+
+                if (!handled) {
+                    printf ("Unrecognized Client Message: %s\n",
+                            get_x11_atom_name (x_st->xcb_c, client_message->type, pool));
+                }
+            } break;
+        case XCB_PROPERTY_NOTIFY:
+            {
+                xcb_property_notify_event_t *property_notify = (xcb_property_notify_event_t*)event;
+                win_st->last_timestamp = property_notify->time;
+
+                struct input_event_t paste_event = {0};
+                if (x11_clipboard_continue_transfer (x_st, property_notify)) {
+                    // Sent the next chunk of an INCR transfer.
+                } else if (x11_clipboard_receive_chunk (x_st, property_notify, &paste_event)) {
+                    paste_event.time = property_notify->time;
+                    x11_event_thread_push_input (ev_th, &paste_event);
+                }
+            } break;
+        case XCB_SELECTION_REQUEST:
+            {
+                x11_clipboard_handle_selection_request (x_st, (xcb_selection_request_event_t*)event);
+            } break;
+        case XCB_SELECTION_NOTIFY:
+            {
+                xcb_selection_notify_event_t *selection_notify = (xcb_selection_notify_event_t*)event;
+                struct input_event_t paste_event = {0};
+                if (x11_clipboard_handle_selection_notify (x_st, selection_notify, &paste_event)) {
+                    paste_event.time = selection_notify->time;
+                    x11_event_thread_push_input (ev_th, &paste_event);
+                }
+            } break;
+        case XCB_SELECTION_CLEAR:
+            {
+                xcb_selection_clear_event_t *selection_clear = (xcb_selection_clear_event_t*)event;
+                if (selection_clear->selection == xcb_atoms_cache[LOC_ATOM_CLIPBOARD]) {
+                    x11_clipboard_lose_ownership (win_st);
+                }
+            } break;
+        case 0:
+            { // XCB_ERROR
+                // NOTE: Errors caused by unchecked requests end up
+                // here, for example those of sync counter updates.
+                xcb_generic_error_t *error = (xcb_generic_error_t*)event;
+                printf("Received X11 error %d (opcode %d.%d, sequence %d)\n",
+                       error->error_code, error->major_code,
+                       error->minor_code, error->sequence);
+            } break;
+        default:
+#ifdef CAIRO_SHM_BACKEND
+            if (x11_shm_presenter_handle_event (&x11_shm_presenter, event)) {
+                break;
+            }
+#endif
+            /* Unknown event type, ignore it */
+            break;
+    }
+}
+
+void* x11_event_thread_main (void *data)
+{
+    struct x11_event_thread_t *ev_th = (struct x11_event_thread_t*)data;
+    struct x_state *x_st = ev_th->x_st;
+
+    mem_pool_t pool = {0};
+    struct x11_window_state_t win_st = ev_th->initial_window_state;
+
+    xcb_generic_event_t *event;
+    while (!__atomic_load_n (&ev_th->quit, __ATOMIC_ACQUIRE) &&
+           (event = xcb_wait_for_event (x_st->xcb_c)) != NULL) {
+
+        // Handle everything that is already queued before waking up the
+        // render thread, this way a batch of events costs a single wakeup.
+        mem_pool_temp_marker_t mrkr = mem_pool_begin_temporary_memory (&pool);
+        for (; event != NULL; event = xcb_poll_for_queued_event (x_st->xcb_c)) {
+            x11_handle_event (ev_th, &win_st, event, &pool);
+            free (event);
+        }
+        mem_pool_end_temporary_memory (mrkr);
+
+        triple_buffer_write (&ev_th->window_state, &win_st);
+        x11_event_thread_signal (ev_th);
+    }
+
+    if (xcb_connection_has_error (x_st->xcb_c)) {
+        // Let the render thread know there is nothing else to do.
+        win_st.close_requested = true;
+        triple_buffer_write (&ev_th->window_state, &win_st);
+        x11_event_thread_signal (ev_th);
+    }
+
+    mem_pool_destroy (&pool);
+    return NULL;
+}
+
+bool x11_event_thread_start (struct x11_event_thread_t *ev_th, struct x_state *x_st,
+                             uint16_t width, uint16_t height)
+{
+    ev_th->x_st = x_st;
+    ev_th->quit = false;
+
+    ev_th->wakeup_fd = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (ev_th->wakeup_fd == -1) {
+        printf ("Could not create eventfd: %s\n", strerror(errno));
+        return false;
+    }
+
+    spsc_ring_init (&ev_th->input_ring, &ev_th->pool,
+                    sizeof(struct input_event_t), X11_INPUT_RING_SIZE);
+    triple_buffer_init (&ev_th->window_state, &ev_th->pool, sizeof(struct x11_window_state_t));
+
+    struct x11_window_state_t *win_st = &ev_th->initial_window_state;
+    *win_st = ZERO_INIT(struct x11_window_state_t);
+    win_st->width = width;
+    win_st->height = height;
+    triple_buffer_write (&ev_th->window_state, win_st);
+
+    if (pthread_create (&ev_th->thread, NULL, x11_event_thread_main, ev_th) != 0) {
+        printf ("Could not create event thread.\n");
+        close (ev_th->wakeup_fd);
+        return false;
+    }
+    return true;
+}
+
+void x11_event_thread_stop (struct x11_event_thread_t *ev_th)
+{
+    __atomic_store_n (&ev_th->quit, true, __ATOMIC_RELEASE);
+
+    // The event thread is most likely blocked in xcb_wait_for_event(), send
+    // an event to our own window so it wakes up and sees the quit flag.
+    xcb_client_message_event_t client_message = {0};
+    client_message.response_type = XCB_CLIENT_MESSAGE;
+    client_message.format = 32;
+    client_message.window = ev_th->x_st->window;
+    client_message.type = XCB_ATOM_NONE;
+    xcb_send_event (ev_th->x_st->xcb_c, 0, ev_th->x_st->window,
+                    XCB_EVENT_MASK_NO_EVENT, (const char*)&client_message);
+    xcb_flush (ev_th->x_st->xcb_c);
+
+    pthread_join (ev_th->thread, NULL);
+    x11_clipboard_destroy ();
+    close (ev_th->wakeup_fd);
+    mem_pool_destroy (&ev_th->pool);
+}
+
+// Blocks the render thread until the event thread publishes something or
+// timer_fd expires.
+void x11_wait_for_wakeup (int wakeup_fd, int timer_fd)
+{
+    while (true) {
+        struct pollfd fds[2];
+        fds[0].fd = wakeup_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = timer_fd;
+        fds[1].events = POLLIN;
+
+        int status = poll (fds, timer_fd == -1 ? 1 : 2, -1);
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf ("Error waiting for events: %s\n", strerror(errno));
+            break;
+        }
+
+        if (timer_fd != -1 && fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read (timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+                printf ("Error reading wakeup timer: %s\n", strerror(errno));
+            }
+        }
+        break;
+    }
+}
+
 void x11_get_screen_extents (struct x_state *x_st, float *x_dpi, float *y_dpi,
                              uint16_t *width, uint16_t *height)
 {
@@ -628,11 +1937,14 @@ void x11_get_screen_extents (struct x_state *x_st, float *x_dpi, float *y_dpi,
         return;
     }
 
-    xcb_randr_get_screen_resources_cookie_t ck =
-        xcb_randr_get_screen_resources (x_st->xcb_c, x_st->window);
+    // NOTE: We use the _current version of this request, the other one makes
+    // the server poll the hardware for changes in outputs, which can take
+    // hundreds of milliseconds. We don't care about hotplugging at startup.
+    xcb_randr_get_screen_resources_current_cookie_t ck =
+        xcb_randr_get_screen_resources_current (x_st->xcb_c, x_st->window);
     xcb_generic_error_t *error = NULL;
-    xcb_randr_get_screen_resources_reply_t *get_resources_reply =
-        xcb_randr_get_screen_resources_reply (x_st->xcb_c, ck, &error);
+    xcb_randr_get_screen_resources_current_reply_t *get_resources_reply =
+        xcb_randr_get_screen_resources_current_reply (x_st->xcb_c, ck, &error);
     if (error) {
         printf("RANDR: Error getting screen resources. %d\n", error->error_code);
         free(error);
@@ -640,48 +1952,53 @@ void x11_get_screen_extents (struct x_state *x_st, float *x_dpi, float *y_dpi,
     }
 
     xcb_randr_output_t *outputs =
-        xcb_randr_get_screen_resources_outputs (get_resources_reply);
+        xcb_randr_get_screen_resources_current_outputs (get_resources_reply);
     int num_outputs =
-        xcb_randr_get_screen_resources_outputs_length  (get_resources_reply);
+        xcb_randr_get_screen_resources_current_outputs_length  (get_resources_reply);
+
+    // Send all output info requests first, then wait for all replies.
+    mem_pool_t pool = {0};
+    xcb_randr_get_output_info_cookie_t *output_cookies =
+        mem_pool_push_array (&pool, num_outputs, xcb_randr_get_output_info_cookie_t);
+    int i;
+    for (i=0; i<num_outputs; i++) {
+        output_cookies[i] =
+            xcb_randr_get_output_info (x_st->xcb_c, outputs[i], XCB_CURRENT_TIME);
+    }
 
     // TODO: Compute in which CRTC is x_st->window. ATM we assume there is only
     // one output and use that.
     int num_active_outputs = 0;
-    xcb_randr_output_t output = 0;
-    int i;
+    xcb_randr_get_output_info_reply_t *output_info = NULL;
     for (i=0; i<num_outputs; i++) {
-        xcb_randr_get_output_info_cookie_t ck =
-            xcb_randr_get_output_info (x_st->xcb_c, outputs[i], XCB_CURRENT_TIME);
-        xcb_randr_get_output_info_reply_t *output_info =
-            xcb_randr_get_output_info_reply (x_st->xcb_c, ck, &error);
+        xcb_randr_get_output_info_reply_t *curr_output_info =
+            xcb_randr_get_output_info_reply (x_st->xcb_c, output_cookies[i], &error);
         if (error) {
             printf("RANDR: Error getting output info. %d\n", error->error_code);
             free(error);
-            return;
+            error = NULL;
+            continue;
         }
 
-        if (output_info->crtc) {
+        if (curr_output_info->crtc) {
             num_active_outputs++;
-            if (output == 0) {
-                output = outputs[i];
+            if (output_info == NULL) {
+                output_info = curr_output_info;
+                continue;
             }
         }
+        free (curr_output_info);
     }
+    mem_pool_destroy (&pool);
+    free (get_resources_reply);
 
     if (num_active_outputs != 1) {
         printf ("There are more than 1 outputs, we may be setting the DPI of the wrong one.\n");
     }
 
-    xcb_randr_get_output_info_reply_t *output_info;
-    {
-        xcb_randr_get_output_info_cookie_t ck =
-            xcb_randr_get_output_info (x_st->xcb_c, output, XCB_CURRENT_TIME);
-        output_info = xcb_randr_get_output_info_reply (x_st->xcb_c, ck, &error);
-        if (error) {
-            printf("RANDR: Error getting output info. %d\n", error->error_code);
-            free(error);
-            return;
-        }
+    if (output_info == NULL) {
+        printf("RANDR: Could not find an active output.\n");
+        return;
     }
 
     xcb_randr_get_crtc_info_reply_t *crtc_info;
@@ -692,6 +2009,7 @@ void x11_get_screen_extents (struct x_state *x_st, float *x_dpi, float *y_dpi,
         if (error) {
             printf("RANDR: Error getting crtc info. %d\n", error->error_code);
             free(error);
+            free (output_info);
             return;
         }
     }
@@ -700,16 +2018,75 @@ void x11_get_screen_extents (struct x_state *x_st, float *x_dpi, float *y_dpi,
     *height = crtc_info->height;
     *x_dpi = crtc_info->width / (float)output_info->mm_width;
     *y_dpi = crtc_info->height / (float)output_info->mm_height;
+    free (crtc_info);
+    free (output_info);
 }
 
 typedef GLXContext (*glXCreateContextAttribsARBProc)(Display*, GLXFBConfig, GLXContext, Bool, const int*);
 
+// Startup work that does not depend on the X server or a GL context. It runs
+// in its own thread while the main thread connects to X and creates the
+// window and GL context.
+struct startup_worker_t {
+    pthread_t thread;
+    struct app_state_t *st;
+    struct phase_profile_t profile;
+};
+
+void* startup_worker_thread (void *data)
+{
+    struct startup_worker_t *worker = (struct startup_worker_t*)data;
+    phase_profile_begin (&worker->profile);
+
+#ifndef CAIRO_SHM_BACKEND
+    gl_preload_shader_sources ();
+    phase_profile_mark (&worker->profile, "Shader source loading");
+#endif
+
+    app_prepare (worker->st);
+    phase_profile_mark (&worker->profile, "Scene and asset preparation");
+
+#ifdef __PANGO_H__
+    // NOTE: The default font map is per thread, the one created here is
+    // thrown away. What we want is to load the fontconfig configuration and
+    // caches, which are global and are the slow part.
+    PangoFontMap *font_map = pango_cairo_font_map_new ();
+    PangoFontFamily **families;
+    int num_families;
+    pango_font_map_list_families (font_map, &families, &num_families);
+    g_free (families);
+    g_object_unref (font_map);
+    phase_profile_mark (&worker->profile, "Font map initialization");
+#endif
+
+    return NULL;
+}
+
 int main (void)
 {
+    struct phase_profile_t startup_profile;
+    phase_profile_begin (&startup_profile);
+
     global_shader_folder = "../shaders/";
+    global_program_cache_dir = "~/.cache/gl_program_cache/";
     // Setup clocks
     setup_clocks ();
 
+    mem_pool_t bootstrap = {0};
+    struct app_state_t *st =
+        (struct app_state_t*)mem_pool_push_size_full (&bootstrap, sizeof(struct app_state_t), POOL_ZERO_INIT);
+    st->memory = bootstrap;
+
+    struct startup_worker_t startup_worker = {0};
+    startup_worker.st = st;
+    float startup_worker_offset_ms = phase_profile_total_ms (&startup_profile);
+    bool startup_worker_running =
+        pthread_create (&startup_worker.thread, NULL, startup_worker_thread, &startup_worker) == 0;
+    if (!startup_worker_running) {
+        printf ("Could not create startup thread, running startup work serially.\n");
+        startup_worker_thread (&startup_worker);
+    }
+
     //////////////////
     // X11 setup
     // By default xcb is used, because it allows more granularity if we ever reach
@@ -718,6 +2095,9 @@ int main (void)
     struct x_state *x_st = &global_x11_state;
     x_st->transient_pool_flush = mem_pool_begin_temporary_memory (&x_st->transient_pool);
 
+    // NOTE: Xlib is used from the render thread (GLX) while the event thread
+    // uses the same connection through xcb.
+    XInitThreads ();
     x_st->xlib_dpy = XOpenDisplay (NULL);
     if (!x_st->xlib_dpy) {
         printf ("Could not open display\n");
@@ -730,8 +2110,12 @@ int main (void)
         return -1;
     }
     XSetEventQueueOwner (x_st->xlib_dpy, XCBOwnsEventQueue);
+    phase_profile_mark (&startup_profile, "X11 connection");
 
-    init_x11_atoms (x_st);
+    // NOTE: Atom replies are collected after the GLXFBConfig selection so
+    // that the round trip overlaps with it.
+    xcb_intern_atom_cookie_t atom_cookies[ARRAY_SIZE(cached_atom_names)];
+    x11_request_atoms (x_st, atom_cookies);
 
     /* Get the default screen */
     // TODO: Do this using only xcb.
@@ -746,6 +2130,28 @@ int main (void)
         }
     }
 
+#ifdef CAIRO_SHM_BACKEND
+    // NOTE: Frames are drawn by cairo and presented with MIT-SHM, there is no
+    // GL context. GLX must not own the window, ShmPutImage and buffer swaps
+    // into the same drawable would overwrite each other.
+    uint8_t x11_depth;
+    xcb_visualtype_t *visual = get_visual_of_max_depth (x_st->xcb_c, x_st->screen, &x11_depth);
+    if (visual == NULL) {
+        printf ("Could not find a visual for the window.\n");
+        return -1;
+    }
+
+    x_st->depth = x11_depth;
+    x_st->visual_id = visual->visual_id;
+    phase_profile_mark (&startup_profile, "Visual selection");
+
+    x11_collect_atoms (x_st, atom_cookies);
+    phase_profile_mark (&startup_profile, "Atom interning");
+
+    if (x11_depth != 32) {
+        printf ("Can't create a window with alpha channel.\n");
+    }
+#else
     /* Get a GLXFBConfig */
     // We want a GLXFBConfig with a double buffer and a X11 visual that allows
     // for alpha channel in the window (transparent windows).
@@ -780,6 +2186,10 @@ int main (void)
 
     x_st->depth = x11_depth;
     x_st->visual_id = visual_id;
+    phase_profile_mark (&startup_profile, "GLXFBConfig selection");
+
+    x11_collect_atoms (x_st, atom_cookies);
+    phase_profile_mark (&startup_profile, "Atom interning");
 
     if (num_GLX_confs == 0 || x11_depth != max_x11_depth) {
         printf ("Failed to get an good glXConfig.\n");
@@ -789,13 +2199,16 @@ int main (void)
     if (max_x11_depth != 32) {
         printf ("Can't create a window with alpha channel.\n");
     }
+#endif
 
     x11_create_window (x_st, "Closet Maker", x_st->visual_id);
 
     x11_setup_icccm_and_ewmh_protocols (x_st);
 
     xcb_map_window (x_st->xcb_c, x_st->window);
+    phase_profile_mark (&startup_profile, "Window creation");
 
+#ifndef CAIRO_SHM_BACKEND
     /* Set up the GL context */
     glXCreateContextAttribsARBProc glXCreateContextAttribsARB = 0;
     glXCreateContextAttribsARB = (glXCreateContextAttribsARBProc)
@@ -839,16 +2252,31 @@ int main (void)
     glDebugMessageCallback((GLDEBUGPROC)debug_message_callback, 0);
 
     glEnable (GL_MULTISAMPLE);
+    phase_profile_mark (&startup_profile, "GL context creation");
+#endif
 
     // ////////////////
-    // Main event loop
-    xcb_generic_event_t *event;
+    // Main loop
+    //
+    // NOTE: This thread owns the GL context (or the SHM presenter) and only
+    // renders. X events are handled by x11_event_thread, which keeps
+    // processing input and window manager requests while we are busy with a
+    // slow frame.
     app_graphics_t graphics;
     graphics.width = WINDOW_WIDTH;
     graphics.height = WINDOW_HEIGHT;
+    graphics.cr = NULL;
     x11_get_screen_extents (x_st, &graphics.x_dpi, &graphics.y_dpi,
                             &graphics.screen_width, &graphics.screen_height);
+    phase_profile_mark (&startup_profile, "RANDR screen extents");
+
+    if (startup_worker_running) {
+        pthread_join (startup_worker.thread, NULL);
+    }
+    phase_profile_mark (&startup_profile, "Wait for startup thread");
+
     bool force_blit = false;
+    bool first_frame = true;
 
     float frame_rate = 60;
     float target_frame_length_ms = 1000/(frame_rate);
@@ -857,134 +2285,141 @@ int main (void)
 
     clock_gettime(CLOCK_MONOTONIC, &start_ticks);
     app_input_t app_input = {0};
-    app_input.wheel = 1;
 
-    mem_pool_t bootstrap = {0};
-    struct app_state_t *st =
-        (struct app_state_t*)mem_pool_push_size_full (&bootstrap, sizeof(struct app_state_t), POOL_ZERO_INIT);
-    st->memory = bootstrap;
+    // Used to wake up from idle mode when the application schedules it.
+    int wakeup_timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (wakeup_timer_fd == -1) {
+        printf ("Could not create wakeup timer: %s\n", strerror(errno));
+    }
+
+#ifdef CAIRO_SHM_BACKEND
+    x11_shm_presenter_init (x_st, &x11_shm_presenter);
+#endif
+
+    if (!x11_event_thread_start (&x11_event_thread, x_st, graphics.width, graphics.height)) {
+        return -1;
+    }
+    uint32_t last_expose_serial = 0;
+    uint32_t last_sync_request_serial = 0;
 
     while (!st->end_execution) {
-        while ((event = xcb_poll_for_event (x_st->xcb_c))) {
-            // NOTE: The most significant bit of event->response_type is set if
-            // the event was generated from a SendEvent request, here we don't
-            // care about the source of the event.
-            switch (event->response_type & ~0x80) {
-                case XCB_CONFIGURE_NOTIFY:
-                    {
-                        graphics.width = ((xcb_configure_notify_event_t*)event)->width;
-                        graphics.height = ((xcb_configure_notify_event_t*)event)->height;
-                    } break;
-                case XCB_MOTION_NOTIFY:
-                    {
-                        x_st->last_timestamp = ((xcb_motion_notify_event_t*)event)->time;
-                        app_input.ptr.x = ((xcb_motion_notify_event_t*)event)->event_x;
-                        app_input.ptr.y = ((xcb_motion_notify_event_t*)event)->event_y;
-                    } break;
-                case XCB_KEY_PRESS:
-                    {
-                        x_st->last_timestamp = ((xcb_key_press_event_t*)event)->time;
-                        app_input.keycode = ((xcb_key_press_event_t*)event)->detail;
-                        app_input.modifiers = ((xcb_key_press_event_t*)event)->state;
-                    } break;
-                case XCB_EXPOSE:
-                    {
-                        // We should tell which areas need exposing
-                        app_input.force_redraw = true;
-                        force_blit = true;
-                    } break;
-                case XCB_BUTTON_PRESS:
-                    {
-                       x_st->last_timestamp = ((xcb_key_press_event_t*)event)->time;
-                       char button_pressed = ((xcb_key_press_event_t*)event)->detail;
-                       if (button_pressed == 4) {
-                           app_input.wheel *= 1.2;
-                       } else if (button_pressed == 5) {
-                           app_input.wheel /= 1.2;
-                       } else if (button_pressed >= 1 && button_pressed <= 3) {
-                           app_input.mouse_down[button_pressed-1] = 1;
-                       }
-                    } break;
-                case XCB_BUTTON_RELEASE:
-                    {
-                        x_st->last_timestamp = ((xcb_key_press_event_t*)event)->time;
-                        // NOTE: This loses clicks if the button press-release
-                        // sequence happens in the same batch of events, right now
-                        // it does not seem to be a problem.
-                        char button_pressed = ((xcb_key_press_event_t*)event)->detail;
-                        if (button_pressed >= 1 && button_pressed <= 3) {
-                            app_input.mouse_down[button_pressed-1] = 0;
-                        }
-                    } break;
-                case XCB_CLIENT_MESSAGE:
-                    {
-                        bool handled = false;
-                        xcb_client_message_event_t *client_message = ((xcb_client_message_event_t*)event);
-
-                        // WM_DELETE_WINDOW protocol
-                        if (client_message->type == xcb_atoms_cache[LOC_ATOM_WM_PROTOCOLS]) {
-                            if (client_message->data.data32[0] == xcb_atoms_cache[LOC_ATOM_WM_DELETE_WINDOW]) {
-                                st->end_execution = true;
-                            }
-                            handled = true;
-                        }
-
-                        // _NET_WM_SYNC_REQUEST protocol using the extended mode
-                        if (client_message->type == xcb_atoms_cache[LOC_ATOM_WM_PROTOCOLS] &&
-                            client_message->data.data32[0] == xcb_atoms_cache[LOC_ATOM__NET_WM_SYNC_REQUEST]) {
-
-                            x_st->counter_val.lo = client_message->data.data32[2];
-                            x_st->counter_val.hi = client_message->data.data32[3];
-                            if (x_st->counter_val.lo % 2 != 0) {
-                                increment_sync_counter (&x_st->counter_val);
-                            }
-                            handled = true;
-                        } else if (client_message->type == xcb_atoms_cache[LOC_ATOM__NET_WM_FRAME_DRAWN]) {
-                            handled = true;
-                        } else if (client_message->type == xcb_atoms_cache[LOC_ATOM__NET_WM_FRAME_TIMINGS]) {
-                            handled = true;
-                        }
-
-                        if (!handled) {
-                            printf ("Unrecognized Client Message: %s\n",
-                                    get_x11_atom_name (x_st->xcb_c,
-                                                       client_message->type,
-                                                       &x_st->transient_pool));
-                        }
-                    } break;
-                case XCB_PROPERTY_NOTIFY:
-                    {
-                        x_st->last_timestamp = ((xcb_property_notify_event_t*)event)->time;
-                    } break;
-                case 0:
-                    { // XCB_ERROR
-                        xcb_generic_error_t *error = (xcb_generic_error_t*)event;
-                        printf("Received X11 error %d\n", error->error_code);
-                    } break;
-                default:
-                    /* Unknown event type, ignore it */
-                    break;
-            }
-            free (event);
+        // Idle mode: nothing is animating so instead of waking up every frame
+        // we sleep until there is input or a scheduled wakeup.
+        float idle_time_ms = 0;
+        if (st->idle) {
+            x11_set_wakeup_timer (wakeup_timer_fd, st->wakeup_ms);
+            xcb_flush (x_st->xcb_c);
+            x11_wait_for_wakeup (x11_event_thread.wakeup_fd, wakeup_timer_fd);
+
+            clock_gettime (CLOCK_MONOTONIC, &end_ticks);
+            idle_time_ms = time_elapsed_in_ms (&start_ticks, &end_ticks);
+            start_ticks = end_ticks;
         }
 
-        x11_notify_start_of_frame (x_st);
+        // NOTE: Clear the eventfd before reading what the event thread
+        // published, anything published after this will wake us up again.
+        uint64_t wakeup_count;
+        if (read (x11_event_thread.wakeup_fd, &wakeup_count, sizeof(wakeup_count)) == -1 &&
+            errno != EAGAIN) {
+            printf ("Error reading event thread wakeup: %s\n", strerror(errno));
+        }
+
+        // Only the latest window state matters, intermediate sizes of a resize
+        // that happened while we were rendering are skipped.
+        struct x11_window_state_t *win_st =
+            (struct x11_window_state_t*)triple_buffer_read (&x11_event_thread.window_state);
+        graphics.width = win_st->width;
+        graphics.height = win_st->height;
+
+        if (win_st->expose_serial != last_expose_serial) {
+            last_expose_serial = win_st->expose_serial;
+            app_input.force_redraw = true;
+            force_blit = true;
+        }
+
+        if (win_st->sync_request_serial != last_sync_request_serial) {
+            last_sync_request_serial = win_st->sync_request_serial;
+            x_st->counter_val = win_st->sync_counter_val;
+
+            // The WM is waiting for us to draw a frame, make sure we do even
+            // if the application is idle.
+            x_st->sync_request_pending = true;
+            app_input.force_redraw = true;
+            force_blit = true;
+        }
+
+        if (win_st->close_requested) {
+            st->end_execution = true;
+        }
+
+        struct input_event_t input_event;
+        while (spsc_ring_pop (&x11_event_thread.input_ring, &input_event)) {
+            input_event_push (&app_input, &x_st->transient_pool, &input_event);
+        }
 
         // TODO: How bad is this? should we actually measure it?
-        app_input.time_elapsed_ms = target_frame_length_ms;
+        app_input.time_elapsed_ms = target_frame_length_ms + idle_time_ms;
+
+#ifdef CAIRO_SHM_BACKEND
+        // NOTE: The server may have discarded exposed contents, present the
+        // whole window again.
+        if (force_blit) {
+            gui_damage_all (&st->gui_st);
+            force_blit = false;
+        }
 
+        graphics.cr = x11_shm_presenter_begin_frame (x_st, &x11_shm_presenter, &st->gui_st,
+                                                     graphics.width, graphics.height);
+        update_and_render (st, &graphics, app_input);
+
+        // NOTE: A frame reaches the window with the ShmPutImage requests of
+        // its damage, that's what we bracket with the frame counter. Frames
+        // without damage are not presented.
+        if (graphics.cr != NULL && gui_has_damage (&st->gui_st)) {
+            x11_notify_start_of_frame (x_st);
+            x11_shm_presenter_end_frame (x_st, &x11_shm_presenter, &st->gui_st);
+            x11_notify_end_of_frame (x_st);
+        }
+#else
         bool blit_needed = update_and_render (st, &graphics, app_input);
+#endif
+
+        struct gui_state_t *gui_st = &st->gui_st;
+        if (gui_st->clipboard_request == CLIPBOARD_REQUEST_COPY) {
+            x11_clipboard_copy (x_st, gui_st->clipboard_offer, gui_st->clipboard_offer_len);
+        } else if (gui_st->clipboard_request == CLIPBOARD_REQUEST_PASTE) {
+            x11_clipboard_paste (x_st, win_st->last_timestamp);
+        }
+        gui_st->clipboard_request = CLIPBOARD_REQUEST_NONE;
 
+        // NOTE: GL commands are only guaranteed to reach the window at
+        // glXSwapBuffers(), so that's what we bracket with the frame counter.
+        // This way frames where the application had nothing to draw don't
+        // touch the sync counters at all.
+#ifndef CAIRO_SHM_BACKEND
         if (blit_needed || force_blit) {
+            x11_notify_start_of_frame (x_st);
             glXSwapBuffers(x_st->xlib_dpy, glX_window);
+            x11_notify_end_of_frame (x_st);
             force_blit = false;
         }
-
-        x11_notify_end_of_frame (x_st);
+#endif
+
+        if (first_frame) {
+            // NOTE: This includes shader compilation and framebuffer setup
+            // that happen inside the first call to update_and_render().
+            phase_profile_mark (&startup_profile, "First frame");
+            phase_profile_print (&startup_profile, "Cold start to first frame");
+            phase_profile_print_offset (&startup_worker.profile, "Startup thread",
+                                        startup_worker_offset_ms);
+            first_frame = false;
+        }
 
         clock_gettime (CLOCK_MONOTONIC, &end_ticks);
         float time_elapsed = time_elapsed_in_ms (&start_ticks, &end_ticks);
-        if (time_elapsed < target_frame_length_ms) {
+        if (st->idle) {
+            // We will block waiting for events, no need to sleep.
+        } else if (time_elapsed < target_frame_length_ms) {
             struct timespec sleep_ticks;
             sleep_ticks.tv_sec = 0;
             sleep_ticks.tv_nsec = (long)((target_frame_length_ms-time_elapsed)*1000000);
@@ -998,15 +2433,25 @@ int main (void)
         start_ticks = end_ticks;
 
         xcb_flush (x_st->xcb_c);
-        app_input.keycode = 0;
-        app_input.wheel = 1;
         app_input.force_redraw = 0;
+        input_queue_clear (&app_input);
         mem_pool_end_temporary_memory (x_st->transient_pool_flush);
     }
 
+    if (wakeup_timer_fd != -1) {
+        close (wakeup_timer_fd);
+    }
+
+    x11_event_thread_stop (&x11_event_thread);
+#ifdef CAIRO_SHM_BACKEND
+    x11_shm_presenter_destroy (x_st, &x11_shm_presenter);
+#endif
+
+#ifndef CAIRO_SHM_BACKEND
     glXDestroyWindow(x_st->xlib_dpy, glX_window);
-    xcb_destroy_window(x_st->xcb_c, x_st->window);
     glXDestroyContext (x_st->xlib_dpy, gl_context);
+#endif
+    xcb_destroy_window(x_st->xcb_c, x_st->window);
     XCloseDisplay (x_st->xlib_dpy);
 
     // NOTE: Even though we try to clean everything up Valgrind complains a